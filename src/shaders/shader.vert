@@ -2,24 +2,31 @@
 #extension GL_ARB_separate_shader_objects : enable
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
     mat4 view;
     mat4 proj;
+    vec4 posScale;
+    vec4 posOffset;
 } ubo;
 
+// Model matrix of each object, selected by the instance index: the
+// instances of an instanced draw, or firstInstance of a per-object draw
+layout(std430, binding = 2) readonly buffer Instances {
+    mat4 model[];
+} instances;
+
+// Packed vertex: unorm16 position relative to the mesh bounding box and
+// half float texture coordinates
 layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inColor;
-layout(location = 2) in vec2 inTexCoord;
+layout(location = 1) in vec2 inTexCoord;
 
-layout(location = 0) out vec3 fragColor;
-layout(location = 1) out vec2 fragTexCoord;
+layout(location = 0) out vec2 fragTexCoord;
 
 out gl_PerVertex {
     vec4 gl_Position;
 };
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
-    fragColor = inColor;
+    vec3 position = inPosition * ubo.posScale.xyz + ubo.posOffset.xyz;
+    gl_Position = ubo.proj * ubo.view * instances.model[gl_InstanceIndex] * vec4(position, 1.0);
     fragTexCoord = inTexCoord;
 }
@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include "vk-allocator.h"
+
+/* Size of the blocks sub-allocated, capped to 1/8 of small heaps */
+static const VkDeviceSize DEFAULT_BLOCK_SIZE = 64ull << 20;
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+/* Whether the last byte of a resource ending at end and the first one of a
+ * resource starting at start share a bufferImageGranularity page.
+ */
+static bool samePage(VkDeviceSize end, VkDeviceSize start, VkDeviceSize granularity)
+{
+  return (end - 1) / granularity == start / granularity;
+}
+
+void DeviceAllocator::init(VkPhysicalDevice phyDevice, VkDevice dev)
+{
+  device = dev;
+  vkGetPhysicalDeviceMemoryProperties(phyDevice, &memProperties);
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(phyDevice, &properties);
+  granularity = std::max<VkDeviceSize>(properties.limits.bufferImageGranularity, 1);
+  maxAllocations = properties.limits.maxMemoryAllocationCount;
+}
+
+void DeviceAllocator::destroy()
+{
+  for (Pool &pool : pools) {
+    for (Block &block : pool.blocks) {
+      if (block.memory == VK_NULL_HANDLE)
+        continue;
+      if (block.allocations)
+        printf("Memory block of type %u freed with %u live allocations\n", pool.memoryType, block.allocations);
+      vkFreeMemory(device, block.memory, VK_NULL_HANDLE);
+    }
+  }
+  pools.clear();
+  deviceAllocations = 0;
+}
+
+uint32_t DeviceAllocator::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const
+{
+  for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+    if ((typeFilter & (1 << i)) &&
+        (memProperties.memoryTypes[i].propertyFlags & properties) == properties)
+      return i;
+  }
+
+  throw std::runtime_error("Error finding suitable memory type");
+}
+
+VkDeviceSize DeviceAllocator::blockSizeFor(uint32_t memoryType) const
+{
+  VkDeviceSize heapSize = memProperties.memoryHeaps[memProperties.memoryTypes[memoryType].heapIndex].size;
+  return std::min(DEFAULT_BLOCK_SIZE, alignUp(heapSize / 8, granularity));
+}
+
+uint32_t DeviceAllocator::createBlock(Pool &pool, VkDeviceSize size, bool dedicated)
+{
+  if (maxAllocations && deviceAllocations >= maxAllocations)
+    throw std::runtime_error("Error allocating memory: maxMemoryAllocationCount reached");
+
+  Block block = {};
+  block.size = size;
+  block.dedicated = dedicated;
+
+  VkMemoryAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = size;
+  allocInfo.memoryTypeIndex = pool.memoryType;
+
+  VkResult res = vkAllocateMemory(device, &allocInfo, VK_NULL_HANDLE, &block.memory);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error allocating device memory block");
+  deviceAllocations++;
+
+  /* Host visible blocks stay mapped, a memory object can't be mapped twice */
+  if (memProperties.memoryTypes[pool.memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    res = vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mapped);
+    if (res != VK_SUCCESS)
+      throw std::runtime_error("Error mapping device memory block");
+  }
+
+  Range range = { 0, size, true, RESOURCE_LINEAR };
+  block.ranges.push_back(range);
+
+  /* Reuse the slot of a released block, allocations refer to them by index */
+  for (uint32_t i = 0; i < pool.blocks.size(); i++) {
+    if (pool.blocks[i].memory == VK_NULL_HANDLE) {
+      pool.blocks[i] = block;
+      return i;
+    }
+  }
+  pool.blocks.push_back(block);
+  return (uint32_t) pool.blocks.size() - 1;
+}
+
+bool DeviceAllocator::allocateFreeList(Block &block, const VkMemoryRequirements &requirements,
+                                       ResourceKind kind, VkDeviceSize &offset)
+{
+  size_t best = block.ranges.size();
+  VkDeviceSize bestStart = 0;
+
+  for (size_t i = 0; i < block.ranges.size(); i++) {
+    const Range &range = block.ranges[i];
+    if (!range.free || range.size < requirements.size)
+      continue;
+
+    VkDeviceSize start = alignUp(range.offset, requirements.alignment);
+    if (i > 0) {
+      const Range &prev = block.ranges[i - 1];
+      if (prev.kind != kind && samePage(prev.offset + prev.size, start, granularity))
+        start = alignUp(start, granularity);
+    }
+
+    VkDeviceSize end = start + requirements.size;
+    if (end > range.offset + range.size)
+      continue;
+
+    if (i + 1 < block.ranges.size()) {
+      const Range &next = block.ranges[i + 1];
+      if (next.kind != kind && samePage(end, next.offset, granularity))
+        continue;
+    }
+
+    /* Best fit: the smallest free range that works */
+    if (best == block.ranges.size() || range.size < block.ranges[best].size) {
+      best = i;
+      bestStart = start;
+    }
+  }
+
+  if (best == block.ranges.size())
+    return false;
+
+  Range range = block.ranges[best];
+  std::vector<Range> split;
+  if (bestStart > range.offset)
+    split.push_back({ range.offset, bestStart - range.offset, true, RESOURCE_LINEAR });
+  split.push_back({ bestStart, requirements.size, false, kind });
+  VkDeviceSize end = bestStart + requirements.size;
+  if (end < range.offset + range.size)
+    split.push_back({ end, range.offset + range.size - end, true, RESOURCE_LINEAR });
+
+  block.ranges.erase(block.ranges.begin() + best);
+  block.ranges.insert(block.ranges.begin() + best, split.begin(), split.end());
+
+  offset = bestStart;
+  return true;
+}
+
+bool DeviceAllocator::allocateLinear(Block &block, const VkMemoryRequirements &requirements,
+                                     ResourceKind kind, VkDeviceSize &offset)
+{
+  VkDeviceSize start = alignUp(block.top, requirements.alignment);
+  if (block.allocations && block.topKind != kind && samePage(block.top, start, granularity))
+    start = alignUp(start, granularity);
+
+  if (start + requirements.size > block.size)
+    return false;
+
+  block.top = start + requirements.size;
+  block.topKind = kind;
+  offset = start;
+  return true;
+}
+
+MemoryAllocation DeviceAllocator::allocate(const VkMemoryRequirements &requirements,
+                                           VkMemoryPropertyFlags properties,
+                                           ResourceKind kind, AllocationStrategy strategy)
+{
+  uint32_t memoryType = findMemoryType(requirements.memoryTypeBits, properties);
+
+  uint32_t poolIndex = 0;
+  while (poolIndex < pools.size() &&
+         (pools[poolIndex].memoryType != memoryType || pools[poolIndex].strategy != strategy))
+    poolIndex++;
+  if (poolIndex == pools.size()) {
+    Pool pool;
+    pool.memoryType = memoryType;
+    pool.strategy = strategy;
+    pools.push_back(pool);
+  }
+  Pool &pool = pools[poolIndex];
+
+  VkDeviceSize blockSize = blockSizeFor(memoryType);
+  bool dedicated = requirements.size > blockSize / 2;
+
+  uint32_t blockIndex = (uint32_t) pool.blocks.size();
+  VkDeviceSize offset = 0;
+  if (!dedicated) {
+    for (uint32_t i = 0; i < pool.blocks.size(); i++) {
+      Block &block = pool.blocks[i];
+      if (block.memory == VK_NULL_HANDLE || block.dedicated)
+        continue;
+
+      bool found = strategy == ALLOCATION_LINEAR ?
+                   allocateLinear(block, requirements, kind, offset) :
+                   allocateFreeList(block, requirements, kind, offset);
+      if (found) {
+        blockIndex = i;
+        break;
+      }
+    }
+  }
+
+  if (blockIndex == pool.blocks.size()) {
+    blockIndex = createBlock(pool, dedicated ? requirements.size : blockSize, dedicated);
+    Block &block = pool.blocks[blockIndex];
+    bool found = strategy == ALLOCATION_LINEAR ?
+                 allocateLinear(block, requirements, kind, offset) :
+                 allocateFreeList(block, requirements, kind, offset);
+    if (!found)
+      throw std::runtime_error("Error sub-allocating device memory");
+  }
+
+  Block &block = pool.blocks[blockIndex];
+  block.allocations++;
+
+  MemoryAllocation allocation;
+  allocation.memory = block.memory;
+  allocation.offset = offset;
+  allocation.size = requirements.size;
+  allocation.mapped = block.mapped ? static_cast<char *>(block.mapped) + offset : nullptr;
+  allocation.pool = poolIndex;
+  allocation.block = blockIndex;
+  return allocation;
+}
+
+void DeviceAllocator::free(MemoryAllocation &allocation)
+{
+  if (allocation.memory == VK_NULL_HANDLE)
+    return;
+
+  Pool &pool = pools[allocation.pool];
+  Block &block = pool.blocks[allocation.block];
+
+  if (pool.strategy == ALLOCATION_FREE_LIST) {
+    auto it = std::lower_bound(block.ranges.begin(), block.ranges.end(), allocation.offset,
+                               [](const Range &range, VkDeviceSize offset) { return range.offset < offset; });
+    if (it == block.ranges.end() || it->offset != allocation.offset || it->free)
+      throw std::runtime_error("Error freeing unknown device memory allocation");
+
+    /* Coalesce with the free neighbours */
+    it->free = true;
+    it->kind = RESOURCE_LINEAR;
+    if (it + 1 != block.ranges.end() && (it + 1)->free) {
+      it->size += (it + 1)->size;
+      block.ranges.erase(it + 1);
+    }
+    if (it != block.ranges.begin() && (it - 1)->free) {
+      (it - 1)->size += it->size;
+      block.ranges.erase(it);
+    }
+  }
+
+  if (--block.allocations == 0) {
+    block.top = 0;
+    releaseBlock(pool, allocation.block);
+  }
+
+  allocation = MemoryAllocation();
+}
+
+void DeviceAllocator::releaseBlock(Pool &pool, uint32_t index)
+{
+  /* Keep one empty block around, so that a resource recreated right after
+   * being destroyed (e.g. on resize) doesn't go back to the driver.
+   */
+  bool keep = !pool.blocks[index].dedicated;
+  for (uint32_t i = 0; keep && i < pool.blocks.size(); i++) {
+    const Block &block = pool.blocks[i];
+    if (i != index && block.memory != VK_NULL_HANDLE && !block.dedicated && block.allocations == 0)
+      keep = false;
+  }
+  if (keep)
+    return;
+
+  vkFreeMemory(device, pool.blocks[index].memory, VK_NULL_HANDLE);
+  pool.blocks[index] = Block();
+  deviceAllocations--;
+}
+
+void DeviceAllocator::createBuffer(const VkBufferCreateInfo &createInfo, VkMemoryPropertyFlags properties,
+                                   VkBuffer &buffer, MemoryAllocation &allocation,
+                                   AllocationStrategy strategy)
+{
+  VkResult res = vkCreateBuffer(device, &createInfo, VK_NULL_HANDLE, &buffer);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating buffer");
+
+  VkMemoryRequirements memRequirements;
+  vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+
+  allocation = allocate(memRequirements, properties, RESOURCE_LINEAR, strategy);
+  vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
+}
+
+void DeviceAllocator::createImage(const VkImageCreateInfo &createInfo, VkMemoryPropertyFlags properties,
+                                  VkImage &image, MemoryAllocation &allocation)
+{
+  VkResult res = vkCreateImage(device, &createInfo, VK_NULL_HANDLE, &image);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating image");
+
+  VkMemoryRequirements memRequirements;
+  vkGetImageMemoryRequirements(device, image, &memRequirements);
+
+  ResourceKind kind = createInfo.tiling == VK_IMAGE_TILING_OPTIMAL ? RESOURCE_OPTIMAL : RESOURCE_LINEAR;
+  allocation = allocate(memRequirements, properties, kind);
+  vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+}
+
+AllocatorStats DeviceAllocator::poolStats(const Pool &pool) const
+{
+  AllocatorStats stats = {};
+
+  for (const Block &block : pool.blocks) {
+    if (block.memory == VK_NULL_HANDLE)
+      continue;
+
+    stats.deviceAllocations++;
+    stats.allocations += block.allocations;
+    stats.blockBytes += block.size;
+    if (pool.strategy == ALLOCATION_LINEAR) {
+      /* Freed ranges of a linear block are not reusable until it's empty */
+      stats.usedBytes += block.top;
+      stats.freeBytes += block.size - block.top;
+      stats.largestFreeRange = std::max(stats.largestFreeRange, block.size - block.top);
+      continue;
+    }
+
+    for (const Range &range : block.ranges) {
+      if (range.free) {
+        stats.freeBytes += range.size;
+        stats.largestFreeRange = std::max(stats.largestFreeRange, range.size);
+      } else {
+        stats.usedBytes += range.size;
+      }
+    }
+  }
+  return stats;
+}
+
+AllocatorStats DeviceAllocator::stats() const
+{
+  AllocatorStats total = {};
+
+  for (const Pool &pool : pools) {
+    AllocatorStats stats = poolStats(pool);
+    total.deviceAllocations += stats.deviceAllocations;
+    total.allocations += stats.allocations;
+    total.blockBytes += stats.blockBytes;
+    total.usedBytes += stats.usedBytes;
+    total.freeBytes += stats.freeBytes;
+    total.largestFreeRange = std::max(total.largestFreeRange, stats.largestFreeRange);
+  }
+  return total;
+}
+
+void DeviceAllocator::printStats() const
+{
+  AllocatorStats total = stats();
+  printf("Device memory: %u allocations in %u device allocations (limit %u), %.1f MB used of %.1f MB\n",
+         total.allocations, total.deviceAllocations, maxAllocations,
+         total.usedBytes / (1024.0 * 1024.0), total.blockBytes / (1024.0 * 1024.0));
+
+  for (const Pool &pool : pools) {
+    AllocatorStats stats = poolStats(pool);
+    /* 0% when all the free memory is in one range, close to 100% when it
+     * is scattered in small ranges.
+     */
+    double fragmentation = stats.freeBytes ?
+                           1.0 - (double) stats.largestFreeRange / stats.freeBytes : 0.0;
+    printf("  memory type %u (%s): %u blocks, %u allocations, %.1f MB used of %.1f MB (%.1f%%), "
+           "fragmentation %.1f%%\n",
+           pool.memoryType, pool.strategy == ALLOCATION_LINEAR ? "linear" : "free list",
+           stats.deviceAllocations, stats.allocations,
+           stats.usedBytes / (1024.0 * 1024.0), stats.blockBytes / (1024.0 * 1024.0),
+           stats.blockBytes ? 100.0 * stats.usedBytes / stats.blockBytes : 0.0, 100.0 * fragmentation);
+  }
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <vector>
+
+/* Kind of resource bound to an allocation. Linear resources (buffers) and
+ * optimally tiled images can't share a bufferImageGranularity page.
+ */
+enum ResourceKind {
+  RESOURCE_LINEAR,
+  RESOURCE_OPTIMAL,
+};
+
+enum AllocationStrategy {
+  /* Best-fit in a list of free ranges, coalesced when freed */
+  ALLOCATION_FREE_LIST,
+  /* Bump allocation for short-lived resources. The block is only reused
+   * once all of its allocations have been freed.
+   */
+  ALLOCATION_LINEAR,
+};
+
+/* Range of a device memory block. mapped points to the range when the
+ * memory is host visible, blocks are persistently mapped.
+ */
+struct MemoryAllocation {
+  VkDeviceMemory   memory = VK_NULL_HANDLE;
+  VkDeviceSize     offset = 0;
+  VkDeviceSize     size = 0;
+  void            *mapped = nullptr;
+  uint32_t         pool = 0;
+  uint32_t         block = 0;
+};
+
+struct AllocatorStats {
+  uint32_t         deviceAllocations;
+  uint32_t         allocations;
+  VkDeviceSize     blockBytes;
+  VkDeviceSize     usedBytes;
+  VkDeviceSize     freeBytes;
+  VkDeviceSize     largestFreeRange;
+};
+
+/* Sub-allocates device memory from big blocks, one set of blocks per memory
+ * type and strategy, instead of one vkAllocateMemory per resource.
+ * Allocations bigger than half a block get a dedicated block.
+ */
+class DeviceAllocator {
+ public:
+  void             init(VkPhysicalDevice phyDevice, VkDevice device);
+  void             destroy();
+
+  MemoryAllocation allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags properties,
+                            ResourceKind kind, AllocationStrategy strategy = ALLOCATION_FREE_LIST);
+  void             free(MemoryAllocation &allocation);
+
+  /* Creates a resource and binds it to a new allocation */
+  void             createBuffer(const VkBufferCreateInfo &createInfo, VkMemoryPropertyFlags properties,
+                                VkBuffer &buffer, MemoryAllocation &allocation,
+                                AllocationStrategy strategy = ALLOCATION_FREE_LIST);
+  void             createImage(const VkImageCreateInfo &createInfo, VkMemoryPropertyFlags properties,
+                               VkImage &image, MemoryAllocation &allocation);
+
+  AllocatorStats   stats() const;
+  void             printStats() const;
+
+ private:
+  struct Range {
+    VkDeviceSize   offset;
+    VkDeviceSize   size;
+    bool           free;
+    ResourceKind   kind;
+  };
+
+  struct Block {
+    VkDeviceMemory memory;
+    VkDeviceSize   size;
+    void          *mapped;
+    /* Free-list blocks: ranges sorted by offset, covering the whole block */
+    std::vector<Range> ranges;
+    /* Linear blocks: next free offset and kind of the last allocation */
+    VkDeviceSize   top;
+    ResourceKind   topKind;
+    uint32_t       allocations;
+    bool           dedicated;
+  };
+
+  struct Pool {
+    uint32_t       memoryType;
+    AllocationStrategy strategy;
+    std::vector<Block> blocks;
+  };
+
+  AllocatorStats   poolStats(const Pool &pool) const;
+  uint32_t         findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const;
+  VkDeviceSize     blockSizeFor(uint32_t memoryType) const;
+  uint32_t         createBlock(Pool &pool, VkDeviceSize size, bool dedicated);
+  bool             allocateFreeList(Block &block, const VkMemoryRequirements &requirements,
+                                    ResourceKind kind, VkDeviceSize &offset);
+  bool             allocateLinear(Block &block, const VkMemoryRequirements &requirements,
+                                  ResourceKind kind, VkDeviceSize &offset);
+  void             releaseBlock(Pool &pool, uint32_t index);
+
+  VkDevice         device = VK_NULL_HANDLE;
+  VkPhysicalDeviceMemoryProperties memProperties;
+  VkDeviceSize     granularity = 1;
+  uint32_t         maxAllocations = 0;
+  uint32_t         deviceAllocations = 0;
+  std::vector<Pool> pools;
+};
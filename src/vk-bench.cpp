@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "vk-bench.h"
+
+unsigned BenchStats::addSeries(const std::string &name)
+{
+  names.push_back(name);
+  samples.resize(names.size());
+  return (unsigned) names.size() - 1;
+}
+
+void BenchStats::addSample(unsigned series, double value)
+{
+  samples[series].push_back(value);
+}
+
+void BenchStats::clear()
+{
+  for (auto &series : samples)
+    series.clear();
+}
+
+/* Nearest-rank percentile over sorted samples */
+static double percentile(const std::vector<double> &sorted, double p)
+{
+  size_t rank = (size_t) std::ceil(p / 100.0 * sorted.size());
+  return sorted[std::min(std::max(rank, (size_t) 1), sorted.size()) - 1];
+}
+
+BenchSummary BenchStats::summary(unsigned series) const
+{
+  BenchSummary result = {};
+  std::vector<double> sorted = samples[series];
+
+  result.count = sorted.size();
+  if (sorted.empty())
+    return result;
+
+  std::sort(sorted.begin(), sorted.end());
+
+  double sum = 0.0;
+  for (double value : sorted)
+    sum += value;
+
+  result.min = sorted.front();
+  result.mean = sum / sorted.size();
+  result.p50 = percentile(sorted, 50.0);
+  result.p95 = percentile(sorted, 95.0);
+  result.p99 = percentile(sorted, 99.0);
+  result.max = sorted.back();
+  return result;
+}
+
+void BenchStats::print() const
+{
+  printf("%-20s %8s %9s %9s %9s %9s %9s %9s\n",
+         "(ms)", "count", "min", "mean", "p50", "p95", "p99", "max");
+  for (unsigned i = 0; i < names.size(); i++) {
+    BenchSummary s = summary(i);
+    printf("%-20s %8zu %9.4f %9.4f %9.4f %9.4f %9.4f %9.4f\n",
+           names[i].c_str(), s.count, s.min, s.mean, s.p50, s.p95, s.p99, s.max);
+  }
+}
+
+/* JSON string contents: quotes, backslashes and control characters escaped */
+static std::string jsonEscape(const std::string &value)
+{
+  std::string escaped;
+  for (char c : value) {
+    switch (c) {
+    case '"':
+      escaped += "\\\"";
+      break;
+    case '\\':
+      escaped += "\\\\";
+      break;
+    case '\n':
+      escaped += "\\n";
+      break;
+    case '\t':
+      escaped += "\\t";
+      break;
+    default:
+      if ((unsigned char) c < 0x20) {
+        char code[8];
+        snprintf(code, sizeof(code), "\\u%04x", (unsigned) c);
+        escaped += code;
+      } else {
+        escaped += c;
+      }
+    }
+  }
+  return escaped;
+}
+
+void BenchStats::writeJson(const std::string &filename,
+                           const std::vector<std::pair<std::string, std::string>> &info) const
+{
+  FILE *file = fopen(filename.c_str(), "w");
+  if (!file)
+    throw std::runtime_error("Error opening " + filename);
+
+  fprintf(file, "{\n");
+  for (const auto &entry : info)
+    fprintf(file, "  \"%s\": \"%s\",\n", jsonEscape(entry.first).c_str(), jsonEscape(entry.second).c_str());
+
+  fprintf(file, "  \"unit\": \"ms\",\n");
+  fprintf(file, "  \"series\": {");
+  for (unsigned i = 0; i < names.size(); i++) {
+    BenchSummary s = summary(i);
+    fprintf(file, "%s\n    \"%s\": { \"count\": %zu, \"min\": %.6f, \"mean\": %.6f, "
+            "\"p50\": %.6f, \"p95\": %.6f, \"p99\": %.6f, \"max\": %.6f }",
+            i ? "," : "", jsonEscape(names[i]).c_str(), s.count, s.min, s.mean, s.p50, s.p95, s.p99, s.max);
+  }
+  fprintf(file, "\n  }\n}\n");
+  fclose(file);
+
+  printf("Benchmark results written to %s\n", filename.c_str());
+}
+
+void BenchStats::writeCsv(const std::string &filename) const
+{
+  FILE *file = fopen(filename.c_str(), "w");
+  if (!file)
+    throw std::runtime_error("Error opening " + filename);
+
+  fprintf(file, "series,count,min_ms,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n");
+  for (unsigned i = 0; i < names.size(); i++) {
+    BenchSummary s = summary(i);
+    fprintf(file, "%s,%zu,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n",
+            names[i].c_str(), s.count, s.min, s.mean, s.p50, s.p95, s.p99, s.max);
+  }
+  fclose(file);
+
+  printf("Benchmark results written to %s\n", filename.c_str());
+}
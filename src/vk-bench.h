@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef std::chrono::steady_clock BenchClock;
+
+/* Milliseconds elapsed between two time points */
+inline double elapsedMs(BenchClock::time_point start, BenchClock::time_point end)
+{
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+struct BenchSummary {
+  size_t   count;
+  double   min;
+  double   mean;
+  double   p50;
+  double   p95;
+  double   p99;
+  double   max;
+};
+
+/* Collects samples (in milliseconds) of several named series and reports
+ * their distribution. Each series keeps its own samples, so series that are
+ * not sampled every frame (e.g. asynchronously resolved GPU timings) can live
+ * next to the per-frame CPU ones.
+ */
+class BenchStats {
+ public:
+  unsigned     addSeries(const std::string &name);
+  void         addSample(unsigned series, double value);
+  void         clear();
+
+  BenchSummary summary(unsigned series) const;
+  void         print() const;
+  /* info holds extra key/value pairs describing the run (device, size...) */
+  void         writeJson(const std::string &filename,
+                         const std::vector<std::pair<std::string, std::string>> &info) const;
+  void         writeCsv(const std::string &filename) const;
+
+ private:
+  std::vector<std::string>          names;
+  std::vector<std::vector<double>>  samples;
+};
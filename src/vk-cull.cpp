@@ -0,0 +1,300 @@
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+
+#include "vk-cull.h"
+#include "vk-bench.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CULL_X86 1
+#include <immintrin.h>
+#else
+#define CULL_X86 0
+#endif
+
+/* Spheres tested per iteration of the SIMD paths, and array padding */
+static const size_t CULL_BATCH = 8;
+/* Below this many spheres per thread, splitting costs more than it saves */
+static const size_t CULL_JOB_SPHERES = 16384;
+/* Minimum measuring time of each --bench-cull case */
+static const double CULL_BENCH_MIN_MS = 100.0;
+
+Frustum frustumFromMatrix(const glm::mat4 &viewProj)
+{
+  /* Left, right, bottom, top, near and far from the rows of the matrix */
+  glm::vec4 rows[4];
+  for (int i = 0; i < 4; i++)
+    rows[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i]);
+  glm::vec4 planes[6] = {rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1],
+                         rows[2], rows[3] - rows[2]};
+
+  Frustum frustum;
+  for (int i = 0; i < 6; i++)
+    frustum.planes[i] = planes[i] / glm::length(glm::vec3(planes[i]));
+  return frustum;
+}
+
+/* Appends the index of every sphere of the batch at base whose bit is set */
+static inline size_t appendVisible(unsigned mask, size_t base, uint32_t *visible, size_t found)
+{
+  while (mask) {
+    visible[found++] = (uint32_t) (base + __builtin_ctz(mask));
+    mask &= mask - 1;
+  }
+  return found;
+}
+
+static size_t cullScalar(const float *x, const float *y, const float *z, const float *r,
+                         const Frustum &frustum, size_t first, size_t last, uint32_t *visible)
+{
+  size_t found = 0;
+  for (size_t i = first; i < last; i++) {
+    bool inside = true;
+    for (int p = 0; p < 6; p++) {
+      const glm::vec4 &plane = frustum.planes[p];
+      inside &= plane.x * x[i] + plane.y * y[i] + plane.z * z[i] + plane.w + r[i] >= 0.0f;
+    }
+    /* Always written, only kept if inside */
+    visible[found] = (uint32_t) i;
+    found += inside;
+  }
+  return found;
+}
+
+#if CULL_X86
+__attribute__((target("sse2")))
+static size_t cullSse(const float *x, const float *y, const float *z, const float *r,
+                      const Frustum &frustum, size_t first, size_t last, uint32_t *visible)
+{
+  __m128 px[6], py[6], pz[6], pw[6];
+  for (int p = 0; p < 6; p++) {
+    px[p] = _mm_set1_ps(frustum.planes[p].x);
+    py[p] = _mm_set1_ps(frustum.planes[p].y);
+    pz[p] = _mm_set1_ps(frustum.planes[p].z);
+    pw[p] = _mm_set1_ps(frustum.planes[p].w);
+  }
+  const __m128 zero = _mm_setzero_ps();
+
+  size_t found = 0;
+  for (size_t i = first; i < last; i += CULL_BATCH) {
+    __m128 x0 = _mm_loadu_ps(x + i), x1 = _mm_loadu_ps(x + i + 4);
+    __m128 y0 = _mm_loadu_ps(y + i), y1 = _mm_loadu_ps(y + i + 4);
+    __m128 z0 = _mm_loadu_ps(z + i), z1 = _mm_loadu_ps(z + i + 4);
+    __m128 r0 = _mm_loadu_ps(r + i), r1 = _mm_loadu_ps(r + i + 4);
+    __m128 in0 = _mm_cmpeq_ps(zero, zero), in1 = in0;
+
+    for (int p = 0; p < 6; p++) {
+      __m128 d0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x0, px[p]), _mm_mul_ps(y0, py[p])),
+                             _mm_add_ps(_mm_mul_ps(z0, pz[p]), _mm_add_ps(pw[p], r0)));
+      __m128 d1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x1, px[p]), _mm_mul_ps(y1, py[p])),
+                             _mm_add_ps(_mm_mul_ps(z1, pz[p]), _mm_add_ps(pw[p], r1)));
+      in0 = _mm_and_ps(in0, _mm_cmpge_ps(d0, zero));
+      in1 = _mm_and_ps(in1, _mm_cmpge_ps(d1, zero));
+    }
+
+    unsigned mask = (unsigned) _mm_movemask_ps(in0) | ((unsigned) _mm_movemask_ps(in1) << 4);
+    found = appendVisible(mask, i, visible, found);
+  }
+  return found;
+}
+
+__attribute__((target("avx2,fma")))
+static size_t cullAvx2(const float *x, const float *y, const float *z, const float *r,
+                       const Frustum &frustum, size_t first, size_t last, uint32_t *visible)
+{
+  __m256 px[6], py[6], pz[6], pw[6];
+  for (int p = 0; p < 6; p++) {
+    px[p] = _mm256_set1_ps(frustum.planes[p].x);
+    py[p] = _mm256_set1_ps(frustum.planes[p].y);
+    pz[p] = _mm256_set1_ps(frustum.planes[p].z);
+    pw[p] = _mm256_set1_ps(frustum.planes[p].w);
+  }
+  const __m256 zero = _mm256_setzero_ps();
+
+  size_t found = 0;
+  for (size_t i = first; i < last; i += CULL_BATCH) {
+    __m256 sx = _mm256_loadu_ps(x + i);
+    __m256 sy = _mm256_loadu_ps(y + i);
+    __m256 sz = _mm256_loadu_ps(z + i);
+    __m256 sr = _mm256_loadu_ps(r + i);
+    __m256 in = _mm256_cmp_ps(zero, zero, _CMP_EQ_OQ);
+
+    for (int p = 0; p < 6; p++) {
+      __m256 d = _mm256_fmadd_ps(sx, px[p], _mm256_add_ps(pw[p], sr));
+      d = _mm256_fmadd_ps(sy, py[p], d);
+      d = _mm256_fmadd_ps(sz, pz[p], d);
+      in = _mm256_and_ps(in, _mm256_cmp_ps(d, zero, _CMP_GE_OQ));
+    }
+
+    found = appendVisible((unsigned) _mm256_movemask_ps(in), i, visible, found);
+  }
+  return found;
+}
+#endif
+
+bool SphereCuller::pathSupported(CullPath path)
+{
+  switch (path) {
+  case CULL_PATH_SCALAR:
+    return true;
+#if CULL_X86
+  case CULL_PATH_SSE:
+    return __builtin_cpu_supports("sse2");
+  case CULL_PATH_AVX2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+  default:
+    return false;
+  }
+}
+
+const char *SphereCuller::pathName(CullPath path)
+{
+  switch (path) {
+  case CULL_PATH_SCALAR:
+    return "scalar";
+  case CULL_PATH_SSE:
+    return "SSE";
+  case CULL_PATH_AVX2:
+    return "AVX2";
+  default:
+    return "unknown";
+  }
+}
+
+SphereCuller::SphereCuller()
+{
+  cullPath = CULL_PATH_SCALAR;
+  for (int path = CULL_PATH_SCALAR; path < CULL_PATH_COUNT; path++) {
+    if (pathSupported((CullPath) path))
+      cullPath = (CullPath) path;
+  }
+}
+
+bool SphereCuller::setPath(CullPath path)
+{
+  if (!pathSupported(path))
+    return false;
+  cullPath = path;
+  return true;
+}
+
+void SphereCuller::resize(size_t spheres)
+{
+  count = spheres;
+  size_t padded = (count + CULL_BATCH - 1) / CULL_BATCH * CULL_BATCH;
+  x.resize(padded, 0.0f);
+  y.resize(padded, 0.0f);
+  z.resize(padded, 0.0f);
+  r.resize(padded);
+  /* Padding fails the test against every plane */
+  std::fill(r.begin() + count, r.end(), -FLT_MAX);
+}
+
+size_t SphereCuller::cullRange(const Frustum &frustum, size_t first, size_t last, uint32_t *visible) const
+{
+  switch (cullPath) {
+#if CULL_X86
+  case CULL_PATH_SSE:
+    return cullSse(x.data(), y.data(), z.data(), r.data(), frustum, first, last, visible);
+  case CULL_PATH_AVX2:
+    return cullAvx2(x.data(), y.data(), z.data(), r.data(), frustum, first, last, visible);
+#endif
+  default:
+    return cullScalar(x.data(), y.data(), z.data(), r.data(), frustum, first, last, visible);
+  }
+}
+
+void SphereCuller::cull(const Frustum &frustum, std::vector<uint32_t> &visible, ThreadPool *threadPool) const
+{
+  /* Every range writes its results at its own start, then they are packed */
+  size_t padded = x.size();
+  visible.resize(padded);
+
+  size_t jobs = 1;
+  if (threadPool)
+    jobs = std::max(std::min((size_t) threadPool->size() + 1, padded / CULL_JOB_SPHERES), (size_t) 1);
+
+  if (jobs == 1) {
+    visible.resize(cullRange(frustum, 0, padded, visible.data()));
+    return;
+  }
+
+  size_t step = (padded / jobs + CULL_BATCH - 1) / CULL_BATCH * CULL_BATCH;
+  std::vector<size_t> found(jobs, 0);
+  threadPool->parallelFor(jobs, [&](size_t job) {
+    size_t first = std::min(job * step, padded);
+    size_t last = job + 1 == jobs ? padded : std::min(first + step, padded);
+    found[job] = cullRange(frustum, first, last, visible.data() + first);
+  });
+
+  size_t total = found[0];
+  for (size_t job = 1; job < jobs; job++) {
+    memmove(visible.data() + total, visible.data() + std::min(job * step, padded), found[job] * sizeof(uint32_t));
+    total += found[job];
+  }
+  visible.resize(total);
+}
+
+void benchCulling(const glm::mat4 &viewProj, size_t objects, ThreadPool &threadPool)
+{
+  Frustum frustum = frustumFromMatrix(viewProj);
+  std::vector<size_t> counts;
+  if (objects)
+    counts.push_back(objects);
+  else
+    counts = {10000, 100000, 1000000};
+
+  /* Spheres of about the size of the grid objects, around the origin the
+   * camera looks at, so that part of them is outside of the view.
+   */
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> position(-4.0f, 4.0f);
+  std::uniform_real_distribution<float> radius(0.01f, 0.1f);
+
+  for (size_t count : counts) {
+    SphereCuller culler;
+    culler.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      glm::vec3 center(position(random), position(random), position(random));
+      culler.set(i, center, radius(random));
+    }
+
+    printf("Frustum culling: %zu spheres\n", count);
+
+    std::vector<uint32_t> reference;
+    std::vector<uint32_t> visible;
+    for (int path = CULL_PATH_SCALAR; path < CULL_PATH_COUNT; path++) {
+      if (!culler.setPath((CullPath) path))
+        continue;
+
+      for (int threaded = 0; threaded < 2; threaded++) {
+        ThreadPool *pool = threaded ? &threadPool : nullptr;
+
+        /* Warm up the caches, then repeat until the timing is stable */
+        culler.cull(frustum, visible, pool);
+        unsigned runs = 0;
+        BenchClock::time_point start = BenchClock::now();
+        double ms;
+        do {
+          culler.cull(frustum, visible, pool);
+          runs++;
+          ms = elapsedMs(start, BenchClock::now());
+        } while (ms < CULL_BENCH_MIN_MS);
+        ms /= runs;
+
+        if (reference.empty())
+          reference = visible;
+
+        char name[64];
+        unsigned threads = threaded ? threadPool.size() + 1 : 1;
+        snprintf(name, sizeof(name), "%s, %u thread%s", SphereCuller::pathName((CullPath) path),
+                 threads, threads > 1 ? "s" : "");
+        printf("  %-20s %9.3f ms %10.1f objects/us, %zu visible%s\n", name, ms, count / (ms * 1000.0),
+               visible.size(), visible == reference ? "" : " (MISMATCH)");
+      }
+    }
+  }
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+
+#include "vk-frame-ring.h"
+
+void FrameRing::init(DeviceAllocator &deviceAllocator, VkDevice dev, VkDeviceSize minOffsetAlignment,
+                     VkDeviceSize size, uint32_t frameCount, VkBufferUsageFlags usage)
+{
+  allocator = &deviceAllocator;
+  device = dev;
+  sliceSize = size;
+  frames = frameCount;
+
+  /* Dynamic offsets must be multiples of minUniformBufferOffsetAlignment
+   * (minStorageBufferOffsetAlignment for storage buffers)
+   */
+  VkDeviceSize alignment = minOffsetAlignment ? minOffsetAlignment : 1;
+  stride = (sliceSize + alignment - 1) / alignment * alignment;
+
+  VkBufferCreateInfo bufferInfo = {};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = stride * frames;
+  bufferInfo.usage = usage;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  /* Coherent, so writes through the mapping need no flush */
+  allocator->createBuffer(bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                          ringBuffer, memory);
+
+  printf("Created %s ring: %u frames, %llu bytes per frame\n",
+         usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT ? "storage" : "uniform",
+         frames, (unsigned long long) stride);
+}
+
+void FrameRing::destroy()
+{
+  if (ringBuffer == VK_NULL_HANDLE)
+    return;
+
+  vkDestroyBuffer(device, ringBuffer, VK_NULL_HANDLE);
+  allocator->free(memory);
+  ringBuffer = VK_NULL_HANDLE;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include "vk-allocator.h"
+
+/* Persistently mapped buffer split in one slice per frame, bound through a
+ * single dynamic descriptor: UNIFORM_BUFFER_DYNAMIC with the default usage,
+ * STORAGE_BUFFER_DYNAMIC with storage buffer usage. The slice of a frame is
+ * selected with the dynamic offset.
+ */
+class FrameRing {
+ public:
+  void             init(DeviceAllocator &allocator, VkDevice device, VkDeviceSize minOffsetAlignment,
+                        VkDeviceSize sliceSize, uint32_t frames,
+                        VkBufferUsageFlags usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+  void             destroy();
+
+  VkBuffer         buffer() const { return ringBuffer; }
+  /* Range of the descriptor, the size of one slice */
+  VkDeviceSize     range() const { return sliceSize; }
+  uint32_t         frameCount() const { return frames; }
+
+  uint32_t         offset(uint32_t frame) const { return (uint32_t) (frame * stride); }
+  void            *data(uint32_t frame) const {
+    return static_cast<char *>(memory.mapped) + offset(frame);
+  }
+
+ private:
+  DeviceAllocator *allocator = nullptr;
+  VkDevice         device = VK_NULL_HANDLE;
+  VkBuffer         ringBuffer = VK_NULL_HANDLE;
+  MemoryAllocation memory;
+  VkDeviceSize     sliceSize = 0;
+  VkDeviceSize     stride = 0;
+  uint32_t         frames = 0;
+};
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+#include "vk-gpu-cull.h"
+#include "vk-util.h"
+
+/* Objects culled by each compute invocation group, see cull.comp */
+static const uint32_t CULL_GROUP_SIZE = 64;
+
+/* Mesh chunk as read by cull.comp */
+struct GpuChunk {
+  uint32_t         indexCount;
+  uint32_t         firstIndex;
+  int32_t          vertexOffset;
+  uint32_t         pad;
+};
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+void GpuCulling::init(VkPhysicalDevice phyDevice, VkDevice dev, DeviceAllocator &deviceAllocator,
+                      UploadService &uploader, VkPipelineCache pipelineCache,
+                      const std::vector<MeshChunk> &chunks, uint32_t objects, uint32_t frameCount,
+                      PFN_vkCmdDrawIndexedIndirectCountKHR drawIndirectCountFunction, uint32_t maxDrawIndirectCount)
+{
+  device = dev;
+  allocator = &deviceAllocator;
+  objectCount = objects;
+  chunkCount = (uint32_t) chunks.size();
+  frames = frameCount;
+  drawIndirectCount = drawIndirectCountFunction;
+  maxBatch = std::max(maxDrawIndirectCount, 1u);
+  /* The count only applies to a single call */
+  if (drawIndirectCount && maxDraws() > maxBatch) {
+    printf("GPU culling: %u draws over the indirect draw limit (%u), not compacted\n", maxDraws(), maxBatch);
+    drawIndirectCount = nullptr;
+  }
+
+  std::vector<GpuChunk> gpuChunks(chunkCount);
+  for (uint32_t i = 0; i < chunkCount; i++) {
+    gpuChunks[i].indexCount = chunks[i].indexCount;
+    gpuChunks[i].firstIndex = chunks[i].firstIndex;
+    gpuChunks[i].vertexOffset = (int32_t) chunks[i].firstVertex;
+    gpuChunks[i].pad = 0;
+  }
+  uploader.createBuffer(gpuChunks.data(), gpuChunks.size() * sizeof(GpuChunk), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                        chunkBuffer, chunkMemory, "cull_chunks");
+
+  /* The slices are bound with dynamic offsets */
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(phyDevice, &properties);
+  VkDeviceSize alignment = std::max(properties.limits.minStorageBufferOffsetAlignment, (VkDeviceSize) 4);
+  drawStride = alignUp(maxDraws() * sizeof(VkDrawIndexedIndirectCommand), alignment);
+  countStride = alignUp(sizeof(uint32_t), alignment);
+
+  VkBufferCreateInfo bufferInfo = {};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = drawStride * frames;
+  bufferInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  allocator->createBuffer(bufferInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, drawBuffer, drawMemory);
+
+  bufferInfo.size = countStride * frames;
+  bufferInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  allocator->createBuffer(bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                          countBuffer, countMemory);
+  memset(countMemory.mapped, 0, countStride * frames);
+
+  createPipeline(pipelineCache);
+  createDescriptorSet();
+
+  printf("Created GPU culling: %u objects x %u chunks, %s\n", objectCount, chunkCount,
+         drawIndirectCount ? "compacted with indirect count" :
+         maxBatch > 1 ? "multi-draw indirect" : "one indirect draw per record");
+}
+
+void GpuCulling::createPipeline(VkPipelineCache pipelineCache)
+{
+  VkResult res = VK_SUCCESS;
+
+  std::array<VkDescriptorSetLayoutBinding, 5> bindings = {};
+  VkDescriptorType types[] = {
+    VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+  };
+  for (uint32_t i = 0; i < bindings.size(); i++) {
+    bindings[i].binding = i;
+    bindings[i].descriptorType = types[i];
+    bindings[i].descriptorCount = 1;
+    bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+
+  VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+  layoutInfo.pBindings = bindings.data();
+
+  res = vkCreateDescriptorSetLayout(device, &layoutInfo, VK_NULL_HANDLE, &setLayout);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating culling descriptor set layout");
+
+  VkPushConstantRange pushConstantRange = {};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  pushConstantRange.offset = 0;
+  pushConstantRange.size = sizeof(Params);
+
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipelineLayoutInfo.setLayoutCount = 1;
+  pipelineLayoutInfo.pSetLayouts = &setLayout;
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+  res = vkCreatePipelineLayout(device, &pipelineLayoutInfo, VK_NULL_HANDLE, &pipelineLayout);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating culling pipeline layout");
+
+  std::vector<char> code = readFile("src/shaders/cull.spv");
+  VkShaderModuleCreateInfo moduleInfo = {};
+  moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  moduleInfo.codeSize = code.size();
+  moduleInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+
+  VkShaderModule module;
+  res = vkCreateShaderModule(device, &moduleInfo, VK_NULL_HANDLE, &module);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating culling shader module");
+
+  VkComputePipelineCreateInfo pipelineInfo = {};
+  pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipelineInfo.stage.module = module;
+  pipelineInfo.stage.pName = "main";
+  pipelineInfo.layout = pipelineLayout;
+
+  res = vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, VK_NULL_HANDLE, &pipeline);
+  vkDestroyShaderModule(device, module, VK_NULL_HANDLE);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating culling pipeline");
+}
+
+void GpuCulling::createDescriptorSet()
+{
+  VkResult res = VK_SUCCESS;
+
+  std::array<VkDescriptorPoolSize, 3> poolSizes = {};
+  poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  poolSizes[0].descriptorCount = 1;
+  poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  poolSizes[1].descriptorCount = 3;
+  poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  poolSizes[2].descriptorCount = 1;
+
+  VkDescriptorPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+  poolInfo.pPoolSizes = poolSizes.data();
+  poolInfo.maxSets = 1;
+
+  res = vkCreateDescriptorPool(device, &poolInfo, VK_NULL_HANDLE, &descriptorPool);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating culling descriptor pool");
+
+  VkDescriptorSetAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocInfo.descriptorPool = descriptorPool;
+  allocInfo.descriptorSetCount = 1;
+  allocInfo.pSetLayouts = &setLayout;
+
+  res = vkAllocateDescriptorSets(device, &allocInfo, &descriptorSet);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error allocating culling descriptor set");
+
+  /* The outputs never change, the inputs are written by setInputs() */
+  std::array<VkDescriptorBufferInfo, 3> bufferInfos = {};
+  bufferInfos[0].buffer = chunkBuffer;
+  bufferInfos[0].range = VK_WHOLE_SIZE;
+  bufferInfos[1].buffer = drawBuffer;
+  bufferInfos[1].range = maxDraws() * sizeof(VkDrawIndexedIndirectCommand);
+  bufferInfos[2].buffer = countBuffer;
+  bufferInfos[2].range = sizeof(uint32_t);
+
+  std::array<VkWriteDescriptorSet, 3> writes = {};
+  for (uint32_t i = 0; i < writes.size(); i++) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = descriptorSet;
+    writes[i].dstBinding = 2 + i;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    writes[i].pBufferInfo = &bufferInfos[i];
+  }
+
+  vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()), writes.data(), 0, VK_NULL_HANDLE);
+}
+
+void GpuCulling::setInputs(VkBuffer uniforms, VkDeviceSize uniformRange, VkBuffer instances, VkDeviceSize instanceRange)
+{
+  std::array<VkDescriptorBufferInfo, 2> bufferInfos = {};
+  bufferInfos[0].buffer = uniforms;
+  bufferInfos[0].range = uniformRange;
+  bufferInfos[1].buffer = instances;
+  bufferInfos[1].range = instanceRange;
+
+  std::array<VkWriteDescriptorSet, 2> writes = {};
+  for (uint32_t i = 0; i < writes.size(); i++) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = descriptorSet;
+    writes[i].dstBinding = i;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    writes[i].pBufferInfo = &bufferInfos[i];
+  }
+
+  vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()), writes.data(), 0, VK_NULL_HANDLE);
+}
+
+void GpuCulling::recordCull(VkCommandBuffer commandBuffer, uint32_t frame,
+                            uint32_t uniformOffset, uint32_t instanceOffset)
+{
+  vkCmdFillBuffer(commandBuffer, countBuffer, frame * countStride, sizeof(uint32_t), 0);
+
+  /* The reset count and the draws of the last frame using the slice must
+   * be done before the shader appends to them.
+   */
+  VkMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, VK_NULL_HANDLE, 0, VK_NULL_HANDLE);
+
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+
+  /* Dynamic offsets go in binding order */
+  uint32_t dynamicOffsets[] = {
+    uniformOffset, instanceOffset, (uint32_t) (frame * drawStride), (uint32_t) (frame * countStride)
+  };
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &descriptorSet,
+                          4, dynamicOffsets);
+
+  Params params;
+  params.objectCount = objectCount;
+  params.chunkCount = chunkCount;
+  params.compact = drawIndirectCount ? 1 : 0;
+  vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+
+  vkCmdDispatch(commandBuffer, (objectCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+                       0, 1, &barrier, 0, VK_NULL_HANDLE, 0, VK_NULL_HANDLE);
+}
+
+void GpuCulling::recordDraws(VkCommandBuffer commandBuffer, uint32_t frame) const
+{
+  VkDeviceSize offset = frame * drawStride;
+  uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+
+  if (drawIndirectCount) {
+    drawIndirectCount(commandBuffer, drawBuffer, offset, countBuffer, frame * countStride, maxDraws(), stride);
+  } else {
+    for (uint32_t first = 0; first < maxDraws(); first += maxBatch) {
+      uint32_t count = std::min(maxBatch, maxDraws() - first);
+      vkCmdDrawIndexedIndirect(commandBuffer, drawBuffer, offset + (VkDeviceSize) first * stride, count, stride);
+    }
+  }
+}
+
+uint32_t GpuCulling::visibleDraws(uint32_t frame) const
+{
+  uint32_t count;
+  memcpy(&count, static_cast<const char *>(countMemory.mapped) + frame * countStride, sizeof(count));
+  return count;
+}
+
+void GpuCulling::destroy()
+{
+  if (device == VK_NULL_HANDLE)
+    return;
+
+  vkDestroyPipeline(device, pipeline, VK_NULL_HANDLE);
+  vkDestroyPipelineLayout(device, pipelineLayout, VK_NULL_HANDLE);
+  vkDestroyDescriptorPool(device, descriptorPool, VK_NULL_HANDLE);
+  vkDestroyDescriptorSetLayout(device, setLayout, VK_NULL_HANDLE);
+
+  vkDestroyBuffer(device, chunkBuffer, VK_NULL_HANDLE);
+  allocator->free(chunkMemory);
+  vkDestroyBuffer(device, drawBuffer, VK_NULL_HANDLE);
+  allocator->free(drawMemory);
+  vkDestroyBuffer(device, countBuffer, VK_NULL_HANDLE);
+  allocator->free(countMemory);
+  device = VK_NULL_HANDLE;
+}
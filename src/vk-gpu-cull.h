@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <vector>
+
+#include "vk-allocator.h"
+#include "vk-mesh-pack.h"
+#include "vk-upload.h"
+
+/* GPU-driven culling: a compute pass tests the bounding sphere of every
+ * object against the view frustum and writes the draws of the visible ones
+ * as VkDrawIndexedIndirectCommand records, one per mesh chunk, plus their
+ * count. The graphics pass consumes them with a single indirect draw, so
+ * the CPU cost doesn't depend on the number of objects.
+ *
+ * With vkCmdDrawIndexedIndirectCount the records are compacted, as long as
+ * they fit in a single call. Otherwise every object keeps its records, the
+ * culled ones are drawn with no instances, and they are drawn in batches
+ * of at most maxDrawIndirectCount records.
+ */
+class GpuCulling {
+ public:
+  /* Inputs are the uniforms (frustum planes and mesh bounding sphere) and
+   * the model matrices of the objects, set with setInputs(). Outputs have
+   * one slice per frame in flight.
+   */
+  void             init(VkPhysicalDevice phyDevice, VkDevice device, DeviceAllocator &allocator,
+                        UploadService &uploader, VkPipelineCache pipelineCache,
+                        const std::vector<MeshChunk> &chunks, uint32_t objects, uint32_t frames,
+                        PFN_vkCmdDrawIndexedIndirectCountKHR drawIndirectCount, uint32_t maxDrawIndirectCount);
+  void             destroy();
+
+  /* Points the culling descriptors to the uniform and instance buffers.
+   * Their slices are selected with dynamic offsets when recording.
+   */
+  void             setInputs(VkBuffer uniforms, VkDeviceSize uniformRange,
+                             VkBuffer instances, VkDeviceSize instanceRange);
+
+  /* Records the culling of a frame, outside of any render pass. It ends
+   * with a barrier making its results visible to indirect draws.
+   */
+  void             recordCull(VkCommandBuffer commandBuffer, uint32_t frame,
+                              uint32_t uniformOffset, uint32_t instanceOffset);
+  /* Records the indirect draws of a frame, with the graphics pipeline,
+   * descriptors and vertex and index buffers already bound.
+   */
+  void             recordDraws(VkCommandBuffer commandBuffer, uint32_t frame) const;
+
+  /* Draws written by the last culling of a frame, once its fence has signaled */
+  uint32_t         visibleDraws(uint32_t frame) const;
+  uint32_t         maxDraws() const { return objectCount * chunkCount; }
+
+ private:
+  struct Params {
+    uint32_t       objectCount;
+    uint32_t       chunkCount;
+    uint32_t       compact;
+  };
+
+  void             createPipeline(VkPipelineCache pipelineCache);
+  void             createDescriptorSet();
+
+  VkDevice         device = VK_NULL_HANDLE;
+  DeviceAllocator *allocator = nullptr;
+  uint32_t         objectCount = 0;
+  uint32_t         chunkCount = 0;
+  uint32_t         frames = 0;
+  PFN_vkCmdDrawIndexedIndirectCountKHR drawIndirectCount = nullptr;
+  uint32_t         maxBatch = 1;
+
+  VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+  VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+  VkPipeline       pipeline = VK_NULL_HANDLE;
+  VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+  VkDescriptorSet  descriptorSet = VK_NULL_HANDLE;
+
+  VkBuffer         chunkBuffer = VK_NULL_HANDLE;
+  MemoryAllocation chunkMemory;
+  /* Draw records and counts, a slice of each per frame in flight. The
+   * counts are host visible to report how many draws survived.
+   */
+  VkBuffer         drawBuffer = VK_NULL_HANDLE;
+  MemoryAllocation drawMemory;
+  VkDeviceSize     drawStride = 0;
+  VkBuffer         countBuffer = VK_NULL_HANDLE;
+  MemoryAllocation countMemory;
+  VkDeviceSize     countStride = 0;
+};
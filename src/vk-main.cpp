@@ -1,10 +1,187 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "vk-test.h"
+#include "vk-vertex-dedup.h"
+#include "vk-cull.h"
 
-int main (void)
+/* Default grid size of --bench-dedup, 6M corners and 1M unique vertices */
+static const unsigned DEDUP_BENCH_GRID_SIZE = 1000;
+static unsigned dedupBenchGridSize = 0;
+/* --bench-cull: run it, and its object count (0 for 10k, 100k and 1M) */
+static bool cullBench = false;
+static size_t cullBenchObjects = 0;
+
+static const struct {
+  const char       *name;
+  VkPresentModeKHR mode;
+} presentModes[] = {
+  {"fifo", VK_PRESENT_MODE_FIFO_KHR},
+  {"fifo-relaxed", VK_PRESENT_MODE_FIFO_RELAXED_KHR},
+  {"mailbox", VK_PRESENT_MODE_MAILBOX_KHR},
+  {"immediate", VK_PRESENT_MODE_IMMEDIATE_KHR},
+};
+
+static void usage(const char *prog)
+{
+  printf("Usage: %s [options]\n", prog);
+  printf("\t--headless          render offscreen, without window nor swapchain\n");
+  printf("\t--size WxH          size of the window or offscreen images (default 800x600)\n");
+  printf("\t--frames N          exit after rendering N frames\n");
+  printf("\t--device N          use the N-th physical device (default 0)\n");
+  printf("\t--output FILE       headless only: save the last frame as a PPM image\n");
+  printf("\t--bench             measure CPU frame times and report their distribution\n");
+  printf("\t--warmup N          benchmark: unmeasured frames before measuring (default 100)\n");
+  printf("\t--duration SECONDS  benchmark: measure during a fixed time instead of --frames\n");
+  printf("\t--bench-json FILE   benchmark: write the results as JSON\n");
+  printf("\t--bench-csv FILE    benchmark: write the results as CSV\n");
+  printf("\t--no-mesh-cache     always import the model from the OBJ file\n");
+  printf("\t--no-pipeline-cache don't load nor save the pipeline cache file\n");
+  printf("\t--stream-import     import the OBJ file in chunks (implies --no-mesh-cache)\n");
+  printf("\t--no-mesh-opt       don't optimize the imported model for the GPU caches\n");
+  printf("\t--threads N         worker threads for CPU work (default: one per core)\n");
+  printf("\t--objects N         draw N copies of the model (default 1)\n");
+  printf("\t--instanced         draw all the objects with instanced draws\n");
+  printf("\t--gpu-cull          cull the objects on the GPU and draw them indirectly\n");
+  printf("\t--cpu-cull          cull the objects on the CPU, only drawing the visible ones\n");
+  printf("\t--meshlets          split the model in meshlets and cull them on the CPU\n");
+  printf("\t--lods              simplify the model into levels of detail selected by distance\n");
+  printf("\t--lod-error PIXELS  largest screen space error of the selected level (default 1)\n");
+  printf("\t--present-mode MODE fifo (default), fifo-relaxed, mailbox or immediate\n");
+  printf("\t--images N          number of swapchain images (default: surface minimum)\n");
+  printf("\t--frames-in-flight N frames prepared ahead of the GPU (default 2)\n");
+  printf("\t--low-latency       sample the input once the previous frame is done\n");
+  printf("\t--bench-dedup [N]   benchmark vertex deduplication on a NxN grid and exit\n");
+  printf("\t--bench-cull [N]    benchmark CPU culling of N objects (default 10k, 100k, 1M) and exit\n");
+  printf("\t--help              show this help\n");
+}
+
+static void parseOptions(int argc, char *argv[], VulkanTestOptions &options)
+{
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool hasValue = i + 1 < argc;
+
+    if (strcmp(arg, "--headless") == 0) {
+      options.headless = true;
+    } else if (strcmp(arg, "--size") == 0 && hasValue) {
+      if (sscanf(argv[++i], "%ux%u", &options.width, &options.height) != 2 ||
+          options.width == 0 || options.height == 0) {
+        fprintf(stderr, "Invalid size: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(arg, "--frames") == 0 && hasValue) {
+      options.frames = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(arg, "--device") == 0 && hasValue) {
+      options.deviceIndex = (unsigned) strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(arg, "--output") == 0 && hasValue) {
+      options.outputImage = argv[++i];
+    } else if (strcmp(arg, "--bench") == 0) {
+      options.bench = true;
+    } else if (strcmp(arg, "--warmup") == 0 && hasValue) {
+      options.warmupFrames = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(arg, "--duration") == 0 && hasValue) {
+      options.benchDuration = strtod(argv[++i], NULL);
+    } else if (strcmp(arg, "--bench-json") == 0 && hasValue) {
+      options.benchJson = argv[++i];
+    } else if (strcmp(arg, "--bench-csv") == 0 && hasValue) {
+      options.benchCsv = argv[++i];
+    } else if (strcmp(arg, "--no-mesh-cache") == 0) {
+      options.meshCache = false;
+    } else if (strcmp(arg, "--no-pipeline-cache") == 0) {
+      options.pipelineCache = false;
+    } else if (strcmp(arg, "--stream-import") == 0) {
+      /* A valid mesh cache would skip the import */
+      options.streamImport = true;
+      options.meshCache = false;
+    } else if (strcmp(arg, "--no-mesh-opt") == 0) {
+      options.meshOpt = false;
+    } else if (strcmp(arg, "--threads") == 0 && hasValue) {
+      options.threads = (unsigned) strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(arg, "--objects") == 0 && hasValue) {
+      options.objects = (uint32_t) strtoul(argv[++i], NULL, 10);
+      if (options.objects == 0) {
+        fprintf(stderr, "Invalid number of objects: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(arg, "--instanced") == 0) {
+      options.instanced = true;
+    } else if (strcmp(arg, "--gpu-cull") == 0) {
+      options.gpuCull = true;
+    } else if (strcmp(arg, "--cpu-cull") == 0) {
+      options.cpuCull = true;
+    } else if (strcmp(arg, "--meshlets") == 0) {
+      options.meshlets = true;
+    } else if (strcmp(arg, "--lods") == 0) {
+      options.lods = true;
+    } else if (strcmp(arg, "--lod-error") == 0 && hasValue) {
+      options.lodError = strtof(argv[++i], NULL);
+      if (!(options.lodError > 0.0f)) {
+        fprintf(stderr, "Invalid LOD error: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(arg, "--present-mode") == 0 && hasValue) {
+      const char *name = argv[++i];
+      bool found = false;
+      for (const auto &entry : presentModes) {
+        if (strcmp(name, entry.name) == 0) {
+          options.presentMode = entry.mode;
+          found = true;
+        }
+      }
+      if (!found) {
+        fprintf(stderr, "Invalid present mode: %s\n", name);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(arg, "--images") == 0 && hasValue) {
+      options.swapchainImages = (uint32_t) strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(arg, "--frames-in-flight") == 0 && hasValue) {
+      options.framesInFlight = (uint32_t) strtoul(argv[++i], NULL, 10);
+      if (options.framesInFlight == 0) {
+        fprintf(stderr, "Invalid frames in flight: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(arg, "--low-latency") == 0) {
+      options.lowLatency = true;
+    } else if (strcmp(arg, "--bench-dedup") == 0) {
+      dedupBenchGridSize = DEDUP_BENCH_GRID_SIZE;
+      if (hasValue && argv[i + 1][0] != '-')
+        dedupBenchGridSize = (unsigned) strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(arg, "--bench-cull") == 0) {
+      cullBench = true;
+      if (hasValue && argv[i + 1][0] != '-')
+        cullBenchObjects = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(arg, "--help") == 0) {
+      usage(argv[0]);
+      exit(EXIT_SUCCESS);
+    } else {
+      fprintf(stderr, "Unknown or incomplete option: %s\n", arg);
+      usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+int main (int argc, char *argv[])
 {
-  VulkanTest prog;
+  VulkanTestOptions options;
+
+  parseOptions(argc, argv, options);
+
+  /* CPU-only microbenchmarks don't need any Vulkan setup */
+  if (dedupBenchGridSize) {
+    benchVertexDedup(dedupBenchGridSize);
+    return 0;
+  }
+  if (cullBench) {
+    ThreadPool threadPool(options.threads);
+    VkExtent2D extent = {options.width, options.height};
+    benchCulling(VulkanTest::projectionMatrix(extent) * VulkanTest::viewMatrix(), cullBenchObjects, threadPool);
+    return 0;
+  }
+
+  VulkanTest prog(options);
 
   prog.init();
 
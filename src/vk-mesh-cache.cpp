@@ -0,0 +1,290 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vk-mesh-cache.h"
+#include "vk-util.h"
+
+/* Bump it every time the layout of the file or the vertex format changes */
+static const uint32_t MESH_CACHE_VERSION = 4;
+static const char MESH_CACHE_MAGIC[8] = { 'V', 'K', 'T', 'M', 'E', 'S', 'H', '\0' };
+
+struct MeshCacheHeader {
+  char             magic[8];
+  uint32_t         version;
+  uint32_t         vertexSize;
+  uint32_t         flags;
+  uint32_t         reserved;
+  /* Source model identification */
+  uint64_t         sourcePathHash;
+  uint64_t         sourceSize;
+  int64_t          sourceMtime;
+  uint64_t         sourceHash;
+  /* Dequantization of the packed positions */
+  float            posScale[3];
+  float            posOffset[3];
+  /* Payload: vertices, indices, chunks and levels of detail */
+  uint64_t         vertexCount;
+  uint64_t         indexCount;
+  uint64_t         chunkCount;
+  uint64_t         lodCount;
+  uint64_t         vertexOffset;
+  uint64_t         indexOffset;
+  uint64_t         chunkOffset;
+  uint64_t         lodOffset;
+};
+
+static uint64_t alignOffset(uint64_t offset, uint64_t alignment)
+{
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+/* Whether an array of count elements at offset lies within the mapping,
+ * written so that hostile values can't overflow.
+ */
+static bool arrayFits(uint64_t offset, uint64_t count, uint64_t size, uint64_t alignment, uint64_t mappingSize)
+{
+  return offset <= mappingSize && offset % alignment == 0 && count <= (mappingSize - offset) / size;
+}
+
+/* Checks the chunks and levels of detail against the header counts, as
+ * they are used later on to index the vertices, indices and chunks.
+ */
+static bool validContents(const MeshCacheHeader &header, const char *bytes)
+{
+  for (uint64_t i = 0; i < header.chunkCount; i++) {
+    MeshChunk chunk;
+    memcpy(&chunk, bytes + header.chunkOffset + i * sizeof(MeshChunk), sizeof(chunk));
+    if ((uint64_t) chunk.firstIndex + chunk.indexCount > header.indexCount ||
+        (uint64_t) chunk.firstVertex + chunk.vertexCount > header.vertexCount)
+      return false;
+  }
+
+  for (uint64_t i = 0; i < header.lodCount; i++) {
+    MeshLod lod;
+    memcpy(&lod, bytes + header.lodOffset + i * sizeof(MeshLod), sizeof(lod));
+    if ((uint64_t) lod.firstChunk + lod.chunkCount > header.chunkCount)
+      return false;
+  }
+
+  return true;
+}
+
+struct SourceInfo {
+  uint64_t         size;
+  int64_t          mtime;
+};
+
+static bool statSource(const std::string &sourceFile, SourceInfo &info)
+{
+  struct stat st;
+  if (stat(sourceFile.c_str(), &st) != 0)
+    return false;
+
+  info.size = (uint64_t) st.st_size;
+  info.mtime = (int64_t) st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+  return true;
+}
+
+static bool hashSource(const std::string &sourceFile, uint64_t &hash)
+{
+  int fd = open(sourceFile.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+
+  void *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  hash = hashBytes(data, st.st_size);
+  if (data)
+    munmap(data, st.st_size);
+  return true;
+}
+
+/* Records the new mtime of an unchanged source in the cache header, so the
+ * next loads don't hash it again. The cache stays valid if it fails.
+ */
+static void updateSourceMtime(const std::string &cacheFile, int64_t mtime)
+{
+  int fd = open(cacheFile.c_str(), O_WRONLY);
+  if (fd < 0)
+    return;
+
+  if (pwrite(fd, &mtime, sizeof(mtime), offsetof(MeshCacheHeader, sourceMtime)) != (ssize_t) sizeof(mtime))
+    printf("Failed to update the source mtime of %s\n", cacheFile.c_str());
+  close(fd);
+}
+
+MeshCache::~MeshCache()
+{
+  unload();
+}
+
+bool MeshCache::load(const std::string &cacheFile, const std::string &sourceFile,
+                     uint32_t flags)
+{
+  unload();
+
+  SourceInfo source;
+  if (!statSource(sourceFile, source))
+    return false;
+
+  int fd = open(cacheFile.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(MeshCacheHeader)) {
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  mapping = data;
+  mappingSize = st.st_size;
+
+  MeshCacheHeader header;
+  memcpy(&header, data, sizeof(header));
+
+  if (memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) != 0 ||
+      header.version != MESH_CACHE_VERSION ||
+      header.vertexSize != sizeof(PackedVertex) ||
+      header.flags != flags ||
+      header.lodCount == 0 ||
+      header.sourcePathHash != hashBytes(sourceFile.data(), sourceFile.size()) ||
+      header.sourceSize != source.size ||
+      header.vertexCount > UINT32_MAX || header.indexCount > UINT32_MAX ||
+      header.chunkCount > UINT32_MAX || header.lodCount > UINT32_MAX ||
+      !arrayFits(header.vertexOffset, header.vertexCount, sizeof(PackedVertex), alignof(PackedVertex), mappingSize) ||
+      !arrayFits(header.indexOffset, header.indexCount, sizeof(uint16_t), alignof(uint16_t), mappingSize) ||
+      !arrayFits(header.chunkOffset, header.chunkCount, sizeof(MeshChunk), alignof(MeshChunk), mappingSize) ||
+      !arrayFits(header.lodOffset, header.lodCount, sizeof(MeshLod), alignof(MeshLod), mappingSize) ||
+      !validContents(header, static_cast<const char *>(data))) {
+    printf("Mesh cache %s is stale or invalid\n", cacheFile.c_str());
+    unload();
+    return false;
+  }
+
+  /* A different mtime with the same contents (e.g. a fresh checkout) is
+   * still a hit, but it needs hashing the whole source to find out.
+   */
+  if (header.sourceMtime != source.mtime) {
+    uint64_t sourceHash;
+    if (!hashSource(sourceFile, sourceHash) || sourceHash != header.sourceHash) {
+      printf("Mesh cache %s is stale: %s changed\n", cacheFile.c_str(), sourceFile.c_str());
+      unload();
+      return false;
+    }
+    updateSourceMtime(cacheFile, source.mtime);
+  }
+
+  /* Data will be read sequentially once, when copying it to the GPU */
+  madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+  madvise(mapping, mappingSize, MADV_WILLNEED);
+
+  const char *bytes = static_cast<const char *>(mapping);
+  vertexData = reinterpret_cast<const PackedVertex *>(bytes + header.vertexOffset);
+  indexData = reinterpret_cast<const uint16_t *>(bytes + header.indexOffset);
+  chunkData = reinterpret_cast<const MeshChunk *>(bytes + header.chunkOffset);
+  lodData = reinterpret_cast<const MeshLod *>(bytes + header.lodOffset);
+  numVertices = (uint32_t) header.vertexCount;
+  numIndices = (uint32_t) header.indexCount;
+  numChunks = (uint32_t) header.chunkCount;
+  numLods = (uint32_t) header.lodCount;
+  scale = glm::vec3(header.posScale[0], header.posScale[1], header.posScale[2]);
+  offset = glm::vec3(header.posOffset[0], header.posOffset[1], header.posOffset[2]);
+
+  return true;
+}
+
+void MeshCache::unload()
+{
+  if (mapping)
+    munmap(mapping, mappingSize);
+
+  mapping = nullptr;
+  mappingSize = 0;
+  vertexData = nullptr;
+  indexData = nullptr;
+  chunkData = nullptr;
+  lodData = nullptr;
+  numVertices = 0;
+  numIndices = 0;
+  numChunks = 0;
+  numLods = 0;
+}
+
+bool MeshCache::store(const std::string &cacheFile, const std::string &sourceFile,
+                      const PackedMesh &mesh, uint32_t flags)
+{
+  SourceInfo source;
+  MeshCacheHeader header = {};
+
+  if (!statSource(sourceFile, source) || !hashSource(sourceFile, header.sourceHash))
+    return false;
+
+  memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+  header.version = MESH_CACHE_VERSION;
+  header.vertexSize = sizeof(PackedVertex);
+  header.flags = flags;
+  header.sourcePathHash = hashBytes(sourceFile.data(), sourceFile.size());
+  header.sourceSize = source.size;
+  header.sourceMtime = source.mtime;
+  for (unsigned i = 0; i < 3; i++) {
+    header.posScale[i] = mesh.posScale[i];
+    header.posOffset[i] = mesh.posOffset[i];
+  }
+  header.vertexCount = mesh.vertices.size();
+  header.indexCount = mesh.indices.size();
+  header.chunkCount = mesh.chunks.size();
+  header.lodCount = mesh.lods.size();
+  header.vertexOffset = sizeof(MeshCacheHeader);
+  header.indexOffset = header.vertexOffset + mesh.vertices.size() * sizeof(PackedVertex);
+  uint64_t indexEnd = header.indexOffset + mesh.indices.size() * sizeof(uint16_t);
+  header.chunkOffset = alignOffset(indexEnd, alignof(MeshChunk));
+  /* MeshLod has the same alignment as MeshChunk, no padding needed */
+  header.lodOffset = header.chunkOffset + mesh.chunks.size() * sizeof(MeshChunk);
+  static const char padding[alignof(MeshChunk)] = {};
+
+  /* Readers never see a partially written cache: write a temporary file
+   * next to it and rename it over the old one.
+   */
+  std::string tmpFile = cacheFile + ".tmp." + std::to_string(getpid());
+  int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+
+  bool ok = writeAll(fd, &header, sizeof(header)) &&
+            writeAll(fd, mesh.vertices.data(), mesh.vertices.size() * sizeof(PackedVertex)) &&
+            writeAll(fd, mesh.indices.data(), mesh.indices.size() * sizeof(uint16_t)) &&
+            writeAll(fd, padding, header.chunkOffset - indexEnd) &&
+            writeAll(fd, mesh.chunks.data(), mesh.chunks.size() * sizeof(MeshChunk)) &&
+            writeAll(fd, mesh.lods.data(), mesh.lods.size() * sizeof(MeshLod)) &&
+            fsync(fd) == 0;
+
+  if (close(fd) != 0)
+    ok = false;
+
+  if (!ok || rename(tmpFile.c_str(), cacheFile.c_str()) != 0) {
+    unlink(tmpFile.c_str());
+    return false;
+  }
+
+  return true;
+}
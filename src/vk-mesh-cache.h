@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "vk-mesh-pack.h"
+
+/* Flags recording how the cached geometry was processed after import */
+enum MeshCacheFlags {
+  MESH_CACHE_OPTIMIZED = 1 << 0,
+  /* Split in meshlets instead of 16-bit index chunks */
+  MESH_CACHE_MESHLETS = 1 << 1,
+  /* With the simplified levels of detail */
+  MESH_CACHE_LODS = 1 << 2,
+};
+
+/* Binary cache of an imported model: the final packed vertex, index and
+ * chunk arrays and the levels of detail, ready to be copied into the upload
+ * buffers. The cache file records the path, size, mtime and content hash
+ * of the source model and is considered stale as soon as any of them
+ * doesn't match, or when it was processed with different MeshCacheFlags.
+ */
+class MeshCache {
+ public:
+  MeshCache() {};
+  ~MeshCache();
+
+  /* Maps cacheFile in memory if it is valid for sourceFile */
+  bool             load(const std::string &cacheFile, const std::string &sourceFile,
+                        uint32_t flags);
+  void             unload();
+
+  /* Writes the cache atomically (temporary file + rename) */
+  static bool      store(const std::string &cacheFile, const std::string &sourceFile,
+                         const PackedMesh &mesh, uint32_t flags);
+
+  const PackedVertex *vertices() const { return vertexData; }
+  const uint16_t  *indices() const { return indexData; }
+  const MeshChunk *chunks() const { return chunkData; }
+  const MeshLod   *lods() const { return lodData; }
+  uint32_t         vertexCount() const { return numVertices; }
+  uint32_t         indexCount() const { return numIndices; }
+  uint32_t         chunkCount() const { return numChunks; }
+  uint32_t         lodCount() const { return numLods; }
+  glm::vec3        posScale() const { return scale; }
+  glm::vec3        posOffset() const { return offset; }
+
+ private:
+  void            *mapping = nullptr;
+  size_t           mappingSize = 0;
+  const PackedVertex *vertexData = nullptr;
+  const uint16_t  *indexData = nullptr;
+  const MeshChunk *chunkData = nullptr;
+  const MeshLod   *lodData = nullptr;
+  uint32_t         numVertices = 0;
+  uint32_t         numIndices = 0;
+  uint32_t         numChunks = 0;
+  uint32_t         numLods = 0;
+  glm::vec3        scale;
+  glm::vec3        offset;
+};
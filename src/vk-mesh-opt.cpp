@@ -0,0 +1,316 @@
+#include <math.h>
+#include <algorithm>
+
+#include "vk-mesh-opt.h"
+
+/* FIFO cache used to evaluate the results, it models common hardware */
+static const unsigned FIFO_CACHE_SIZE = 16;
+/* Forsyth's tuning: LRU cache modeled while scoring and score weights */
+static const unsigned SCORE_CACHE_SIZE = 32;
+static const float CACHE_DECAY_POWER = 1.5f;
+static const float LAST_TRIANGLE_SCORE = 0.75f;
+static const float VALENCE_BOOST_SCALE = 2.0f;
+static const float VALENCE_BOOST_POWER = 0.5f;
+
+VertexCacheStats analyzeVertexCache(const uint32_t *indices, size_t indexCount,
+                                    size_t vertexCount, unsigned cacheSize)
+{
+  VertexCacheStats stats = {};
+  if (indexCount < 3 || vertexCount == 0)
+    return stats;
+
+  /* A vertex is in the cache if it was pushed less than cacheSize misses ago */
+  std::vector<size_t> pushedAt(vertexCount, 0);
+  size_t misses = 0;
+
+  for (size_t i = 0; i < indexCount; i++) {
+    uint32_t v = indices[i];
+    if (pushedAt[v] == 0 || misses + 1 - pushedAt[v] > cacheSize) {
+      misses++;
+      pushedAt[v] = misses;
+    }
+  }
+
+  stats.acmr = misses / (float) (indexCount / 3);
+  stats.atvr = misses / (float) vertexCount;
+  return stats;
+}
+
+static float vertexScore(int cachePosition, unsigned liveTriangles)
+{
+  /* No triangles left, the vertex doesn't matter anymore */
+  if (liveTriangles == 0)
+    return -1.0f;
+
+  float score = 0.0f;
+  if (cachePosition >= 0) {
+    /* The vertices of the last triangle get a fixed score, so that the next
+     * one doesn't prefer any particular edge.
+     */
+    if (cachePosition < 3) {
+      score = LAST_TRIANGLE_SCORE;
+    } else {
+      float scaler = 1.0f / (SCORE_CACHE_SIZE - 3);
+      score = powf(1.0f - (cachePosition - 3) * scaler, CACHE_DECAY_POWER);
+    }
+  }
+
+  /* Boost vertices with few triangles left, to finish them off */
+  score += VALENCE_BOOST_SCALE * powf((float) liveTriangles, -VALENCE_BOOST_POWER);
+  return score;
+}
+
+void optimizeVertexCache(std::vector<uint32_t> &indices, size_t vertexCount)
+{
+  size_t triangleCount = indices.size() / 3;
+  if (triangleCount == 0)
+    return;
+
+  /* Triangles of each vertex, emitted ones are swapped out of the live range */
+  std::vector<uint32_t> adjacencyOffset(vertexCount + 1, 0);
+  std::vector<uint32_t> liveTriangles(vertexCount, 0);
+  for (size_t i = 0; i < triangleCount * 3; i++)
+    liveTriangles[indices[i]]++;
+  for (size_t v = 0; v < vertexCount; v++)
+    adjacencyOffset[v + 1] = adjacencyOffset[v] + liveTriangles[v];
+
+  std::vector<uint32_t> adjacency(triangleCount * 3);
+  std::vector<uint32_t> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+  for (size_t t = 0; t < triangleCount; t++) {
+    for (unsigned k = 0; k < 3; k++)
+      adjacency[fill[indices[t * 3 + k]]++] = (uint32_t) t;
+  }
+
+  std::vector<int> cachePosition(vertexCount, -1);
+  std::vector<float> vertexScores(vertexCount);
+  for (size_t v = 0; v < vertexCount; v++)
+    vertexScores[v] = vertexScore(-1, liveTriangles[v]);
+
+  std::vector<float> triangleScores(triangleCount);
+  for (size_t t = 0; t < triangleCount; t++) {
+    triangleScores[t] = vertexScores[indices[t * 3 + 0]] +
+                        vertexScores[indices[t * 3 + 1]] +
+                        vertexScores[indices[t * 3 + 2]];
+  }
+
+  std::vector<bool> emitted(triangleCount, false);
+  std::vector<uint32_t> output;
+  output.reserve(indices.size());
+
+  std::vector<uint32_t> cache, newCache;
+  cache.reserve(SCORE_CACHE_SIZE + 3);
+  newCache.reserve(SCORE_CACHE_SIZE + 3);
+
+  size_t cursor = 0;
+  int64_t best = 0;
+
+  while (output.size() < triangleCount * 3) {
+    /* Nothing good in the cache: restart from the first triangle left in the
+     * input order, which tends to be spatially coherent.
+     */
+    if (best < 0) {
+      while (emitted[cursor])
+        cursor++;
+      best = (int64_t) cursor;
+    }
+
+    uint32_t triangle = (uint32_t) best;
+    const uint32_t *corners = &indices[triangle * 3];
+    emitted[triangle] = true;
+
+    newCache.clear();
+    for (unsigned k = 0; k < 3; k++) {
+      uint32_t v = corners[k];
+      output.push_back(v);
+      newCache.push_back(v);
+
+      /* Remove the triangle from the live adjacency of the vertex */
+      uint32_t *begin = &adjacency[adjacencyOffset[v]];
+      uint32_t *end = begin + liveTriangles[v];
+      *std::find(begin, end, triangle) = end[-1];
+      liveTriangles[v]--;
+    }
+
+    for (uint32_t v : cache) {
+      if (v != corners[0] && v != corners[1] && v != corners[2])
+        newCache.push_back(v);
+    }
+
+    /* Rescore the vertices that moved in the cache or fell out of it */
+    for (size_t i = 0; i < newCache.size(); i++) {
+      uint32_t v = newCache[i];
+      cachePosition[v] = i < SCORE_CACHE_SIZE ? (int) i : -1;
+      vertexScores[v] = vertexScore(cachePosition[v], liveTriangles[v]);
+    }
+
+    /* Then their live triangles, picking the best one for the next round */
+    float bestScore = 0.0f;
+    best = -1;
+    for (uint32_t v : newCache) {
+      const uint32_t *adjacent = &adjacency[adjacencyOffset[v]];
+      for (uint32_t i = 0; i < liveTriangles[v]; i++) {
+        uint32_t t = adjacent[i];
+        float score = vertexScores[indices[t * 3 + 0]] +
+                      vertexScores[indices[t * 3 + 1]] +
+                      vertexScores[indices[t * 3 + 2]];
+        triangleScores[t] = score;
+        if (score > bestScore) {
+          bestScore = score;
+          best = t;
+        }
+      }
+    }
+
+    if (newCache.size() > SCORE_CACHE_SIZE)
+      newCache.resize(SCORE_CACHE_SIZE);
+    cache.swap(newCache);
+  }
+
+  indices.swap(output);
+}
+
+/* Splits the triangle sequence where the FIFO cache starts from scratch
+ * (the three vertices of a triangle miss): clusters can be reordered at
+ * those points without hurting the cache efficiency. Clusters are then
+ * split further while their own ACMR stays within threshold of the one of
+ * the whole cluster.
+ */
+static std::vector<size_t> generateClusters(const std::vector<uint32_t> &indices,
+                                            size_t vertexCount, float threshold)
+{
+  size_t triangleCount = indices.size() / 3;
+  std::vector<size_t> hard;
+  std::vector<size_t> pushedAt(vertexCount, 0);
+  size_t misses = 0;
+
+  for (size_t t = 0; t < triangleCount; t++) {
+    unsigned triangleMisses = 0;
+    for (unsigned k = 0; k < 3; k++) {
+      uint32_t v = indices[t * 3 + k];
+      if (pushedAt[v] == 0 || misses + 1 - pushedAt[v] > FIFO_CACHE_SIZE) {
+        misses++;
+        pushedAt[v] = misses;
+        triangleMisses++;
+      }
+    }
+    if (t == 0 || triangleMisses == 3)
+      hard.push_back(t);
+  }
+  hard.push_back(triangleCount);
+
+  std::vector<size_t> clusters;
+  for (size_t c = 0; c + 1 < hard.size(); c++) {
+    size_t start = hard[c];
+    size_t end = hard[c + 1];
+    float clusterAcmr = analyzeVertexCache(&indices[start * 3], (end - start) * 3, vertexCount).acmr;
+
+    /* Restart the cache at every soft boundary, like it would happen if the
+     * pieces end up apart.
+     */
+    std::fill(pushedAt.begin(), pushedAt.end(), 0);
+    misses = 0;
+    size_t softStart = start;
+    size_t softMisses = 0;
+    clusters.push_back(start);
+
+    for (size_t t = start; t < end; t++) {
+      for (unsigned k = 0; k < 3; k++) {
+        uint32_t v = indices[t * 3 + k];
+        if (pushedAt[v] == 0 || misses + 1 - pushedAt[v] > FIFO_CACHE_SIZE) {
+          misses++;
+          pushedAt[v] = misses;
+          softMisses++;
+        }
+      }
+
+      size_t softTriangles = t + 1 - softStart;
+      if (t + 1 < end && softTriangles >= FIFO_CACHE_SIZE &&
+          softMisses <= clusterAcmr * threshold * softTriangles) {
+        clusters.push_back(t + 1);
+        softStart = t + 1;
+        softMisses = 0;
+        std::fill(pushedAt.begin(), pushedAt.end(), 0);
+        misses = 0;
+      }
+    }
+  }
+  clusters.push_back(triangleCount);
+
+  return clusters;
+}
+
+void optimizeOverdraw(std::vector<uint32_t> &indices, const std::vector<Vertex> &vertices,
+                      float threshold)
+{
+  size_t triangleCount = indices.size() / 3;
+  if (triangleCount == 0)
+    return;
+
+  std::vector<size_t> clusters = generateClusters(indices, vertices.size(), threshold);
+  size_t clusterCount = clusters.size() - 1;
+
+  /* Area-weighted centroid and normal of each cluster and of the mesh */
+  std::vector<glm::vec3> centroids(clusterCount, glm::vec3(0.0f));
+  std::vector<glm::vec3> normals(clusterCount, glm::vec3(0.0f));
+  std::vector<float> areas(clusterCount, 0.0f);
+  glm::vec3 meshCentroid(0.0f);
+  float meshArea = 0.0f;
+
+  for (size_t c = 0; c < clusterCount; c++) {
+    for (size_t t = clusters[c]; t < clusters[c + 1]; t++) {
+      const glm::vec3 &p0 = vertices[indices[t * 3 + 0]].pos;
+      const glm::vec3 &p1 = vertices[indices[t * 3 + 1]].pos;
+      const glm::vec3 &p2 = vertices[indices[t * 3 + 2]].pos;
+      glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+      float area = glm::length(normal);
+
+      centroids[c] += (p0 + p1 + p2) * (area / 3.0f);
+      normals[c] += normal;
+      areas[c] += area;
+    }
+    meshCentroid += centroids[c];
+    meshArea += areas[c];
+    if (areas[c] > 0.0f)
+      centroids[c] = centroids[c] / areas[c];
+  }
+  if (meshArea > 0.0f)
+    meshCentroid = meshCentroid / meshArea;
+
+  /* Clusters far from the center facing outwards are likely occluders */
+  std::vector<float> sortKey(clusterCount);
+  for (size_t c = 0; c < clusterCount; c++) {
+    float length = glm::length(normals[c]);
+    glm::vec3 normal = length > 0.0f ? normals[c] / length : glm::vec3(0.0f);
+    sortKey[c] = glm::dot(centroids[c] - meshCentroid, normal);
+  }
+
+  std::vector<size_t> order(clusterCount);
+  for (size_t c = 0; c < clusterCount; c++)
+    order[c] = c;
+  std::stable_sort(order.begin(), order.end(),
+                   [&sortKey](size_t a, size_t b) { return sortKey[a] > sortKey[b]; });
+
+  std::vector<uint32_t> output;
+  output.reserve(indices.size());
+  for (size_t c : order)
+    output.insert(output.end(), indices.begin() + clusters[c] * 3, indices.begin() + clusters[c + 1] * 3);
+
+  indices.swap(output);
+}
+
+void optimizeVertexFetch(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices)
+{
+  std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+  std::vector<Vertex> output;
+  output.reserve(vertices.size());
+
+  for (uint32_t &index : indices) {
+    if (remap[index] == UINT32_MAX) {
+      remap[index] = static_cast<uint32_t>(output.size());
+      output.push_back(vertices[index]);
+    }
+    index = remap[index];
+  }
+
+  vertices.swap(output);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "vk-mesh.h"
+
+/* Post-transform vertex cache efficiency of an index buffer, simulating a
+ * FIFO cache of cacheSize entries.
+ *  - ACMR: average cache misses per triangle (0.5 is the ideal for big regular meshes, 3 the worst).
+ *  - ATVR: average transformed vertices per vertex (1.0 is the ideal).
+ */
+struct VertexCacheStats {
+  float            acmr;
+  float            atvr;
+};
+
+VertexCacheStats analyzeVertexCache(const uint32_t *indices, size_t indexCount,
+                                    size_t vertexCount, unsigned cacheSize = 16);
+
+/* Reorders triangles to maximize post-transform vertex cache hits, with
+ * Tom Forsyth's "Linear-Speed Vertex Cache Optimisation".
+ */
+void optimizeVertexCache(std::vector<uint32_t> &indices, size_t vertexCount);
+
+/* Reorders clusters of cache-optimized triangles so that the ones facing
+ * outwards are drawn first and occlude the rest, reducing overdraw. The
+ * cache efficiency can degrade at most by threshold (e.g. 1.05 for 5%).
+ */
+void optimizeOverdraw(std::vector<uint32_t> &indices, const std::vector<Vertex> &vertices,
+                      float threshold);
+
+/* Renumbers vertices by their first use in the index buffer, so that vertex
+ * fetches follow the triangle order. Unreferenced vertices are dropped.
+ */
+void optimizeVertexFetch(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices);
@@ -0,0 +1,113 @@
+#include <math.h>
+#include <algorithm>
+
+#include <glm/gtc/packing.hpp>
+
+#include "vk-mesh-pack.h"
+
+static uint16_t quantizeUnorm16(float value)
+{
+  value = std::min(std::max(value, 0.0f), 1.0f);
+  return static_cast<uint16_t>(lroundf(value * 65535.0f));
+}
+
+static PackedVertex packVertex(const Vertex &vertex, const glm::vec3 &posOffset,
+                               const glm::vec3 &invScale)
+{
+  PackedVertex packed;
+  glm::vec3 normalized = (vertex.pos - posOffset) * invScale;
+
+  packed.pos[0] = quantizeUnorm16(normalized.x);
+  packed.pos[1] = quantizeUnorm16(normalized.y);
+  packed.pos[2] = quantizeUnorm16(normalized.z);
+  packed.pos[3] = 0;
+  packed.texCoord[0] = glm::packHalf1x16(vertex.texCoord.x);
+  packed.texCoord[1] = glm::packHalf1x16(vertex.texCoord.y);
+  return packed;
+}
+
+PackedMesh packMesh(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                    uint32_t maxVertices, uint32_t maxTriangles)
+{
+  PackedMesh mesh;
+
+  glm::vec3 minPos(0.0f), maxPos(0.0f);
+  if (!vertices.empty()) {
+    minPos = maxPos = vertices[0].pos;
+    for (const Vertex &vertex : vertices) {
+      minPos = glm::min(minPos, vertex.pos);
+      maxPos = glm::max(maxPos, vertex.pos);
+    }
+  }
+
+  /* Flat axes get a unit scale, all their positions quantize to 0 */
+  glm::vec3 extent = maxPos - minPos;
+  glm::vec3 invScale;
+  for (unsigned i = 0; i < 3; i++) {
+    if (extent[i] <= 0.0f)
+      extent[i] = 1.0f;
+    invScale[i] = 1.0f / extent[i];
+  }
+  mesh.posScale = extent;
+  mesh.posOffset = minPos;
+
+  mesh.vertices.reserve(vertices.size());
+  mesh.indices.reserve(indices.size());
+
+  /* Index of each vertex in the current chunk, valid if chunkOf matches */
+  std::vector<uint32_t> chunkOf(vertices.size(), UINT32_MAX);
+  std::vector<uint16_t> local(vertices.size());
+  MeshChunk chunk = {};
+
+  for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+    uint32_t chunkId = static_cast<uint32_t>(mesh.chunks.size());
+    unsigned newVertices = 0;
+    for (unsigned k = 0; k < 3; k++) {
+      if (chunkOf[indices[i + k]] != chunkId)
+        newVertices++;
+    }
+
+    if (chunk.vertexCount + newVertices > maxVertices || chunk.indexCount / 3 >= maxTriangles) {
+      mesh.chunks.push_back(chunk);
+      chunk.firstIndex += chunk.indexCount;
+      chunk.firstVertex += chunk.vertexCount;
+      chunk.indexCount = 0;
+      chunk.vertexCount = 0;
+      chunkId++;
+    }
+
+    for (unsigned k = 0; k < 3; k++) {
+      uint32_t v = indices[i + k];
+      if (chunkOf[v] != chunkId) {
+        chunkOf[v] = chunkId;
+        local[v] = static_cast<uint16_t>(chunk.vertexCount++);
+        mesh.vertices.push_back(packVertex(vertices[v], minPos, invScale));
+      }
+      mesh.indices.push_back(local[v]);
+    }
+    chunk.indexCount += 3;
+  }
+
+  if (chunk.indexCount)
+    mesh.chunks.push_back(chunk);
+  mesh.lods.push_back({0, static_cast<uint32_t>(mesh.chunks.size()), 0.0f});
+
+  return mesh;
+}
+
+void appendMeshLod(PackedMesh &mesh, const PackedMesh &lod, float error)
+{
+  MeshLod level = {static_cast<uint32_t>(mesh.chunks.size()), lod.lods[0].chunkCount, error};
+  uint32_t firstIndex = static_cast<uint32_t>(mesh.indices.size());
+  uint32_t firstVertex = static_cast<uint32_t>(mesh.vertices.size());
+
+  for (uint32_t i = 0; i < level.chunkCount; i++) {
+    MeshChunk chunk = lod.chunks[lod.lods[0].firstChunk + i];
+    chunk.firstIndex += firstIndex;
+    chunk.firstVertex += firstVertex;
+    mesh.chunks.push_back(chunk);
+  }
+  mesh.vertices.insert(mesh.vertices.end(), lod.vertices.begin(), lod.vertices.end());
+  mesh.indices.insert(mesh.indices.end(), lod.indices.begin(), lod.indices.end());
+  mesh.lods.push_back(level);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "vk-mesh.h"
+
+/* Most vertices a chunk can have, so it can be drawn with 16-bit indices */
+static const uint32_t MESH_CHUNK_MAX_VERTICES = 1 << 16;
+
+/* Vertex layout consumed by the GPU, 12 bytes instead of the 32 of Vertex.
+ * Positions are unorm16 relative to the mesh bounding box (decoded in the
+ * vertex shader with the scale and offset of the mesh) and padded to four
+ * components, as R16G16B16A16_UNORM is the widely supported format.
+ * Texture coordinates are half floats. The color is not stored, it is
+ * always white.
+ */
+struct PackedVertex {
+  uint16_t         pos[4];
+  uint16_t         texCoord[2];
+};
+
+/* Part of the mesh drawn with 16-bit indices, relative to firstVertex */
+struct MeshChunk {
+  uint32_t         firstIndex;
+  uint32_t         indexCount;
+  uint32_t         firstVertex;
+  uint32_t         vertexCount;
+};
+
+/* Level of detail: a range of chunks, with the estimated distance between
+ * its surface and the one of level 0, in model units.
+ */
+struct MeshLod {
+  uint32_t         firstChunk;
+  uint32_t         chunkCount;
+  float            error;
+};
+
+struct PackedMesh {
+  /* pos = packed pos / 65535 * posScale + posOffset */
+  glm::vec3        posScale;
+  glm::vec3        posOffset;
+  std::vector<PackedVertex> vertices;
+  std::vector<uint16_t> indices;
+  std::vector<MeshChunk> chunks;
+  /* Levels of detail, coarser with each level, level 0 is the full mesh */
+  std::vector<MeshLod> lods;
+};
+
+/* Quantizes the vertices and splits the triangles, in order, into chunks of
+ * at most maxVertices vertices and maxTriangles triangles. Vertices used by
+ * more than one chunk are duplicated in each of them; a mesh under the
+ * limits is a single chunk with no duplicates.
+ */
+PackedMesh packMesh(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                    uint32_t maxVertices = MESH_CHUNK_MAX_VERTICES, uint32_t maxTriangles = UINT32_MAX);
+
+/* Appends the chunks of level 0 of lod, packed from the same vertices as
+ * mesh (so with the same dequantization), as a new level of detail of mesh.
+ */
+void appendMeshLod(PackedMesh &mesh, const PackedMesh &lod, float error);
@@ -0,0 +1,304 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <unordered_map>
+
+#include "vk-mesh-simplify.h"
+
+/* Collapses that bend a triangle more than this (cosine) are rejected */
+static const double MIN_FLIP_DOT = 0.2;
+
+/* Error quadric of a set of planes: sum of weight * (n.p + d)^2, stored as
+ * the upper half of the symmetric 4x4 matrix. weight is the sum of the
+ * weights, to turn the error into a mean squared distance.
+ */
+struct Quadric {
+  double           a00, a01, a02, a03;
+  double           a11, a12, a13;
+  double           a22, a23;
+  double           a33;
+  double           weight;
+};
+
+static void addPlane(Quadric &q, const glm::dvec3 &n, double d, double weight)
+{
+  q.a00 += weight * n.x * n.x;
+  q.a01 += weight * n.x * n.y;
+  q.a02 += weight * n.x * n.z;
+  q.a03 += weight * n.x * d;
+  q.a11 += weight * n.y * n.y;
+  q.a12 += weight * n.y * n.z;
+  q.a13 += weight * n.y * d;
+  q.a22 += weight * n.z * n.z;
+  q.a23 += weight * n.z * d;
+  q.a33 += weight * d * d;
+  q.weight += weight;
+}
+
+static void addQuadric(Quadric &q, const Quadric &other)
+{
+  q.a00 += other.a00;
+  q.a01 += other.a01;
+  q.a02 += other.a02;
+  q.a03 += other.a03;
+  q.a11 += other.a11;
+  q.a12 += other.a12;
+  q.a13 += other.a13;
+  q.a22 += other.a22;
+  q.a23 += other.a23;
+  q.a33 += other.a33;
+  q.weight += other.weight;
+}
+
+/* Sum of the weighted squared distances from p to the planes */
+static double quadricError(const Quadric &q, const glm::dvec3 &p)
+{
+  double rx = q.a00 * p.x + q.a01 * p.y + q.a02 * p.z + q.a03;
+  double ry = q.a01 * p.x + q.a11 * p.y + q.a12 * p.z + q.a13;
+  double rz = q.a02 * p.x + q.a12 * p.y + q.a22 * p.z + q.a23;
+  double error = rx * p.x + ry * p.y + rz * p.z + q.a03 * p.x + q.a13 * p.y + q.a23 * p.z + q.a33;
+  return std::max(error, 0.0);
+}
+
+/* Same mixing as hashVertex(), on the position bits only */
+struct PositionHash {
+  size_t operator()(const glm::vec3 &pos) const
+  {
+    const float values[4] = {pos.x + 0.0f, pos.y + 0.0f, pos.z + 0.0f, 0.0f};
+    uint64_t words[2];
+    memcpy(words, values, sizeof(words));
+    return (size_t) mix64(mix64(words[0]) * 0x9e3779b97f4a7c15ull ^ words[1]);
+  }
+};
+
+struct Collapse {
+  uint32_t         from;
+  uint32_t         to;
+  double           error;
+};
+
+class MeshSimplifier {
+ public:
+  MeshSimplifier(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices);
+
+  /* Collapses edges until at most targetTriangles are left, or no edge can
+   * be collapsed anymore.
+   */
+  void             simplify(size_t targetTriangles);
+
+  const std::vector<uint32_t> &indices() const { return triangles; }
+  float            error() const { return (float) sqrt(maxError); }
+
+ private:
+  bool             collapsePass(size_t targetTriangles);
+  bool             flips(uint32_t from, uint32_t to) const;
+  glm::dvec3       position(uint32_t vertex) const { return glm::dvec3(vertices[vertex].pos); }
+
+  const std::vector<Vertex> &vertices;
+  std::vector<uint32_t> triangles;
+  /* Vertices with the same position share an id and a quadric. Vertices on
+   * a border or a seam (whose position has several vertices) are locked.
+   */
+  std::vector<uint32_t> positionId;
+  std::vector<Quadric> quadrics;
+  std::vector<bool> locked;
+  double           maxError = 0.0;
+
+  /* Triangles of each vertex, rebuilt every pass */
+  std::vector<uint32_t> firstTriangle;
+  std::vector<uint32_t> vertexTriangles;
+};
+
+MeshSimplifier::MeshSimplifier(const std::vector<Vertex> &meshVertices, const std::vector<uint32_t> &indices) :
+  vertices(meshVertices), triangles(indices)
+{
+  size_t vertexCount = vertices.size();
+
+  std::unordered_map<glm::vec3, uint32_t, PositionHash> ids;
+  positionId.resize(vertexCount);
+  for (size_t v = 0; v < vertexCount; v++)
+    positionId[v] = ids.emplace(vertices[v].pos, (uint32_t) ids.size()).first->second;
+
+  /* A seam is a position used by more than one vertex */
+  std::vector<uint32_t> firstUser(ids.size(), UINT32_MAX);
+  locked.assign(vertexCount, false);
+  std::vector<bool> seam(ids.size(), false);
+  for (uint32_t v : triangles) {
+    uint32_t id = positionId[v];
+    if (firstUser[id] == UINT32_MAX)
+      firstUser[id] = v;
+    else if (firstUser[id] != v)
+      seam[id] = true;
+  }
+
+  /* A border edge has no twin going the other way */
+  std::unordered_map<uint64_t, uint32_t> edges;
+  for (size_t i = 0; i < triangles.size(); i += 3) {
+    for (unsigned k = 0; k < 3; k++) {
+      uint64_t a = positionId[triangles[i + k]], b = positionId[triangles[i + (k + 1) % 3]];
+      edges[a << 32 | b]++;
+    }
+  }
+  for (const auto &edge : edges) {
+    uint64_t a = edge.first >> 32, b = edge.first & 0xffffffff;
+    if (edges.find(b << 32 | a) == edges.end())
+      seam[a] = seam[b] = true;
+  }
+
+  for (size_t v = 0; v < vertexCount; v++)
+    locked[v] = seam[positionId[v]];
+
+  /* Planes of the triangles, weighted by their area */
+  quadrics.assign(ids.size(), Quadric());
+  for (size_t i = 0; i < triangles.size(); i += 3) {
+    glm::dvec3 p0 = position(triangles[i]), p1 = position(triangles[i + 1]), p2 = position(triangles[i + 2]);
+    glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+    double length = glm::length(normal);
+    if (length == 0.0)
+      continue;
+    normal /= length;
+    for (unsigned k = 0; k < 3; k++)
+      addPlane(quadrics[positionId[triangles[i + k]]], normal, -glm::dot(normal, p0), length * 0.5);
+  }
+}
+
+/* Whether moving from onto to turns any of the triangles of from over */
+bool MeshSimplifier::flips(uint32_t from, uint32_t to) const
+{
+  glm::dvec3 target = position(to);
+  for (uint32_t t = firstTriangle[from]; t < firstTriangle[from + 1]; t++) {
+    const uint32_t *corners = &triangles[vertexTriangles[t] * 3];
+    glm::dvec3 p[3], q[3];
+    bool degenerate = false;
+    for (unsigned k = 0; k < 3; k++) {
+      p[k] = position(corners[k]);
+      q[k] = corners[k] == from ? target : p[k];
+      degenerate |= positionId[corners[k]] == positionId[to];
+    }
+    /* Triangles on the collapsed edge disappear */
+    if (degenerate)
+      continue;
+
+    glm::dvec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+    glm::dvec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+    if (glm::dot(before, after) <= MIN_FLIP_DOT * glm::length(before) * glm::length(after))
+      return true;
+  }
+  return false;
+}
+
+/* One round of collapses of independent edges, cheapest first: once a
+ * vertex is involved in a collapse, its neighborhood is left for the next
+ * pass, as its triangles and quadric changed.
+ */
+bool MeshSimplifier::collapsePass(size_t targetTriangles)
+{
+  size_t vertexCount = vertices.size();
+  size_t triangleCount = triangles.size() / 3;
+
+  firstTriangle.assign(vertexCount + 1, 0);
+  for (uint32_t v : triangles)
+    firstTriangle[v + 1]++;
+  for (size_t v = 0; v < vertexCount; v++)
+    firstTriangle[v + 1] += firstTriangle[v];
+  vertexTriangles.resize(triangles.size());
+  std::vector<uint32_t> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+  for (size_t i = 0; i < triangles.size(); i++)
+    vertexTriangles[fill[triangles[i]]++] = (uint32_t) (i / 3);
+
+  std::vector<Collapse> collapses;
+  collapses.reserve(triangles.size());
+  for (size_t i = 0; i < triangles.size(); i += 3) {
+    for (unsigned k = 0; k < 3; k++) {
+      uint32_t a = triangles[i + k], b = triangles[i + (k + 1) % 3];
+      for (int dir = 0; dir < 2; dir++, std::swap(a, b)) {
+        if (locked[a])
+          continue;
+        Quadric q = quadrics[positionId[a]];
+        addQuadric(q, quadrics[positionId[b]]);
+        collapses.push_back({a, b, quadricError(q, position(b)) / std::max(q.weight, 1e-30)});
+      }
+    }
+  }
+  std::sort(collapses.begin(), collapses.end(), [](const Collapse &x, const Collapse &y) {
+    return x.error < y.error;
+  });
+
+  std::vector<uint32_t> remap(vertexCount);
+  for (size_t v = 0; v < vertexCount; v++)
+    remap[v] = (uint32_t) v;
+  std::vector<bool> touched(vertexCount, false);
+  size_t removed = 0;
+  size_t done = 0;
+
+  for (const Collapse &collapse : collapses) {
+    if (triangleCount - removed <= targetTriangles)
+      break;
+    if (touched[collapse.from] || touched[collapse.to])
+      continue;
+    if (flips(collapse.from, collapse.to))
+      continue;
+
+    /* Lock the neighborhood: its triangles are about to change */
+    for (uint32_t t = firstTriangle[collapse.from]; t < firstTriangle[collapse.from + 1]; t++) {
+      const uint32_t *corners = &triangles[vertexTriangles[t] * 3];
+      bool onEdge = false;
+      for (unsigned k = 0; k < 3; k++) {
+        touched[corners[k]] = true;
+        onEdge |= positionId[corners[k]] == positionId[collapse.to];
+      }
+      removed += onEdge;
+    }
+
+    remap[collapse.from] = collapse.to;
+    addQuadric(quadrics[positionId[collapse.to]], quadrics[positionId[collapse.from]]);
+    maxError = std::max(maxError, collapse.error);
+    done++;
+  }
+
+  /* Drop the triangles left with two corners at the same position */
+  size_t kept = 0;
+  for (size_t i = 0; i < triangles.size(); i += 3) {
+    uint32_t a = remap[triangles[i]], b = remap[triangles[i + 1]], c = remap[triangles[i + 2]];
+    if (positionId[a] == positionId[b] || positionId[b] == positionId[c] || positionId[a] == positionId[c])
+      continue;
+    triangles[kept++] = a;
+    triangles[kept++] = b;
+    triangles[kept++] = c;
+  }
+  triangles.resize(kept);
+
+  return done > 0;
+}
+
+void MeshSimplifier::simplify(size_t targetTriangles)
+{
+  while (triangles.size() / 3 > targetTriangles && collapsePass(targetTriangles))
+    ;
+}
+
+std::vector<SimplifiedLevel> simplifyMesh(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                                          unsigned maxLevels, float ratio, float maxRatio)
+{
+  std::vector<SimplifiedLevel> levels;
+  MeshSimplifier simplifier(vertices, indices);
+
+  /* Every level continues collapsing the previous one, so the errors are
+   * measured against the original surface.
+   */
+  size_t triangles = indices.size() / 3;
+  while (levels.size() < maxLevels && triangles > 1) {
+    simplifier.simplify((size_t) (triangles * ratio));
+    size_t left = simplifier.indices().size() / 3;
+    if (left > triangles * maxRatio)
+      break;
+
+    SimplifiedLevel level;
+    level.indices = simplifier.indices();
+    level.error = simplifier.error();
+    levels.push_back(level);
+    triangles = left;
+  }
+
+  return levels;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "vk-mesh.h"
+
+/* Level of detail produced by simplifyMesh(). error is an estimate of the
+ * largest distance between the level and the original surface, in the
+ * units of the vertex positions.
+ */
+struct SimplifiedLevel {
+  std::vector<uint32_t> indices;
+  float            error;
+};
+
+/* Builds a chain of up to maxLevels levels of detail by collapsing edges
+ * in order of quadric error (Garland and Heckbert), each one with about
+ * ratio times the triangles of the previous. Vertices are never moved nor
+ * added, so the levels index the same vertex array. Vertices on borders
+ * and texture seams are kept, which bounds how far a mesh can go: the
+ * chain ends when a level doesn't get below maxRatio of the previous.
+ */
+std::vector<SimplifiedLevel> simplifyMesh(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                                          unsigned maxLevels, float ratio, float maxRatio);
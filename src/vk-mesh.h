@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE // Vulkan's depth range from 0 to 1
+#include <glm/glm.hpp>
+
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/hash.hpp>
+
+#include "vk-util.h"
+
+struct Vertex {
+  glm::vec3 pos;
+  glm::vec3 color;
+  glm::vec2 texCoord;
+  bool operator==(const Vertex& other) const {
+    return pos == other.pos && color == other.color && texCoord == other.texCoord;
+  }
+};
+
+/* Hash of the vertex attribute bits. Each 64-bit word goes through a full
+ * avalanche mix, unlike combining the per-member hashes with XOR/shift, which
+ * clusters badly for meshes whose coordinates share most of their bits.
+ */
+inline uint64_t hashVertex(const Vertex &vertex)
+{
+  /* Adding 0.0f turns -0.0f into 0.0f, which compare equal */
+  const float values[8] = {
+    vertex.pos.x + 0.0f, vertex.pos.y + 0.0f, vertex.pos.z + 0.0f,
+    vertex.color.x + 0.0f, vertex.color.y + 0.0f, vertex.color.z + 0.0f,
+    vertex.texCoord.x + 0.0f, vertex.texCoord.y + 0.0f
+  };
+  uint64_t words[4];
+  memcpy(words, values, sizeof(words));
+
+  uint64_t hash = 0x9e3779b97f4a7c15ull;
+  for (unsigned i = 0; i < 4; i++)
+    hash = (hash ^ mix64(words[i])) * 0x9e3779b97f4a7c15ull;
+  return mix64(hash);
+}
+
+namespace std {
+    template<> struct hash<Vertex> {
+        size_t operator()(Vertex const& vertex) const {
+            return (size_t) hashVertex(vertex);
+        }
+    };
+}
@@ -0,0 +1,112 @@
+#include <math.h>
+#include <algorithm>
+
+#include "vk-meshlet.h"
+
+/* Cones wider than about 84 degrees would hardly ever be culled */
+static const float MESHLET_MIN_CONE_DOT = 0.1f;
+
+static glm::vec3 unpackPosition(const PackedVertex &vertex, const glm::vec3 &posScale, const glm::vec3 &posOffset)
+{
+  glm::vec3 pos(vertex.pos[0], vertex.pos[1], vertex.pos[2]);
+  return pos / 65535.0f * posScale + posOffset;
+}
+
+static MeshletBounds meshletBounds(const PackedVertex *vertices, const uint16_t *indices, const MeshChunk &chunk,
+                                   const glm::vec3 &posScale, const glm::vec3 &posOffset)
+{
+  MeshletBounds bounds;
+
+  /* Sphere around the center of the bounding box */
+  glm::vec3 minPos = unpackPosition(vertices[chunk.firstVertex], posScale, posOffset);
+  glm::vec3 maxPos = minPos;
+  for (uint32_t v = 1; v < chunk.vertexCount; v++) {
+    glm::vec3 pos = unpackPosition(vertices[chunk.firstVertex + v], posScale, posOffset);
+    minPos = glm::min(minPos, pos);
+    maxPos = glm::max(maxPos, pos);
+  }
+  bounds.center = (minPos + maxPos) * 0.5f;
+  bounds.radius = 0.0f;
+  for (uint32_t v = 0; v < chunk.vertexCount; v++) {
+    glm::vec3 pos = unpackPosition(vertices[chunk.firstVertex + v], posScale, posOffset);
+    bounds.radius = std::max(bounds.radius, glm::distance(pos, bounds.center));
+  }
+
+  /* Normal cone: the axis is the average of the triangle normals and the
+   * cutoff the sine of the widest angle between them and the axis. The
+   * apex is moved back along the axis until every triangle plane is in
+   * front of it. Degenerate triangles don't face anywhere and are skipped.
+   */
+  std::vector<glm::vec3> normals;
+  std::vector<glm::vec3> corners;
+  glm::vec3 axis(0.0f);
+  for (uint32_t i = 0; i < chunk.indexCount; i += 3) {
+    glm::vec3 p[3];
+    for (unsigned k = 0; k < 3; k++)
+      p[k] = unpackPosition(vertices[chunk.firstVertex + indices[chunk.firstIndex + i + k]], posScale, posOffset);
+
+    glm::vec3 normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+    float area = glm::length(normal);
+    if (area == 0.0f)
+      continue;
+    normals.push_back(normal / area);
+    corners.push_back(p[0]);
+    axis += normal / area;
+  }
+
+  bounds.coneApex = bounds.center;
+  bounds.coneAxis = glm::vec3(0.0f, 0.0f, 1.0f);
+  bounds.coneCutoff = 2.0f;
+  if (normals.empty() || glm::length(axis) == 0.0f)
+    return bounds;
+
+  axis = glm::normalize(axis);
+  float minDot = 1.0f;
+  for (const glm::vec3 &normal : normals)
+    minDot = std::min(minDot, glm::dot(normal, axis));
+  if (minDot <= MESHLET_MIN_CONE_DOT)
+    return bounds;
+
+  float maxT = 0.0f;
+  for (size_t i = 0; i < normals.size(); i++) {
+    float t = glm::dot(bounds.center - corners[i], normals[i]) / glm::dot(axis, normals[i]);
+    maxT = std::max(maxT, t);
+  }
+
+  bounds.coneApex = bounds.center - axis * maxT;
+  bounds.coneAxis = axis;
+  bounds.coneCutoff = sqrtf(1.0f - minDot * minDot);
+  return bounds;
+}
+
+std::vector<MeshletBounds> computeMeshletBounds(const PackedVertex *vertices, const uint16_t *indices,
+                                                const std::vector<MeshChunk> &chunks,
+                                                const glm::vec3 &posScale, const glm::vec3 &posOffset)
+{
+  std::vector<MeshletBounds> bounds;
+  bounds.reserve(chunks.size());
+  for (const MeshChunk &chunk : chunks)
+    bounds.push_back(meshletBounds(vertices, indices, chunk, posScale, posOffset));
+  return bounds;
+}
+
+void cullMeshlets(const MeshletBounds *meshlets, uint32_t count, const Frustum &frustum,
+                  const glm::vec3 &camera, uint32_t first, std::vector<uint32_t> &visible)
+{
+  for (uint32_t i = 0; i < count; i++) {
+    const MeshletBounds &meshlet = meshlets[i];
+
+    glm::vec3 view = meshlet.coneApex - camera;
+    float distance = glm::length(view);
+    if (glm::dot(view, meshlet.coneAxis) > meshlet.coneCutoff * distance)
+      continue;
+
+    bool inside = true;
+    for (int p = 0; p < 6 && inside; p++) {
+      const glm::vec4 &plane = frustum.planes[p];
+      inside = glm::dot(glm::vec3(plane), meshlet.center) + plane.w >= -meshlet.radius;
+    }
+    if (inside)
+      visible.push_back(first + i);
+  }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "vk-mesh-pack.h"
+#include "vk-cull.h"
+
+/* Limits of a meshlet, as used by mesh shading pipelines: 124 triangles
+ * keep the primitive indices within 372 bytes, with 64 vertices.
+ */
+static const uint32_t MESHLET_MAX_VERTICES = 64;
+static const uint32_t MESHLET_MAX_TRIANGLES = 124;
+
+/* Model space bounds of a meshlet. The normal cone contains the normals of
+ * all its triangles: they all face away from a camera inside the cone
+ * behind the apex, i.e. when dot(normalize(apex - camera), axis) > cutoff.
+ * Meshlets whose normals spread too much have a cutoff above 1.
+ */
+struct MeshletBounds {
+  glm::vec3        center;
+  float            radius;
+  glm::vec3        coneApex;
+  glm::vec3        coneAxis;
+  float            coneCutoff;
+};
+
+/* Bounds of every chunk of a packed mesh, from its dequantized positions */
+std::vector<MeshletBounds> computeMeshletBounds(const PackedVertex *vertices, const uint16_t *indices,
+                                                const std::vector<MeshChunk> &chunks,
+                                                const glm::vec3 &posScale, const glm::vec3 &posOffset);
+
+/* Appends first + i for every meshlet i of the count at meshlets that is
+ * not back-facing and is inside the frustum. Both the frustum and the
+ * camera are in model space.
+ */
+void cullMeshlets(const MeshletBounds *meshlets, uint32_t count, const Frustum &frustum,
+                  const glm::vec3 &camera, uint32_t first, std::vector<uint32_t> &visible);
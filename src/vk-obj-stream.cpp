@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "vk-obj-stream.h"
+#include "vk-vertex-dedup.h"
+
+/* Bytes read from the file at once */
+static const size_t READ_CHUNK_SIZE = 4 << 20;
+/* Vertices and indices handed to the sink at once */
+static const size_t SINK_BATCH_SIZE = 64 * 1024;
+
+namespace {
+
+class ObjStreamParser {
+ public:
+  ObjStreamParser(MeshSink &output) : sink(output), uniqueVertices(SINK_BATCH_SIZE) {};
+
+  void             parseLine(const char *line, const char *end);
+  void             flush();
+  void             updatePeak(size_t bufferBytes);
+
+  ObjStreamStats   stats = {};
+
+ private:
+  void             addCorner(long position, long texcoord);
+  float            parseFloat(const char *&p, const char *end);
+  uint32_t         resolveIndex(long index, size_t count);
+
+  MeshSink        &sink;
+  std::vector<float> positions;
+  std::vector<float> texcoords;
+  ObjIndexDedupTable uniqueVertices;
+  uint32_t         vertexCount = 0;
+  std::vector<Vertex> pendingVertices;
+  std::vector<uint32_t> pendingIndices;
+  /* Corners of the polygon being triangulated */
+  std::vector<uint32_t> polygon;
+  unsigned         lineNumber = 0;
+};
+
+}
+
+static inline const char *skipSpaces(const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    p++;
+  return p;
+}
+
+/* Whether an index starts at p. strtol skips whitespace, '\n' included,
+ * so it is only called on the first character of a number.
+ */
+static inline bool startsNumber(const char *p, const char *end)
+{
+  return p < end && ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+');
+}
+
+/* Lines end with '\n' and a number ends before it, but strtof skips
+ * leading whitespace: a missing value would read the next line.
+ */
+float ObjStreamParser::parseFloat(const char *&p, const char *end)
+{
+  p = skipSpaces(p, end);
+  if (p >= end || *p == '\n')
+    throw std::runtime_error("Missing coordinate at line " + std::to_string(lineNumber));
+
+  char *next;
+  float value = strtof(p, &next);
+  if (next == p)
+    throw std::runtime_error("Invalid coordinate at line " + std::to_string(lineNumber));
+  p = next;
+  return value;
+}
+
+uint32_t ObjStreamParser::resolveIndex(long index, size_t count)
+{
+  /* OBJ indices start at 1, negative ones are relative to the end */
+  long resolved = index > 0 ? index - 1 : (long) count + index;
+  if (index == 0 || resolved < 0 || (size_t) resolved >= count)
+    throw std::runtime_error("Invalid face index at line " + std::to_string(lineNumber));
+  return (uint32_t) resolved;
+}
+
+void ObjStreamParser::addCorner(long position, long texcoord)
+{
+  uint32_t positionIndex = resolveIndex(position, positions.size() / 3);
+  uint32_t texcoordIndex = texcoord ? resolveIndex(texcoord, texcoords.size() / 2) : UINT32_MAX;
+
+  bool inserted;
+  uint32_t index = uniqueVertices.insert(positionIndex, texcoordIndex, vertexCount, inserted);
+  if (inserted) {
+    Vertex vertex = {};
+    vertex.pos = {
+      positions[3 * positionIndex + 0],
+      positions[3 * positionIndex + 1],
+      positions[3 * positionIndex + 2]
+    };
+    if (texcoordIndex != UINT32_MAX) {
+      vertex.texCoord = {
+        texcoords[2 * texcoordIndex + 0],
+        1.0f - texcoords[2 * texcoordIndex + 1]
+      };
+    }
+    vertex.color = {1.0f, 1.0f, 1.0f};
+    pendingVertices.push_back(vertex);
+    vertexCount++;
+  }
+
+  polygon.push_back(index);
+}
+
+void ObjStreamParser::parseLine(const char *p, const char *end)
+{
+  lineNumber++;
+  p = skipSpaces(p, end);
+
+  if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+    p += 2;
+    for (unsigned i = 0; i < 3; i++)
+      positions.push_back(parseFloat(p, end));
+    stats.positions++;
+  } else if (p + 2 < end && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+    p += 3;
+    for (unsigned i = 0; i < 2; i++)
+      texcoords.push_back(parseFloat(p, end));
+    stats.texcoords++;
+  } else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+    p += 2;
+    polygon.clear();
+
+    /* Corners are v, v/vt, v//vn or v/vt/vn */
+    while ((p = skipSpaces(p, end)) < end && *p != '\n') {
+      char *next;
+      if (!startsNumber(p, end))
+        throw std::runtime_error("Invalid face at line " + std::to_string(lineNumber));
+      long position = strtol(p, &next, 10);
+      p = next;
+
+      long texcoord = 0;
+      if (*p == '/') {
+        p++;
+        if (startsNumber(p, end)) {
+          texcoord = strtol(p, &next, 10);
+          p = next;
+        }
+        if (*p == '/') {
+          p++;
+          if (startsNumber(p, end)) {
+            strtol(p, &next, 10);
+            p = next;
+          }
+        }
+      }
+
+      addCorner(position, texcoord);
+    }
+
+    /* Fan triangulation */
+    for (size_t i = 2; i < polygon.size(); i++) {
+      pendingIndices.push_back(polygon[0]);
+      pendingIndices.push_back(polygon[i - 1]);
+      pendingIndices.push_back(polygon[i]);
+    }
+  }
+
+  if (pendingVertices.size() >= SINK_BATCH_SIZE || pendingIndices.size() >= SINK_BATCH_SIZE)
+    flush();
+}
+
+void ObjStreamParser::flush()
+{
+  /* Vertices first, the indices may refer to them */
+  if (!pendingVertices.empty())
+    sink.addVertices(pendingVertices.data(), pendingVertices.size());
+  if (!pendingIndices.empty())
+    sink.addIndices(pendingIndices.data(), pendingIndices.size());
+
+  stats.vertices += pendingVertices.size();
+  stats.indices += pendingIndices.size();
+  pendingVertices.clear();
+  pendingIndices.clear();
+}
+
+void ObjStreamParser::updatePeak(size_t bufferBytes)
+{
+  size_t bytes = bufferBytes +
+    positions.capacity() * sizeof(float) +
+    texcoords.capacity() * sizeof(float) +
+    uniqueVertices.memoryBytes() +
+    pendingVertices.capacity() * sizeof(Vertex) +
+    pendingIndices.capacity() * sizeof(uint32_t);
+  stats.peakBytes = std::max(stats.peakBytes, bytes);
+}
+
+ObjStreamStats streamObj(const std::string &filename, MeshSink &sink)
+{
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (!file)
+    throw std::runtime_error("Error opening " + filename);
+
+  ObjStreamParser parser(sink);
+  /* Complete lines are parsed, the incomplete tail is carried over to the
+   * beginning of the buffer before reading the next chunk.
+   */
+  std::vector<char> buffer(READ_CHUNK_SIZE + 1);
+  size_t carry = 0;
+  bool eof = false;
+
+  try {
+    while (!eof) {
+      /* A line longer than the buffer, make room for it */
+      if (buffer.size() - 1 - carry < READ_CHUNK_SIZE / 2)
+        buffer.resize(buffer.size() * 2);
+
+      size_t read = fread(buffer.data() + carry, 1, buffer.size() - 1 - carry, file);
+      if (read == 0 && ferror(file))
+        throw std::runtime_error("Error reading " + filename);
+
+      parser.stats.bytesRead += read;
+      size_t size = carry + read;
+      eof = read == 0 || feof(file);
+
+      /* The last line may lack its newline */
+      if (eof && size > 0 && buffer[size - 1] != '\n')
+        buffer[size++] = '\n';
+
+      const char *line = buffer.data();
+      const char *end = buffer.data() + size;
+      const char *newline;
+      while ((newline = static_cast<const char *>(memchr(line, '\n', end - line)))) {
+        parser.parseLine(line, newline + 1);
+        line = newline + 1;
+      }
+
+      carry = end - line;
+      memmove(buffer.data(), line, carry);
+      parser.updatePeak(buffer.capacity());
+    }
+
+    parser.flush();
+  } catch (...) {
+    fclose(file);
+    throw;
+  }
+
+  fclose(file);
+  return parser.stats;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "vk-mesh.h"
+
+/* Receives the output of the streaming importer in batches, in order.
+ * Indices may only refer to vertices already added.
+ */
+class MeshSink {
+ public:
+  virtual ~MeshSink() {};
+  virtual void     addVertices(const Vertex *vertices, size_t count) = 0;
+  virtual void     addIndices(const uint32_t *indices, size_t count) = 0;
+};
+
+struct ObjStreamStats {
+  uint64_t         bytesRead;
+  size_t           positions;
+  size_t           texcoords;
+  size_t           vertices;
+  size_t           indices;
+  /* Largest working memory of the parser: read buffer, position and
+   * texcoord arrays, deduplication table and pending batches. The output
+   * kept by the sink is not included.
+   */
+  size_t           peakBytes;
+};
+
+/* Imports an OBJ file reading it in fixed size chunks, so the file is never
+ * held in memory as a whole. Faces are triangulated as fans and their
+ * corners deduplicated by their position/texcoord index pair and sent to
+ * the sink right away. The position and texcoord arrays (which faces can
+ * refer to at any point) and the deduplication table still grow with the
+ * model, as does whatever the sink keeps. Throws on errors.
+ */
+ObjStreamStats streamObj(const std::string &filename, MeshSink &sink);
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <stdexcept>
+
+#include "vk-pipeline-cache.h"
+#include "vk-bench.h"
+#include "vk-util.h"
+
+/* Header at the start of the data of every pipeline cache, defined by the
+ * Vulkan spec (VK_PIPELINE_CACHE_HEADER_VERSION_ONE).
+ */
+struct PipelineCacheHeader {
+  uint32_t         headerSize;
+  uint32_t         headerVersion;
+  uint32_t         vendorID;
+  uint32_t         deviceID;
+  uint8_t          pipelineCacheUUID[VK_UUID_SIZE];
+};
+
+static bool readCacheFile(const std::string &filename, std::vector<char> &data)
+{
+  std::ifstream file(filename, std::ios::ate | std::ios::binary);
+  if (!file.is_open())
+    return false;
+
+  data.resize((size_t) file.tellg());
+  file.seekg(0);
+  file.read(data.data(), data.size());
+  return file.good();
+}
+
+bool PipelineCache::validHeader(const std::vector<char> &data) const
+{
+  PipelineCacheHeader header;
+  if (data.size() < sizeof(header))
+    return false;
+
+  memcpy(&header, data.data(), sizeof(header));
+  return header.headerSize >= sizeof(header) && header.headerSize <= data.size() &&
+         header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+         header.vendorID == properties.vendorID &&
+         header.deviceID == properties.deviceID &&
+         memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void PipelineCache::init(VkPhysicalDevice phyDevice, VkDevice dev, const std::string &file)
+{
+  BenchClock::time_point start = BenchClock::now();
+  device = dev;
+  filename = file;
+  vkGetPhysicalDeviceProperties(phyDevice, &properties);
+
+  std::vector<char> data;
+  if (!filename.empty() && readCacheFile(filename, data)) {
+    if (!validHeader(data)) {
+      printf("Pipeline cache %s was created by another device or driver, ignoring it\n", filename.c_str());
+      data.clear();
+    }
+  }
+
+  VkPipelineCacheCreateInfo cacheInfo = {};
+  cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  cacheInfo.initialDataSize = data.size();
+  cacheInfo.pInitialData = data.empty() ? VK_NULL_HANDLE : data.data();
+
+  VkResult res = vkCreatePipelineCache(device, &cacheInfo, VK_NULL_HANDLE, &cache);
+  if (res != VK_SUCCESS && !data.empty()) {
+    /* The header matched but the driver still refused the data */
+    printf("Pipeline cache %s rejected by the driver, starting empty\n", filename.c_str());
+    data.clear();
+    cacheInfo.initialDataSize = 0;
+    cacheInfo.pInitialData = VK_NULL_HANDLE;
+    res = vkCreatePipelineCache(device, &cacheInfo, VK_NULL_HANDLE, &cache);
+  }
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating pipeline cache");
+
+  loadedSize = data.size();
+  loadedHash = hashBytes(data.data(), data.size());
+  loadMs = elapsedMs(start, BenchClock::now());
+
+  if (loadedSize)
+    printf("Loaded pipeline cache %s in %.2f ms: %zu bytes\n", filename.c_str(), loadMs, loadedSize);
+  else
+    printf("Created empty pipeline cache\n");
+}
+
+void PipelineCache::save()
+{
+  if (cache == VK_NULL_HANDLE || filename.empty())
+    return;
+
+  size_t size = 0;
+  VkResult res = vkGetPipelineCacheData(device, cache, &size, VK_NULL_HANDLE);
+  if (res != VK_SUCCESS || size == 0)
+    return;
+
+  std::vector<char> data(size);
+  res = vkGetPipelineCacheData(device, cache, &size, data.data());
+  if (res != VK_SUCCESS)
+    return;
+  data.resize(size);
+
+  /* Nothing new, e.g. every pipeline was a hit */
+  if (size == loadedSize && hashBytes(data.data(), data.size()) == loadedHash)
+    return;
+
+  if (writeFileAtomic(filename, data.data(), data.size()))
+    printf("Saved pipeline cache to %s: %zu bytes\n", filename.c_str(), size);
+  else
+    printf("Failed to save pipeline cache to %s\n", filename.c_str());
+}
+
+void PipelineCache::destroy()
+{
+  if (cache != VK_NULL_HANDLE)
+    vkDestroyPipelineCache(device, cache, VK_NULL_HANDLE);
+  cache = VK_NULL_HANDLE;
+}
+
+void PipelineCache::recordCreation(double ms, int hit)
+{
+  pipelines++;
+  createMs += ms;
+  if (hit > 0)
+    hits++;
+  else if (hit == 0)
+    misses++;
+}
+
+void PipelineCache::printStats() const
+{
+  printf("Pipeline cache: %s start, loaded in %.2f ms, %u pipelines created in %.2f ms",
+         loadedSize ? "warm" : "cold", loadMs, pipelines, createMs);
+  if (hits + misses)
+    printf(", %u hits, %u misses\n", hits, misses);
+  else
+    printf(", hits not reported by the driver\n");
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* VkPipelineCache persisted in a file between runs. The file holds the
+ * data returned by vkGetPipelineCacheData(), which is only reused when its
+ * header matches the device and driver (vendor, device and cache UUID), so
+ * another GPU or a driver update starts with an empty cache.
+ */
+class PipelineCache {
+ public:
+  void             init(VkPhysicalDevice phyDevice, VkDevice device, const std::string &filename);
+  /* Writes the cache data if it changed since it was loaded */
+  void             save();
+  void             destroy();
+
+  VkPipelineCache  handle() const { return cache; }
+
+  /* Records a pipeline creation. hit is 1 or 0 when the driver reported
+   * whether the cache had it (VK_EXT_pipeline_creation_feedback), -1 otherwise.
+   */
+  void             recordCreation(double ms, int hit);
+  void             printStats() const;
+
+ private:
+  bool             validHeader(const std::vector<char> &data) const;
+
+  VkDevice         device = VK_NULL_HANDLE;
+  VkPipelineCache  cache = VK_NULL_HANDLE;
+  std::string      filename;
+  VkPhysicalDeviceProperties properties;
+
+  size_t           loadedSize = 0;
+  uint64_t         loadedHash = 0;
+  double           loadMs = 0.0;
+  unsigned         pipelines = 0;
+  unsigned         hits = 0;
+  unsigned         misses = 0;
+  double           createMs = 0.0;
+};
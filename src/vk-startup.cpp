@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <algorithm>
+
+#include "vk-startup.h"
+
+/* Width of the timeline bars, in characters */
+static const unsigned TIMELINE_WIDTH = 40;
+
+unsigned StartupGraph::add(const std::string &name, TaskThread thread, const std::vector<unsigned> &deps,
+                           std::function<void()> task)
+{
+  Task entry = {};
+  entry.name = name;
+  entry.thread = thread;
+  entry.deps = deps;
+  entry.function = task;
+  tasks.push_back(entry);
+  return (unsigned) tasks.size() - 1;
+}
+
+bool StartupGraph::depsDone(const Task &task) const
+{
+  for (unsigned dep : task.deps) {
+    if (!tasks[dep].done)
+      return false;
+  }
+  return true;
+}
+
+std::exception_ptr StartupGraph::depsError(const Task &task) const
+{
+  for (unsigned dep : task.deps) {
+    if (tasks[dep].error)
+      return tasks[dep].error;
+  }
+  return std::exception_ptr();
+}
+
+/* Runs a task and records when. Called without the lock held. */
+void StartupGraph::execute(unsigned index)
+{
+  Task &task = tasks[index];
+  std::exception_ptr error;
+
+  double startMs = elapsedMs(origin, BenchClock::now());
+  try {
+    task.function();
+  } catch (...) {
+    error = std::current_exception();
+  }
+  double endMs = elapsedMs(origin, BenchClock::now());
+
+  std::lock_guard<std::mutex> lock(mutex);
+  task.startMs = startMs;
+  task.endMs = endMs;
+  task.error = error;
+  task.ran = true;
+  task.done = true;
+  launchReady();
+  taskDone.notify_all();
+}
+
+/* Starts the worker tasks whose dependencies are done. Called with the lock
+ * held. Tasks depending on a failed one fail without running.
+ */
+void StartupGraph::launchReady()
+{
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (unsigned i = 0; i < tasks.size(); i++) {
+      Task &task = tasks[i];
+      if (task.thread != TASK_WORKER || task.launched || aborting || !depsDone(task))
+        continue;
+
+      task.launched = true;
+      std::exception_ptr error = depsError(task);
+      if (error) {
+        task.error = error;
+        task.done = true;
+        progress = true;
+        continue;
+      }
+
+      threads.push_back(std::thread(&StartupGraph::execute, this, i));
+    }
+  }
+}
+
+void StartupGraph::run()
+{
+  origin = BenchClock::now();
+  std::exception_ptr error;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    launchReady();
+  }
+
+  for (unsigned i = 0; i < tasks.size() && !error; i++) {
+    if (tasks[i].thread != TASK_MAIN)
+      continue;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      taskDone.wait(lock, [this, i]() { return depsDone(tasks[i]); });
+      error = depsError(tasks[i]);
+      tasks[i].launched = !error;
+    }
+
+    if (!error) {
+      execute(i);
+      error = tasks[i].error;
+    }
+  }
+
+  /* Worker threads reference this graph and whatever their tasks capture,
+   * they must be done before returning, even on errors.
+   */
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (error)
+      aborting = true;
+    taskDone.wait(lock, [this]() {
+      for (const Task &task : tasks) {
+        if (task.launched && !task.done)
+          return false;
+      }
+      return true;
+    });
+  }
+
+  for (auto &thread : threads)
+    thread.join();
+  threads.clear();
+
+  totalMs = elapsedMs(origin, BenchClock::now());
+
+  for (const Task &task : tasks) {
+    if (!error && task.error)
+      error = task.error;
+  }
+  if (error)
+    std::rethrow_exception(error);
+}
+
+void StartupGraph::printTimeline() const
+{
+  printf("Startup timeline: %.2f ms\n", totalMs);
+  printf("  %-18s %-6s %9s %9s %9s\n", "task", "thread", "start", "end", "ms");
+
+  double scale = totalMs > 0.0 ? TIMELINE_WIDTH / totalMs : 0.0;
+  for (const Task &task : tasks) {
+    if (!task.ran) {
+      printf("  %-18s %-6s %9s\n", task.name.c_str(), task.thread == TASK_MAIN ? "main" : "worker",
+             "skipped");
+      continue;
+    }
+
+    char bar[TIMELINE_WIDTH + 1];
+    unsigned begin = std::min((unsigned) (task.startMs * scale), TIMELINE_WIDTH - 1);
+    unsigned end = std::max(std::min((unsigned) (task.endMs * scale + 0.5), TIMELINE_WIDTH), begin + 1);
+    for (unsigned c = 0; c < TIMELINE_WIDTH; c++)
+      bar[c] = c >= begin && c < end ? '#' : '.';
+    bar[TIMELINE_WIDTH] = '\0';
+
+    printf("  %-18s %-6s %9.2f %9.2f %9.2f %s\n", task.name.c_str(),
+           task.thread == TASK_MAIN ? "main" : "worker",
+           task.startMs, task.endMs, task.endMs - task.startMs, bar);
+  }
+
+  if (tasks.empty())
+    return;
+
+  /* Walk back from the last task to finish. A task waited on the latest of
+   * its dependencies and, on the main thread, on the previous main task.
+   */
+  std::vector<int> previousMain(tasks.size(), -1);
+  int lastMain = -1;
+  for (unsigned i = 0; i < tasks.size(); i++) {
+    if (tasks[i].thread != TASK_MAIN)
+      continue;
+    previousMain[i] = lastMain;
+    lastMain = (int) i;
+  }
+
+  int current = 0;
+  for (unsigned i = 1; i < tasks.size(); i++) {
+    if (tasks[i].endMs > tasks[current].endMs)
+      current = (int) i;
+  }
+
+  std::vector<unsigned> path;
+  while (current >= 0) {
+    path.push_back((unsigned) current);
+
+    const Task &task = tasks[current];
+    int next = previousMain[current];
+    for (unsigned dep : task.deps) {
+      if (next < 0 || tasks[dep].endMs > tasks[next].endMs)
+        next = (int) dep;
+    }
+    current = next;
+  }
+
+  printf("  critical path:");
+  for (size_t i = path.size(); i-- > 0;)
+    printf(" %s%s", tasks[path[i]].name.c_str(), i ? " ->" : "\n");
+}
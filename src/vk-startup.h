@@ -0,0 +1,63 @@
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vk-bench.h"
+
+/* Startup work as a small task graph. Main tasks run on the calling thread,
+ * which owns the window and the Vulkan objects, in the order they were
+ * added. Worker tasks touch neither: each one gets its own thread as soon as
+ * its dependencies are done, so CPU-only work (asset decoding, model import)
+ * overlaps with the Vulkan setup. They are not ThreadPool tasks, so they can
+ * use the pool themselves.
+ */
+class StartupGraph {
+ public:
+  enum TaskThread {
+    TASK_MAIN,
+    TASK_WORKER,
+  };
+
+  unsigned         add(const std::string &name, TaskThread thread, const std::vector<unsigned> &deps,
+                       std::function<void()> task);
+  /* Runs all the tasks and rethrows the first error, once every started
+   * worker task is done.
+   */
+  void             run();
+
+  /* When each task ran, and the chain of tasks that bounded the total time */
+  void             printTimeline() const;
+
+ private:
+  struct Task {
+    std::string           name;
+    TaskThread            thread;
+    std::vector<unsigned> deps;
+    std::function<void()> function;
+    bool                  launched;
+    bool                  ran;
+    bool                  done;
+    std::exception_ptr    error;
+    double                startMs;
+    double                endMs;
+  };
+
+  void             execute(unsigned task);
+  void             launchReady();
+  bool             depsDone(const Task &task) const;
+  std::exception_ptr depsError(const Task &task) const;
+
+  std::vector<Task>        tasks;
+  std::vector<std::thread> threads;
+  std::mutex               mutex;
+  std::condition_variable  taskDone;
+  bool                     aborting = false;
+  BenchClock::time_point   origin;
+  double                   totalMs = 0.0;
+};
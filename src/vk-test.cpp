@@ -4,11 +4,12 @@
 #include <stdexcept>
 #include <algorithm>
 #include <array>
-#include <unordered_map>
+#include <cmath>
 
 // For rotating MVP matrices
 #include <glm/gtc/matrix_transform.hpp>
 #include <chrono>
+#include <inttypes.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
@@ -18,13 +19,46 @@
 
 #include "vk-test.h"
 #include "vk-util.h"
-
-const int WIDTH = 800;
-const int HEIGHT = 600;
-const int MAX_FRAMES_IN_FLIGHT = 2;
+#include "vk-vertex-dedup.h"
+#include "vk-obj-stream.h"
+#include "vk-mesh-opt.h"
+#include "vk-mesh-pack.h"
+#include "vk-mesh-simplify.h"
+#include "vk-startup.h"
+
+/* Frames rendered in headless mode when no --frames count is given */
+const uint64_t HEADLESS_DEFAULT_FRAMES = 100;
+/* Frames measured in benchmark mode when neither --frames nor --duration are given */
+const uint64_t BENCH_DEFAULT_FRAMES = 1000;
+/* Timestamp queries available for init-time uploads (begin/end pairs) */
+const uint32_t UPLOAD_QUERY_COUNT = 128;
+/* Draws below which recording them in another secondary doesn't pay off */
+const uint32_t MIN_DRAWS_PER_RECORD_JOB = 256;
+/* Objects whose meshlets are culled by each job, at least */
+const uint32_t MIN_OBJECTS_PER_CLUSTER_JOB = 8;
+/* Levels of detail simplified from the model, each one with half the
+ * triangles of the previous; the chain stops early when a level can't get
+ * below 80% of the previous.
+ */
+const unsigned LOD_MAX_LEVELS = 5;
+const float LOD_RATIO = 0.5f;
+const float LOD_MAX_RATIO = 0.8f;
+/* Depth range of the camera. The near plane is also the closest distance
+ * the error of a level of detail is projected at.
+ */
+const float CAMERA_NEAR = 0.1f;
+const float CAMERA_FAR = 10.0f;
+/* Seconds between GPU frame time and input latency log lines */
+const double GPU_TIMING_LOG_INTERVAL = 2.0;
 
 const std::string MODEL_PATH = "src/models/chalet.obj";
+const std::string MODEL_CACHE_PATH = MODEL_PATH + ".cache";
+/* Corners deduplicated by each import task */
+const size_t IMPORT_CHUNK_CORNERS = 1 << 20;
+/* Vertex cache efficiency that can be traded for less overdraw, 5% */
+const float MESH_OPT_OVERDRAW_THRESHOLD = 1.05f;
 const std::string TEXTURE_PATH = "src/textures/chalet.jpg";
+const std::string PIPELINE_CACHE_PATH = "src/shaders/pipeline.cache";
 
 std::vector<const char*> validationLayers = {
     "VK_LAYER_KHRONOS_validation"
@@ -46,6 +80,39 @@ void DestroyDebugReportCallbackEXT(VkInstance instance, VkDebugReportCallbackEXT
   }
 }
 
+static const char *presentModeName(VkPresentModeKHR mode)
+{
+  switch (mode) {
+  case VK_PRESENT_MODE_IMMEDIATE_KHR:
+    return "immediate";
+  case VK_PRESENT_MODE_MAILBOX_KHR:
+    return "mailbox";
+  case VK_PRESENT_MODE_FIFO_KHR:
+    return "fifo";
+  case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+    return "fifo-relaxed";
+  default:
+    return "unknown";
+  }
+}
+
+/* Picks the requested present mode if the surface supports it. Otherwise
+ * immediate falls back to mailbox, as both avoid waiting for the vertical
+ * blank, and the rest to FIFO, which is always supported.
+ */
+static VkPresentModeKHR choosePresentMode(VkPresentModeKHR requested, const std::vector<VkPresentModeKHR> &supported)
+{
+  std::vector<VkPresentModeKHR> candidates = {requested};
+  if (requested == VK_PRESENT_MODE_IMMEDIATE_KHR)
+    candidates.push_back(VK_PRESENT_MODE_MAILBOX_KHR);
+
+  for (VkPresentModeKHR candidate : candidates) {
+    if (std::find(supported.begin(), supported.end(), candidate) != supported.end())
+      return candidate;
+  }
+  return VK_PRESENT_MODE_FIFO_KHR;
+}
+
 static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(VkDebugReportFlagsEXT flags, VkDebugReportObjectTypeEXT objType, uint64_t obj, size_t location, int32_t code, const char* layerPrefix, const char* msg, void* userData)
 {
   std::cerr << "validation layer: " << msg << std::endl;
@@ -105,7 +172,7 @@ void VulkanTest::initWindow()
   /* Window is resizable */
   glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
-  window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", NULL, NULL);
+  window = glfwCreateWindow(options.width, options.height, "Vulkan", NULL, NULL);
   glfwSetWindowUserPointer(window, this);
   glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
 }
@@ -122,13 +189,16 @@ void VulkanTest::createInstance()
   applicationInfo.engineVersion = 0;
   applicationInfo.apiVersion = VK_API_VERSION_1_0;
 
-  unsigned requiredInstanceExtensionsCount = 0;
-  const char **instanceExtensionsGLFW;
-  instanceExtensionsGLFW = glfwGetRequiredInstanceExtensions(&requiredInstanceExtensionsCount);
-  printf("Required instance extensions for GLFW: \n");
-  for (unsigned i = 0; i < requiredInstanceExtensionsCount; i++) {
-    instanceExtensions.push_back(instanceExtensionsGLFW[i]);
-    printf("\t%s\n", instanceExtensionsGLFW[i]);
+  /* Headless mode doesn't present anything, so it doesn't need any WSI extension */
+  if (!options.headless) {
+    unsigned requiredInstanceExtensionsCount = 0;
+    const char **instanceExtensionsGLFW;
+    instanceExtensionsGLFW = glfwGetRequiredInstanceExtensions(&requiredInstanceExtensionsCount);
+    printf("Required instance extensions for GLFW: \n");
+    for (unsigned i = 0; i < requiredInstanceExtensionsCount; i++) {
+      instanceExtensions.push_back(instanceExtensionsGLFW[i]);
+      printf("\t%s\n", instanceExtensionsGLFW[i]);
+    }
   }
 
   if (ENABLE_DEBUG)
@@ -147,7 +217,7 @@ void VulkanTest::createInstance()
   createInfo.enabledLayerCount = (unsigned)validationLayers.size();
   createInfo.ppEnabledLayerNames = &validationLayers[0];
   createInfo.enabledExtensionCount = (unsigned)instanceExtensions.size();
-  createInfo.ppEnabledExtensionNames = &instanceExtensions[0];
+  createInfo.ppEnabledExtensionNames = instanceExtensions.data();
 
   /* Creating the instance */
   res = vkCreateInstance(&createInfo, VK_NULL_HANDLE, &instance);
@@ -169,6 +239,9 @@ void VulkanTest::createDevice()
   if (res != VK_SUCCESS)
      throw std::runtime_error("Error enumerating devices");
 
+  if (count == 0)
+    throw std::runtime_error("No Vulkan devices found");
+
   physicalDevices.resize(count);
 
   res = vkEnumeratePhysicalDevices(instance, &count, physicalDevices.data());
@@ -186,11 +259,14 @@ void VulkanTest::createDevice()
   /* Choose the best one */
   phyDevice = physicalDevices[0];
 #else
-  /* Select the first one */
-  phyDevice = physicalDevices[0];
+  /* Select the one asked by the user, the first one by default */
+  if (options.deviceIndex >= count)
+    throw std::runtime_error("Requested device index is not available");
+  phyDevice = physicalDevices[options.deviceIndex];
 #endif
   VkPhysicalDeviceProperties physicalDeviceProperties;
   vkGetPhysicalDeviceProperties(phyDevice, &physicalDeviceProperties);
+  printf("Using device %u: %s\n", options.deviceIndex, physicalDeviceProperties.deviceName);
 
   VkSampleCountFlags counts = std::min(physicalDeviceProperties.limits.framebufferColorSampleCounts, physicalDeviceProperties.limits.framebufferDepthSampleCounts);
   if (counts & VK_SAMPLE_COUNT_64_BIT) { msaaSamples = VK_SAMPLE_COUNT_64_BIT; }
@@ -201,6 +277,9 @@ void VulkanTest::createDevice()
   else if (counts & VK_SAMPLE_COUNT_2_BIT) { msaaSamples = VK_SAMPLE_COUNT_2_BIT; }
   else msaaSamples = VK_SAMPLE_COUNT_1_BIT;
 
+  /* Timestamps are converted to ms later with timestampPeriod (ns per tick) */
+  timestampPeriod = physicalDeviceProperties.limits.timestampPeriod;
+
   VkPhysicalDeviceFeatures supportedFeatures;
   vkGetPhysicalDeviceFeatures(phyDevice, &supportedFeatures);
 
@@ -211,6 +290,14 @@ void VulkanTest::createDevice()
   if (!supportedFeatures.samplerAnisotropy)
     throw std::runtime_error("Device doesn't support anisotropy sampling");
 
+  /* GPU culling needs firstInstance in indirect draws to select the object */
+  if (options.gpuCull && !supportedFeatures.drawIndirectFirstInstance) {
+    printf("Device doesn't support drawIndirectFirstInstance, GPU culling disabled\n");
+    options.gpuCull = false;
+  }
+  if (supportedFeatures.multiDrawIndirect)
+    maxDrawIndirectCount = physicalDeviceProperties.limits.maxDrawIndirectCount;
+
   /* Ask for queues properties, etc */
   vkGetPhysicalDeviceQueueFamilyProperties(phyDevice, &count, VK_NULL_HANDLE);
   if (res != VK_SUCCESS)
@@ -231,9 +318,54 @@ void VulkanTest::createDevice()
   if (queueGraphicsFamilyIndex < 0)
     throw std::runtime_error("Device doesn't have a graphics queue useful for us");
 
-  /* Presentation queue */
-  queuePresentationFamilyIndex = -1;
+  if (options.gpuCull && !(queueFamilyProperties[queueGraphicsFamilyIndex].queueFlags & VK_QUEUE_COMPUTE_BIT)) {
+    printf("Graphics queue doesn't support compute, GPU culling disabled\n");
+    options.gpuCull = false;
+  }
+
+  /* CPU culling selects the objects drawn one by one */
+  if (options.cpuCull && (options.gpuCull || options.instanced)) {
+    printf("CPU culling only applies to non-instanced draws without GPU culling, disabled\n");
+    options.cpuCull = false;
+  }
+  clusterCull = options.meshlets && !options.gpuCull && !options.instanced;
+  lodSelect = options.lods && !options.gpuCull && !options.instanced;
+  if (options.lods && !lodSelect)
+    printf("LOD selection only applies to non-instanced draws without GPU culling, drawing level 0\n");
+  drawList = clusterCull || lodSelect;
+
+  uint32_t timestampValidBits = queueFamilyProperties[queueGraphicsFamilyIndex].timestampValidBits;
+  timestampsSupported = timestampValidBits > 0;
+  timestampMask = timestampValidBits >= 64 ? ~0ull : (1ull << timestampValidBits) - 1;
+  if (!timestampsSupported)
+    printf("Graphics queue doesn't support timestamps, GPU timings disabled\n");
+
+  /* Transfer queue: a family with transfer but neither graphics nor compute
+   * is usually a DMA engine, copying in parallel with rendering.
+   */
+  queueTransferFamilyIndex = queueGraphicsFamilyIndex;
   for (unsigned i = 0; i < count; i++) {
+    VkQueueFlags flags = queueFamilyProperties[i].queueFlags;
+    if (flags & VK_QUEUE_TRANSFER_BIT && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) &&
+        queueFamilyProperties[i].queueCount > 0) {
+      queueTransferFamilyIndex = i;
+      break;
+    }
+  }
+
+  transferTimestampsSupported = timestampsSupported &&
+    queueFamilyProperties[queueTransferFamilyIndex].timestampValidBits > 0;
+  if (queueTransferFamilyIndex != queueGraphicsFamilyIndex)
+    printf("Using dedicated transfer queue family %d\n", queueTransferFamilyIndex);
+
+  /* Presentation queue. There is no surface in headless mode, the graphics
+   * queue is used for everything.
+   */
+  queuePresentationFamilyIndex = -1;
+  if (options.headless)
+    queuePresentationFamilyIndex = queueGraphicsFamilyIndex;
+
+  for (unsigned i = 0; i < count && !options.headless; i++) {
     VkBool32 presentSupport = false;
     vkGetPhysicalDeviceSurfaceSupportKHR(phyDevice, i, surface, &presentSupport);
     if (presentSupport && queueFamilyProperties[i].queueCount > 0)
@@ -249,6 +381,9 @@ void VulkanTest::createDevice()
   uniqueQueueFamilies.push_back(queueGraphicsFamilyIndex);
   if (queuePresentationFamilyIndex != queueGraphicsFamilyIndex)
     uniqueQueueFamilies.push_back(queuePresentationFamilyIndex);
+  if (queueTransferFamilyIndex != queueGraphicsFamilyIndex &&
+      queueTransferFamilyIndex != queuePresentationFamilyIndex)
+    uniqueQueueFamilies.push_back(queueTransferFamilyIndex);
   for (unsigned i = 0; i < uniqueQueueFamilies.size(); i++) {
     float queuePriorities [] = { 0 };
     VkDeviceQueueCreateInfo queueCreateInfo = {};
@@ -261,9 +396,34 @@ void VulkanTest::createDevice()
     queueCreateInfos.push_back(queueCreateInfo);
   }
 
-  deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+  if (!options.headless)
+    deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+
+  /* Optional extensions */
+  uint32_t extensionCount = 0;
+  vkEnumerateDeviceExtensionProperties(phyDevice, VK_NULL_HANDLE, &extensionCount, VK_NULL_HANDLE);
+  std::vector<VkExtensionProperties> extensions(extensionCount);
+  vkEnumerateDeviceExtensionProperties(phyDevice, VK_NULL_HANDLE, &extensionCount, extensions.data());
+  bool drawIndirectCountSupported = false;
+  for (const auto &extension : extensions) {
+    if (strcmp(extension.extensionName, VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME) == 0)
+      creationFeedbackSupported = true;
+    if (strcmp(extension.extensionName, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME) == 0)
+      drawIndirectCountSupported = true;
+  }
+  if (creationFeedbackSupported)
+    deviceExtensions.push_back(VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+  /* Compacted draws are only worth it with more than one draw per call */
+  drawIndirectCountSupported &= supportedFeatures.multiDrawIndirect == VK_TRUE;
+  if (options.gpuCull && drawIndirectCountSupported)
+    deviceExtensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+
   VkPhysicalDeviceFeatures deviceFeatures = {};
   deviceFeatures.samplerAnisotropy = VK_TRUE;
+  if (options.gpuCull) {
+    deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+    deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+  }
 
   VkDeviceCreateInfo deviceCreateInfo = {};
   deviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -274,7 +434,7 @@ void VulkanTest::createDevice()
   deviceCreateInfo.enabledLayerCount = 0;
   deviceCreateInfo.ppEnabledLayerNames = VK_NULL_HANDLE;
   deviceCreateInfo.enabledExtensionCount = (unsigned)deviceExtensions.size();
-  deviceCreateInfo.ppEnabledExtensionNames = &deviceExtensions[0];
+  deviceCreateInfo.ppEnabledExtensionNames = deviceExtensions.data();
   deviceCreateInfo.pEnabledFeatures = &deviceFeatures;
 
   res = vkCreateDevice(phyDevice, &deviceCreateInfo, VK_NULL_HANDLE, &device);
@@ -282,6 +442,12 @@ void VulkanTest::createDevice()
     throw std::runtime_error("Error creating device");
 
   printf("Created logical device\n");
+
+  if (options.gpuCull && drawIndirectCountSupported)
+    drawIndirectCount = (PFN_vkCmdDrawIndexedIndirectCountKHR)
+      vkGetDeviceProcAddr(device, "vkCmdDrawIndexedIndirectCountKHR");
+
+  allocator.init(phyDevice, device);
 }
 
 void VulkanTest::getQueue()
@@ -289,6 +455,7 @@ void VulkanTest::getQueue()
   /* Get queue */
   vkGetDeviceQueue(device, queueGraphicsFamilyIndex, 0, &graphicsQueue);
   vkGetDeviceQueue(device, queuePresentationFamilyIndex, 0, &presentQueue);
+  vkGetDeviceQueue(device, queueTransferFamilyIndex, 0, &transferQueue);
 }
 
 void VulkanTest::createSurface()
@@ -314,26 +481,81 @@ void VulkanTest::createCommandPool()
   res = vkCreateCommandPool(device, &cmdPoolInfo, VK_NULL_HANDLE, &cmdPool);
   if (res != VK_SUCCESS)
     throw std::runtime_error("Error creating command pool");
+
+  VkFenceCreateInfo fenceInfo = {};
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  res = vkCreateFence(device, &fenceInfo, VK_NULL_HANDLE, &setupFence);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating setup fence");
+
+  VkSemaphoreCreateInfo semaphoreInfo = {};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  res = vkCreateSemaphore(device, &semaphoreInfo, VK_NULL_HANDLE, &setupSemaphore);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating setup semaphore");
 }
 
-void VulkanTest::createCommandBuffers()
+/* Per frame in flight: a pool for the primary and one for each recording
+ * job, so that jobs record their secondaries in parallel without locking.
+ * The draw list is split in as many jobs as threads, but jobs get at least
+ * MIN_DRAWS_PER_RECORD_JOB draws, as each secondary has a fixed cost. With
+ * CPU culling there are enough jobs for everything being visible.
+ */
+void VulkanTest::createFrameCommands()
 {
   VkResult res = VK_SUCCESS;
-  /* Create command buffers */
-  commandBuffers.resize(swapChainFramebuffers.size());
+  uint32_t draws = options.cpuCull || drawList ? options.objects * meshLods[0].chunkCount : drawCount();
+  uint32_t jobs = std::min(threadPool.size() + 1,
+                           (draws + MIN_DRAWS_PER_RECORD_JOB - 1) / MIN_DRAWS_PER_RECORD_JOB);
+  jobs = std::max(jobs, 1u);
+
+  VkCommandPoolCreateInfo cmdPoolInfo = {};
+  cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  cmdPoolInfo.queueFamilyIndex = queueGraphicsFamilyIndex;
 
   VkCommandBufferAllocateInfo cmd = {};
   cmd.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  cmd.pNext = VK_NULL_HANDLE;
-  cmd.commandPool = cmdPool;
-  cmd.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  cmd.commandBufferCount = (unsigned) swapChainFramebuffers.size();
+  cmd.commandBufferCount = 1;
 
-  res = vkAllocateCommandBuffers(device, &cmd, commandBuffers.data());
-  if (res != VK_SUCCESS)
-    throw std::runtime_error("Error creating command buffer");
+  frameCommands.resize(options.framesInFlight);
+  for (FrameCommands &frame : frameCommands) {
+    res = vkCreateCommandPool(device, &cmdPoolInfo, VK_NULL_HANDLE, &frame.primaryPool);
+    if (res != VK_SUCCESS)
+      throw std::runtime_error("Error creating frame command pool");
 
-  printf("Created command buffers\n");
+    cmd.commandPool = frame.primaryPool;
+    cmd.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    res = vkAllocateCommandBuffers(device, &cmd, &frame.primary);
+    if (res != VK_SUCCESS)
+      throw std::runtime_error("Error creating command buffer");
+
+    frame.pools.resize(jobs);
+    frame.secondaries.resize(jobs);
+    for (uint32_t i = 0; i < jobs; i++) {
+      res = vkCreateCommandPool(device, &cmdPoolInfo, VK_NULL_HANDLE, &frame.pools[i]);
+      if (res != VK_SUCCESS)
+        throw std::runtime_error("Error creating frame command pool");
+
+      cmd.commandPool = frame.pools[i];
+      cmd.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+      res = vkAllocateCommandBuffers(device, &cmd, &frame.secondaries[i]);
+      if (res != VK_SUCCESS)
+        throw std::runtime_error("Error creating secondary command buffer");
+    }
+  }
+
+  printf("Created frame command buffers: %u draws recorded by %u jobs each frame\n", draws, jobs);
+}
+
+void VulkanTest::destroyFrameCommands()
+{
+  for (FrameCommands &frame : frameCommands) {
+    vkDestroyCommandPool(device, frame.primaryPool, VK_NULL_HANDLE);
+    for (VkCommandPool pool : frame.pools)
+      vkDestroyCommandPool(device, pool, VK_NULL_HANDLE);
+  }
+  frameCommands.clear();
 }
 
 void VulkanTest::createPipelineLayout()
@@ -351,13 +573,20 @@ void VulkanTest::createPipelineLayout()
 
   VkDescriptorSetLayoutBinding uboLayoutBinding = {};
   uboLayoutBinding.binding = 0;
-  uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   /* Uniform buffer only used in vertex shader */
   uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
   uboLayoutBinding.pImmutableSamplers = VK_NULL_HANDLE;
   uboLayoutBinding.descriptorCount = 1;
 
-  std::array<VkDescriptorSetLayoutBinding, 2> bindings  = {uboLayoutBinding, samplerLayoutBinding};
+  VkDescriptorSetLayoutBinding instanceLayoutBinding = {};
+  instanceLayoutBinding.binding = 2;
+  instanceLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  instanceLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  instanceLayoutBinding.pImmutableSamplers = VK_NULL_HANDLE;
+  instanceLayoutBinding.descriptorCount = 1;
+
+  std::array<VkDescriptorSetLayoutBinding, 3> bindings  = {uboLayoutBinding, samplerLayoutBinding, instanceLayoutBinding};
 
   VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo = {};
   descriptorSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -385,46 +614,89 @@ void VulkanTest::createPipelineLayout()
   printf("Created pipeline layout\n");
 }
 
+/* Only the swapchain-sized resources are recreated: the render pass and
+ * the pipeline depend on the formats and the sample count, not the extent.
+ * The frames in flight keep running: the old swapchain is passed as
+ * oldSwapchain and the old resources are destroyed once those frames are done.
+ */
 void VulkanTest::recreateSwapchain()
 {
-  vkDeviceWaitIdle(device);
+  BenchClock::time_point start = BenchClock::now();
 
-  destroySwapchain();
+  VkFormat oldFormat = swapChainImageFormat;
+  retireSwapchain();
   createSwapchain();
   createSwapchainImageViews();
-  createRenderPass();
+  if (swapChainImageFormat != oldFormat) {
+    VkPipeline oldPipeline = graphicsPipeline;
+    VkRenderPass oldRenderPass = renderPass;
+    deferDestroy([this, oldPipeline, oldRenderPass]() {
+      vkDestroyPipeline(device, oldPipeline, VK_NULL_HANDLE);
+      vkDestroyRenderPass(device, oldRenderPass, VK_NULL_HANDLE);
+    });
+    createRenderPass();
+    createPipeline();
+  }
   createDepthResources();
   createColorResources();
   createFramebuffer();
-  createPipeline();
-  createCommandBuffers();
-  recordCommandBuffers();
+  /* The layout transitions of the new attachments are left in the setup
+   * batch, drawFrame() submits them with the next frame.
+   */
+
+  printf("Recreated swapchain %ux%u in %.2f ms\n", swapChainExtent.width, swapChainExtent.height,
+         elapsedMs(start, BenchClock::now()));
 }
 
-void VulkanTest::destroySwapchain()
+/* Hands the swapchain-sized resources over to the deferred destruction, the
+ * frames in flight may still use them. The swapchain itself is kept, it is
+ * the oldSwapchain of the next one.
+ */
+void VulkanTest::retireSwapchain()
 {
-  vkFreeCommandBuffers(device, cmdPool, commandBuffers.size(), &commandBuffers[0]);
-  vkDestroyPipeline(device, graphicsPipeline, VK_NULL_HANDLE);
-  vkDestroyPipelineLayout(device, pipelineLayout, VK_NULL_HANDLE);
-  vkDestroyDescriptorSetLayout(device, setLayout, VK_NULL_HANDLE);
-
-  vkDestroyRenderPass(device, renderPass, VK_NULL_HANDLE);
-
-  for (unsigned i = 0; i < swapChainFramebuffers.size(); i++)
-    vkDestroyFramebuffer(device, swapChainFramebuffers[i], VK_NULL_HANDLE);
-
-  for (unsigned i = 0; i < swapChainImageViews.size(); i++)
-    vkDestroyImageView(device, swapChainImageViews[i], VK_NULL_HANDLE);
-
-  vkFreeMemory(device, depthImageMemory, VK_NULL_HANDLE);
-  vkDestroyImageView(device, depthImageView, VK_NULL_HANDLE);
-  vkDestroyImage(device, depthImage, VK_NULL_HANDLE);
+  std::vector<VkFramebuffer> oldFramebuffers = swapChainFramebuffers;
+  std::vector<VkImageView> oldImageViews = swapChainImageViews;
+  VkImage oldDepthImage = depthImage;
+  VkImageView oldDepthImageView = depthImageView;
+  MemoryAllocation oldDepthImageMemory = depthImageMemory;
+  VkImage oldColorImage = colorImage;
+  VkImageView oldColorImageView = colorImageView;
+  MemoryAllocation oldColorImageMemory = colorImageMemory;
+
+  deferDestroy([=]() mutable {
+    for (unsigned i = 0; i < oldFramebuffers.size(); i++)
+      vkDestroyFramebuffer(device, oldFramebuffers[i], VK_NULL_HANDLE);
+
+    for (unsigned i = 0; i < oldImageViews.size(); i++)
+      vkDestroyImageView(device, oldImageViews[i], VK_NULL_HANDLE);
+
+    allocator.free(oldDepthImageMemory);
+    vkDestroyImageView(device, oldDepthImageView, VK_NULL_HANDLE);
+    vkDestroyImage(device, oldDepthImage, VK_NULL_HANDLE);
+
+    allocator.free(oldColorImageMemory);
+    vkDestroyImageView(device, oldColorImageView, VK_NULL_HANDLE);
+    vkDestroyImage(device, oldColorImage, VK_NULL_HANDLE);
+  });
+
+  swapChainFramebuffers.clear();
+  swapChainImageViews.clear();
+}
 
-  vkFreeMemory(device, colorImageMemory, VK_NULL_HANDLE);
-  vkDestroyImageView(device, colorImageView, VK_NULL_HANDLE);
-  vkDestroyImage(device, colorImage, VK_NULL_HANDLE);
+/* Called once the device is idle */
+void VulkanTest::destroySwapchain()
+{
+  retireSwapchain();
+  flushDeferredDestroys();
 
-  vkDestroySwapchainKHR(device, swapChain, VK_NULL_HANDLE);
+  if (options.headless) {
+    for (unsigned i = 0; i < swapChainImages.size(); i++) {
+      vkDestroyImage(device, swapChainImages[i], VK_NULL_HANDLE);
+      allocator.free(offscreenImageMemory[i]);
+    }
+  } else {
+    vkDestroySwapchainKHR(device, swapChain, VK_NULL_HANDLE);
+  }
 }
 
 void VulkanTest::createSwapchain()
@@ -475,14 +747,30 @@ void VulkanTest::createSwapchain()
   if (surfaceFormat.format == VK_FORMAT_UNDEFINED)
     throw std::runtime_error("VK_FORMAT_B8G8R8A8_UNORM is not supported");
 
-  /* This presentation mode is always supported according to the spec */
-  VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  uint32_t presentModeCount;
+  vkGetPhysicalDeviceSurfacePresentModesKHR(phyDevice, surface, &presentModeCount, VK_NULL_HANDLE);
+  presentModes.resize(presentModeCount);
+  vkGetPhysicalDeviceSurfacePresentModesKHR(phyDevice, surface, &presentModeCount, presentModes.data());
+
+  VkPresentModeKHR presentMode = choosePresentMode(options.presentMode, presentModes);
+  if (presentMode != options.presentMode)
+    printf("Present mode %s is not supported, using %s\n", presentModeName(options.presentMode),
+           presentModeName(presentMode));
 
   /* Select the extend to current window size */
   swapChainExtent = {width, height};
 
   unsigned imageCount = (capabilities.minImageCount >= 2) ?
     capabilities.minImageCount : capabilities.minImageCount + 1;
+  if (options.swapchainImages) {
+    imageCount = std::max(options.swapchainImages, capabilities.minImageCount);
+    /* A maxImageCount of 0 means there is no limit */
+    if (capabilities.maxImageCount)
+      imageCount = std::min(imageCount, capabilities.maxImageCount);
+    if (imageCount != options.swapchainImages)
+      printf("%u swapchain images requested, the surface supports %u to %u\n", options.swapchainImages,
+             capabilities.minImageCount, capabilities.maxImageCount);
+  }
 
   VkSwapchainCreateInfoKHR createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
@@ -498,17 +786,162 @@ void VulkanTest::createSwapchain()
   createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
   createInfo.presentMode = presentMode;
   createInfo.clipped = VK_TRUE;
-  createInfo.oldSwapchain = VK_NULL_HANDLE;
+  /* Lets the implementation reuse the resources of the retired swapchain,
+   * and keeps presenting its images until the new one takes over.
+   */
+  VkSwapchainKHR oldSwapchain = swapChain;
+  createInfo.oldSwapchain = oldSwapchain;
 
   res = vkCreateSwapchainKHR(device, &createInfo, VK_NULL_HANDLE, &swapChain);
   if (res != VK_SUCCESS)
     throw std::runtime_error("Error creating swapchain");
 
+  /* Its presentations are ordered after the frames in flight */
+  if (oldSwapchain != VK_NULL_HANDLE) {
+    deferDestroy([this, oldSwapchain]() {
+      vkDestroySwapchainKHR(device, oldSwapchain, VK_NULL_HANDLE);
+    });
+  }
+
 
   vkGetSwapchainImagesKHR(device, swapChain, &imageCount, VK_NULL_HANDLE);
   swapChainImages.resize(imageCount);
   vkGetSwapchainImagesKHR(device, swapChain, &imageCount, swapChainImages.data());
   swapChainImageFormat = surfaceFormat.format;
+  swapChainPresentMode = presentMode;
+
+  printf("Created swapchain: %ux%u, %u images, %s present mode, %u frames in flight\n",
+         swapChainExtent.width, swapChainExtent.height, imageCount, presentModeName(presentMode),
+         options.framesInFlight);
+}
+
+void VulkanTest::createOffscreenImages()
+{
+  /* Headless mode renders into plain device-local images that play the role of
+   * the swapchain ones. There is one per frame in flight so that an image is
+   * never written while the previous frame using it is still executing.
+   */
+  swapChainImageFormat = VK_FORMAT_B8G8R8A8_UNORM;
+  swapChainExtent = {options.width, options.height};
+  swapChainImages.resize(options.framesInFlight);
+  offscreenImageMemory.resize(options.framesInFlight);
+
+  for (unsigned i = 0; i < swapChainImages.size(); i++) {
+    VkImageCreateInfo imageInfo = {};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.extent.width = swapChainExtent.width;
+    imageInfo.extent.height = swapChainExtent.height;
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.format = swapChainImageFormat;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    /* Transfer source so that the result can be read back */
+    imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.flags = 0;
+
+    allocator.createImage(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, swapChainImages[i], offscreenImageMemory[i]);
+  }
+
+  printf("Created %u offscreen images of %u x %u\n", (unsigned) swapChainImages.size(),
+         swapChainExtent.width, swapChainExtent.height);
+}
+
+void VulkanTest::saveOffscreenImage(const std::string &filename)
+{
+  /* The last submitted frame used the image of the previous frame in flight */
+  VkImage image = swapChainImages[(currentFrame + swapChainImages.size() - 1) % swapChainImages.size()];
+  VkDeviceSize imageSize = swapChainExtent.width * swapChainExtent.height * 4;
+
+  VkBuffer readbackBuffer;
+  MemoryAllocation readbackBufferMemory;
+  createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+               readbackBuffer, readbackBufferMemory, ALLOCATION_LINEAR);
+
+  VkCommandBuffer commandBuffer = beginCommandBuffer();
+
+  /* The render pass left it in TRANSFER_SRC_OPTIMAL, make the writes visible */
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.baseMipLevel = 0;
+  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.layerCount = 1;
+  barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0,
+                       0, VK_NULL_HANDLE,
+                       0, VK_NULL_HANDLE,
+                       1, &barrier);
+
+  VkBufferImageCopy region = {};
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.mipLevel = 0;
+  region.imageSubresource.baseArrayLayer = 0;
+  region.imageSubresource.layerCount = 1;
+  region.imageOffset = {0, 0, 0};
+  region.imageExtent = {swapChainExtent.width, swapChainExtent.height, 1};
+
+  vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                         readbackBuffer, 1, &region);
+
+  VkBufferMemoryBarrier bufferBarrier = {};
+  bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bufferBarrier.buffer = readbackBuffer;
+  bufferBarrier.offset = 0;
+  bufferBarrier.size = VK_WHOLE_SIZE;
+
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                       0,
+                       0, VK_NULL_HANDLE,
+                       1, &bufferBarrier,
+                       0, VK_NULL_HANDLE);
+
+  endCommandBufferAndSubmit(commandBuffer);
+
+  FILE *file = fopen(filename.c_str(), "wb");
+  if (!file)
+    throw std::runtime_error("Error opening " + filename);
+
+  /* Binary PPM, swizzling the BGRA pixels to RGB */
+  fprintf(file, "P6\n%u %u\n255\n", swapChainExtent.width, swapChainExtent.height);
+
+  const uint8_t *pixels = static_cast<const uint8_t *>(readbackBufferMemory.mapped);
+  std::vector<uint8_t> row(swapChainExtent.width * 3);
+  for (uint32_t y = 0; y < swapChainExtent.height; y++) {
+    for (uint32_t x = 0; x < swapChainExtent.width; x++) {
+      const uint8_t *pixel = &pixels[(y * swapChainExtent.width + x) * 4];
+      row[x * 3 + 0] = pixel[2];
+      row[x * 3 + 1] = pixel[1];
+      row[x * 3 + 2] = pixel[0];
+    }
+    fwrite(row.data(), 1, row.size(), file);
+  }
+  fclose(file);
+
+  vkDestroyBuffer(device, readbackBuffer, VK_NULL_HANDLE);
+  allocator.free(readbackBufferMemory);
+
+  printf("Saved last rendered frame to %s\n", filename.c_str());
 }
 
 void VulkanTest::createSwapchainImageViews()
@@ -579,22 +1012,19 @@ void VulkanTest::createPipeline()
   /* Vertex input description */
   VkVertexInputBindingDescription bindingDescription = {};
   bindingDescription.binding = 0;
-  bindingDescription.stride = sizeof(Vertex);
+  bindingDescription.stride = sizeof(PackedVertex);
   bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
-  std::array<VkVertexInputAttributeDescription, 3> attributeDescriptions = {};
+  /* Positions are dequantized in the vertex shader */
+  std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions = {};
   attributeDescriptions[0].binding = 0;
   attributeDescriptions[0].location = 0;
-  attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-  attributeDescriptions[0].offset = offsetof(Vertex, pos);
+  attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_UNORM;
+  attributeDescriptions[0].offset = offsetof(PackedVertex, pos);
   attributeDescriptions[1].binding = 0;
   attributeDescriptions[1].location = 1;
-  attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-  attributeDescriptions[1].offset = offsetof(Vertex, color);
-  attributeDescriptions[2].binding = 0;
-  attributeDescriptions[2].location = 2;
-  attributeDescriptions[2].format = VK_FORMAT_R32G32_SFLOAT;
-  attributeDescriptions[2].offset = offsetof(Vertex, texCoord);
+  attributeDescriptions[1].format = VK_FORMAT_R16G16_SFLOAT;
+  attributeDescriptions[1].offset = offsetof(PackedVertex, texCoord);
 
   VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
   vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
@@ -609,24 +1039,21 @@ void VulkanTest::createPipeline()
   inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
   inputAssembly.primitiveRestartEnable = VK_FALSE;
 
-  VkViewport viewport = {};
-  viewport.x = 0.0f;
-  viewport.y = 0.0f;
-  viewport.width = (float) swapChainExtent.width;
-  viewport.height = (float) swapChainExtent.height;
-  viewport.minDepth = 0.0f;
-  viewport.maxDepth = 1.0f;
-
-  VkRect2D scissor = {};
-  scissor.offset = {0, 0};
-  scissor.extent = swapChainExtent;
-
+  /* Viewport and scissor are set when recording, so the pipeline doesn't
+   * depend on the swapchain extent and survives resizes.
+   */
   VkPipelineViewportStateCreateInfo viewportState = {};
   viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
   viewportState.viewportCount = 1;
-  viewportState.pViewports = &viewport;
+  viewportState.pViewports = VK_NULL_HANDLE;
   viewportState.scissorCount = 1;
-  viewportState.pScissors = &scissor;
+  viewportState.pScissors = VK_NULL_HANDLE;
+
+  std::array<VkDynamicState, 2> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+  VkPipelineDynamicStateCreateInfo dynamicState = {};
+  dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+  dynamicState.pDynamicStates = dynamicStates.data();
 
   VkPipelineRasterizationStateCreateInfo rasterizer = {};
   rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
@@ -658,9 +1085,6 @@ void VulkanTest::createPipeline()
   colorBlending.blendConstants[2] = 0.0f;
   colorBlending.blendConstants[3] = 0.0f;
 
-  /* Create pipeline layout, includes descriptor set layout definition too */
-  createPipelineLayout();
-
   VkPipelineDepthStencilStateCreateInfo depthStencil = {};
   depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
   depthStencil.depthTestEnable = VK_TRUE;
@@ -684,19 +1108,39 @@ void VulkanTest::createPipeline()
   pipelineInfo.pMultisampleState = &multisampling;
   pipelineInfo.pColorBlendState = &colorBlending;
   pipelineInfo.pDepthStencilState = &depthStencil;
+  pipelineInfo.pDynamicState = &dynamicState;
   pipelineInfo.layout = pipelineLayout;
   pipelineInfo.renderPass = renderPass;
   pipelineInfo.subpass = 0;
   pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
-  res = vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, VK_NULL_HANDLE, &graphicsPipeline);
+  /* Ask the driver whether the pipeline came from the cache */
+  VkPipelineCreationFeedbackEXT pipelineFeedback = {};
+  VkPipelineCreationFeedbackEXT stageFeedbacks[2] = {};
+  VkPipelineCreationFeedbackCreateInfoEXT feedbackInfo = {};
+  feedbackInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT;
+  feedbackInfo.pPipelineCreationFeedback = &pipelineFeedback;
+  feedbackInfo.pipelineStageCreationFeedbackCount = 2;
+  feedbackInfo.pPipelineStageCreationFeedbacks = stageFeedbacks;
+  if (creationFeedbackSupported)
+    pipelineInfo.pNext = &feedbackInfo;
+
+  BenchClock::time_point start = BenchClock::now();
+  res = vkCreateGraphicsPipelines(device, pipelineCache.handle(), 1, &pipelineInfo, VK_NULL_HANDLE, &graphicsPipeline);
   if (res != VK_SUCCESS)
     throw std::runtime_error("Error when creating graphics pipeline");
+  double createMs = elapsedMs(start, BenchClock::now());
 
   vkDestroyShaderModule(device, fragShaderModule, VK_NULL_HANDLE);
   vkDestroyShaderModule(device, vertShaderModule, VK_NULL_HANDLE);
 
-  printf("Created pipeline\n");
+  int hit = -1;
+  if (pipelineFeedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT)
+    hit = pipelineFeedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT ? 1 : 0;
+  pipelineCache.recordCreation(createMs, hit);
+
+  printf("Created pipeline in %.2f ms (cache %s)\n", createMs,
+         hit < 0 ? "hit unknown" : hit ? "hit" : "miss");
 }
 
 void VulkanTest::createRenderPass()
@@ -731,7 +1175,9 @@ void VulkanTest::createRenderPass()
   colorAttachmentResolve.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   colorAttachmentResolve.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
   colorAttachmentResolve.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  colorAttachmentResolve.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  /* Offscreen images are not presented, leave them ready to be read back */
+  colorAttachmentResolve.finalLayout = options.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL :
+                                                          VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
   VkAttachmentReference colorAttachmentRef = {};
   colorAttachmentRef.attachment = 0;
@@ -797,9 +1243,12 @@ void VulkanTest::createFramebuffer()
 
 void VulkanTest::createSyncObjects()
 {
-  imageAvailableSemaphore.resize(MAX_FRAMES_IN_FLIGHT);
-  renderFinishedSemaphore.resize(MAX_FRAMES_IN_FLIGHT);
-  inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+  imageAvailableSemaphore.resize(options.framesInFlight);
+  renderFinishedSemaphore.resize(options.framesInFlight);
+  inFlightFences.resize(options.framesInFlight);
+  deferredDestroys.resize(options.framesInFlight);
+  frameInputTime.resize(options.framesInFlight);
+  frameLatencyPending.assign(options.framesInFlight, false);
 
 
   /* Create semaphores to know when an swapchain image is ready and when the rendering has finished */
@@ -810,7 +1259,7 @@ void VulkanTest::createSyncObjects()
   fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
   fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-  for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+  for (unsigned i = 0; i < options.framesInFlight; i++) {
     if (vkCreateSemaphore(device, &semaphoreInfo, VK_NULL_HANDLE, &imageAvailableSemaphore[i]) != VK_SUCCESS ||
         vkCreateSemaphore(device, &semaphoreInfo, VK_NULL_HANDLE, &renderFinishedSemaphore[i]) != VK_SUCCESS ||
         vkCreateFence(device, &fenceInfo, VK_NULL_HANDLE, &inFlightFences[i]) != VK_SUCCESS)
@@ -821,36 +1270,88 @@ void VulkanTest::createSyncObjects()
 
 void VulkanTest::drawFrame()
 {
+  BenchClock::time_point frameStart = BenchClock::now();
+  frameTimingValid = false;
+  inputLatencies.clear();
+
   vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, std::numeric_limits<uint64_t>::max());
 
+  BenchClock::time_point fenceDone = BenchClock::now();
+
+  resolveInputLatency(currentFrame, fenceDone);
+  runDeferredDestroys(currentFrame);
+
+  /* The fence guarantees the queries of the last frame using this slot are done */
+  resolveFrameTimestamps();
+  resolveUploadTimestamps();
+  if (uploader.retire())
+    uploader.printStats();
+
   VkResult res = VK_SUCCESS;
-  /* Acquire next image to draw into */
-  uint32_t imageIndex;
-  res = vkAcquireNextImageKHR(device, swapChain, std::numeric_limits<uint64_t>::max(), imageAvailableSemaphore[currentFrame], VK_NULL_HANDLE, &imageIndex);
+  /* Acquire next image to draw into. Offscreen images are owned by the frame in flight. */
+  uint32_t imageIndex = currentFrame;
+  if (!options.headless) {
+    res = vkAcquireNextImageKHR(device, swapChain, std::numeric_limits<uint64_t>::max(), imageAvailableSemaphore[currentFrame], VK_NULL_HANDLE, &imageIndex);
+
+    if (res == VK_ERROR_OUT_OF_DATE_KHR) {
+      recreateSwapchain();
+      return;
+    } else if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
+      throw std::runtime_error("failed to acquire swap chain image!");
+    }
+  }
 
-  if (res == VK_ERROR_OUT_OF_DATE_KHR) {
-    recreateSwapchain();
-    return;
-  } else if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
-    throw std::runtime_error("failed to acquire swap chain image!");
+  BenchClock::time_point acquireDone = BenchClock::now();
+
+  /* Input is sampled by the loop calling drawFrame(), right before. In low
+   * latency mode it is sampled again once the previous frame is done, so
+   * the new frame doesn't queue behind it and shows the latest input.
+   */
+  BenchClock::time_point inputTime = frameStart;
+  if (options.lowLatency) {
+    if (lastSubmittedFrame >= 0) {
+      vkWaitForFences(device, 1, &inFlightFences[lastSubmittedFrame], VK_TRUE, std::numeric_limits<uint64_t>::max());
+      resolveInputLatency(lastSubmittedFrame, BenchClock::now());
+    }
+    if (!options.headless)
+      glfwPollEvents();
+    inputTime = BenchClock::now();
   }
 
-  updateUniformBuffer();
+  BenchClock::time_point pacingDone = BenchClock::now();
+
+  updateUniformBuffer(inputTime);
+
+  BenchClock::time_point uboDone = BenchClock::now();
+
+  if (options.cpuCull || drawList)
+    cullObjects();
+
+  BenchClock::time_point cullDone = BenchClock::now();
+
+  VkCommandBuffer commandBuffer = recordFrame(imageIndex);
+
+  BenchClock::time_point recordDone = BenchClock::now();
 
   VkSubmitInfo submitInfo = {};
   submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
   VkSemaphore waitSemaphores[] = {imageAvailableSemaphore[currentFrame]};
   VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-  submitInfo.waitSemaphoreCount = 1;
+  submitInfo.waitSemaphoreCount = options.headless ? 0 : 1;
   submitInfo.pWaitSemaphores = waitSemaphores;
   submitInfo.pWaitDstStageMask = waitStages;
 
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+  /* Setup commands left by a swapchain recreation run first */
+  VkCommandBuffer frameCommandBuffers[] = {setupCommands, commandBuffer};
+  bool withSetup = setupCommands != VK_NULL_HANDLE;
+  if (withSetup)
+    vkEndCommandBuffer(setupCommands);
+  submitInfo.commandBufferCount = withSetup ? 2 : 1;
+  submitInfo.pCommandBuffers = withSetup ? frameCommandBuffers : &frameCommandBuffers[1];
 
   VkSemaphore signalSemaphores[] = {renderFinishedSemaphore[currentFrame]};
-  submitInfo.signalSemaphoreCount = 1;
+  submitInfo.signalSemaphoreCount = options.headless ? 0 : 1;
   submitInfo.pSignalSemaphores = signalSemaphores;
 
   vkResetFences(device, 1, &inFlightFences[currentFrame]);
@@ -859,6 +1360,43 @@ void VulkanTest::drawFrame()
   res = vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]);
   if (res != VK_SUCCESS)
     throw std::runtime_error("Error submitting draw command buffer");
+  lastSubmittedFrame = (int) currentFrame;
+  frameInputTime[currentFrame] = inputTime;
+  frameLatencyPending[currentFrame] = true;
+
+  /* The fence of this frame covers the setup batch and anything retired
+   * while it was open.
+   */
+  std::vector<std::function<void()>> &destroys = deferredDestroys[currentFrame];
+  destroys.insert(destroys.end(), setupDestroys.begin(), setupDestroys.end());
+  setupDestroys.clear();
+  if (withSetup) {
+    VkCommandBuffer setup = setupCommands;
+    setupCommands = VK_NULL_HANDLE;
+    deferDestroy([this, setup]() {
+      vkFreeCommandBuffers(device, cmdPool, 1, &setup);
+    });
+  }
+
+  frameQueryPending[currentFrame] = true;
+
+  BenchClock::time_point submitDone = BenchClock::now();
+
+  frameStageMs[FRAME_STAGE_FENCE_WAIT] = elapsedMs(frameStart, fenceDone);
+  frameStageMs[FRAME_STAGE_ACQUIRE] = elapsedMs(fenceDone, acquireDone);
+  frameStageMs[FRAME_STAGE_PACING] = elapsedMs(acquireDone, pacingDone);
+  frameStageMs[FRAME_STAGE_UBO_UPDATE] = elapsedMs(pacingDone, uboDone);
+  frameStageMs[FRAME_STAGE_CULL] = elapsedMs(uboDone, cullDone);
+  frameStageMs[FRAME_STAGE_RECORD] = elapsedMs(cullDone, recordDone);
+  frameStageMs[FRAME_STAGE_SUBMIT] = elapsedMs(recordDone, submitDone);
+  frameStageMs[FRAME_STAGE_PRESENT] = 0.0;
+  frameTotalMs = elapsedMs(frameStart, submitDone);
+  frameTimingValid = true;
+
+  if (options.headless) {
+    currentFrame = (currentFrame + 1) % options.framesInFlight;
+    return;
+  }
 
   VkPresentInfoKHR presentInfo = {};
   presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -874,196 +1412,781 @@ void VulkanTest::drawFrame()
 
   res = vkQueuePresentKHR(presentQueue, &presentInfo);
 
+  BenchClock::time_point presentDone = BenchClock::now();
+  frameStageMs[FRAME_STAGE_PRESENT] = elapsedMs(submitDone, presentDone);
+  frameTotalMs = elapsedMs(frameStart, presentDone);
+
   if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR || framebufferResized) {
     framebufferResized = false;
+    frameTimingValid = false;
     recreateSwapchain();
   } else if (res != VK_SUCCESS) {
     throw std::runtime_error("failed to present swap chain image!");
   }
 
-  currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+  currentFrame = (currentFrame + 1) % options.framesInFlight;
 }
 
-void VulkanTest::recordCommandBuffers()
+/* Input-to-present latency of a frame: from its input sample until its
+ * fence is seen signaled, the closest to the present that can be observed
+ * without present timing extensions. Called once the fence is done.
+ */
+void VulkanTest::resolveInputLatency(unsigned frame, BenchClock::time_point signaled)
 {
-  VkResult res = VK_SUCCESS;
-  for (unsigned i = 0; i < swapChainFramebuffers.size(); i++) {
-    VkCommandBufferBeginInfo beginInfo = {};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-
-    vkBeginCommandBuffer(commandBuffers[i], &beginInfo);
-
-
-    VkRenderPassBeginInfo renderPassInfo = {};
-    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    renderPassInfo.renderPass = renderPass;
-    renderPassInfo.framebuffer = swapChainFramebuffers[i];
-    renderPassInfo.renderArea.offset = {0, 0};
-    renderPassInfo.renderArea.extent = swapChainExtent;
-
-    std::array<VkClearValue, 2> clearValues = {};
-    clearValues[0].color = {0.0f, 0.0f, 0.0f, 1.0f};
-    clearValues[1].depthStencil = {1.0f, 0};
-
-    renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
-    renderPassInfo.pClearValues = clearValues.data();
-
-    vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-
-    vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-    vkCmdBindDescriptorSets(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, VK_NULL_HANDLE);
-
-    VkBuffer vertexBuffers[] = {vertexBuffer};
-    VkDeviceSize offsets[] = {0};
-    vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, vertexBuffers, offsets);
-    vkCmdBindIndexBuffer(commandBuffers[i], indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+  if (!frameLatencyPending[frame])
+    return;
 
-    vkCmdDrawIndexed(commandBuffers[i], static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
+  frameLatencyPending[frame] = false;
+  double latencyMs = elapsedMs(frameInputTime[frame], signaled);
+  inputLatencies.push_back(latencyMs);
 
-    vkCmdEndRenderPass(commandBuffers[i]);
+  if (latencyLogFrames == 0)
+    latencyLogTime = signaled;
+  latencyLogSumMs += latencyMs;
+  latencyLogFrames++;
 
-    res = vkEndCommandBuffer(commandBuffers[i]);
-    if (res != VK_SUCCESS)
-      throw std::runtime_error("Error recording command buffer");
+  if (elapsedMs(latencyLogTime, signaled) >= GPU_TIMING_LOG_INTERVAL * 1000.0) {
+    printf("Input-to-present latency: %.4f ms average over %u frames\n", latencyLogSumMs / latencyLogFrames,
+           latencyLogFrames);
+    latencyLogSumMs = 0.0;
+    latencyLogFrames = 0;
   }
-
-  printf("Recorded command buffer commands\n");
 }
 
-void VulkanTest::createBuffer(VkDeviceSize bufferSize, unsigned bufferUsage, unsigned memoryProperties,
-                              VkBuffer &buffer, VkDeviceMemory &bufferMemory)
+/* Destroys the resources through a function once the frames submitted so
+ * far are done. It is queued on the last submitted frame: its fence is
+ * signaled after every earlier submission on the graphics queue. While the
+ * setup batch is open (e.g. two swapchain recreations before a frame), it
+ * may record commands on the resources, so they wait for the next submit.
+ */
+void VulkanTest::deferDestroy(std::function<void()> destroy)
 {
-  VkResult res = VK_SUCCESS;
-  VkBufferCreateInfo bufferInfo = {};
-  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  bufferInfo.size = bufferSize;
-  bufferInfo.usage = bufferUsage;
-  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-  res = vkCreateBuffer(device, &bufferInfo, VK_NULL_HANDLE, &buffer);
-  if (res != VK_SUCCESS)
-    throw std::runtime_error("Error creating vertex buffer");
-
-  VkMemoryRequirements memRequirements;
-  vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
-
-  VkMemoryAllocateInfo allocInfo = {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memRequirements.size;
-  allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, memoryProperties);
+  if (setupCommands != VK_NULL_HANDLE || !setupDestroys.empty()) {
+    setupDestroys.push_back(destroy);
+    return;
+  }
+  if (lastSubmittedFrame < 0) {
+    destroy();
+    return;
+  }
+  deferredDestroys[lastSubmittedFrame].push_back(destroy);
+}
 
-  res = vkAllocateMemory(device, &allocInfo, VK_NULL_HANDLE, &bufferMemory);
-  if (res != VK_SUCCESS)
-    throw std::runtime_error("Error allocating vertex buffer memory");
+/* Called once the fence of the frame has been waited for */
+void VulkanTest::runDeferredDestroys(unsigned frame)
+{
+  std::vector<std::function<void()>> destroys;
+  destroys.swap(deferredDestroys[frame]);
+  for (auto &destroy : destroys)
+    destroy();
+}
 
-  vkBindBufferMemory(device, buffer, bufferMemory, 0);
+void VulkanTest::flushDeferredDestroys()
+{
+  for (unsigned i = 0; i < deferredDestroys.size(); i++)
+    runDeferredDestroys(i);
+  std::vector<std::function<void()>> destroys;
+  destroys.swap(setupDestroys);
+  for (auto &destroy : destroys)
+    destroy();
+  lastSubmittedFrame = -1;
 }
 
-void VulkanTest::fillBuffer(VkDeviceMemory bufferMemory, VkDeviceSize size, const void *data)
+/* Draws recorded by the CPU: every chunk of level 0 of every object (of
+ * the visible ones with CPU culling), the chunks of the selected level or
+ * the visible meshlets with a draw list, every chunk once when instanced,
+ * or a single indirect draw with GPU culling.
+ */
+uint32_t VulkanTest::drawCount() const
 {
-  void* dataBuffer;
-  vkMapMemory(device, bufferMemory, 0, size, 0, &dataBuffer);
-  memcpy(dataBuffer, data, (size_t) size);
-  vkUnmapMemory(device, bufferMemory);
+  if (options.gpuCull)
+    return 1;
+  if (drawList)
+    return (uint32_t) visibleDraws.size();
+  if (options.cpuCull)
+    return (uint32_t) visibleObjects.size() * meshLods[0].chunkCount;
+  return (options.instanced ? 1 : options.objects) * meshLods[0].chunkCount;
 }
 
-void VulkanTest::loadModel()
+/* Coarsest level of detail whose error, projected at the point of the
+ * bounding sphere of the object closest to the camera, is at most
+ * options.lodError pixels. The model matrices scale uniformly.
+ */
+uint32_t VulkanTest::selectLod(const glm::mat4 &model) const
 {
-  tinyobj::attrib_t attrib;
-  std::vector<tinyobj::shape_t> shapes;
-  std::vector<tinyobj::material_t> materials;
-  std::string warn, err;
+  glm::vec3 center = glm::vec3(model * glm::vec4(meshPosOffset + meshPosScale * 0.5f, 1.0f));
+  float scale = glm::length(glm::vec3(model[0]));
+  float distance = glm::distance(center, cameraPosition) - glm::length(meshPosScale) * 0.5f * scale;
+  distance = std::max(distance, CAMERA_NEAR);
+
+  for (uint32_t level = (uint32_t) meshLods.size() - 1; level > 0; level--) {
+    if (meshLods[level].error * scale * lodScale <= options.lodError * distance)
+      return level;
+  }
+  return 0;
+}
 
-  if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, MODEL_PATH.c_str())) {
-    throw std::runtime_error(warn + err);
+/* Tests the bounding spheres written by updateUniformBuffer() against the
+ * frustum, spread across the thread pool for large object counts. Then the
+ * level of detail of the objects left is selected and its meshlets are
+ * culled in their model space, where the camera is brought with the
+ * inverse of the model matrix and the frustum planes with its transpose.
+ */
+void VulkanTest::cullObjects()
+{
+  if (options.cpuCull) {
+    objectBounds.cull(frustum, visibleObjects, &threadPool);
+    culledFrames++;
+    culledVisible += visibleObjects.size();
   }
 
-  std::unordered_map<Vertex, uint32_t> uniqueVertices = {};
+  if (!drawList)
+    return;
 
-  for (const auto& shape : shapes) {
-    for (const auto& index : shape.mesh.indices) {
-      Vertex vertex = {};
-      vertex.pos = {
-        attrib.vertices[3 * index.vertex_index + 0],
-        attrib.vertices[3 * index.vertex_index + 1],
-        attrib.vertices[3 * index.vertex_index + 2]
-      };
-
-      vertex.texCoord = {
-        attrib.texcoords[2 * index.texcoord_index + 0],
-        1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
-      };
-
-      vertex.color = {1.0f, 1.0f, 1.0f};
-      if (uniqueVertices.count(vertex) == 0) {
-        uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
-        vertices.push_back(vertex);
+  uint32_t chunks = (uint32_t) meshChunks.size();
+  uint32_t objects = options.cpuCull ? (uint32_t) visibleObjects.size() : options.objects;
+  uint32_t jobs = std::min(threadPool.size() + 1,
+                           (objects + MIN_OBJECTS_PER_CLUSTER_JOB - 1) / MIN_OBJECTS_PER_CLUSTER_JOB);
+  jobs = std::max(jobs, 1u);
+  clusterDraws.resize(jobs);
+
+  threadPool.parallelFor(jobs, [&](size_t job) {
+    std::vector<uint32_t> &draws = clusterDraws[job];
+    draws.clear();
+    for (uint32_t i = objects * job / jobs; i < objects * (job + 1) / jobs; i++) {
+      uint32_t object = options.cpuCull ? visibleObjects[i] : i;
+      const glm::mat4 &model = objectModels[object];
+      uint32_t level = lodSelect ? selectLod(model) : 0;
+      const MeshLod &lod = meshLods[level];
+      uint32_t first = object * chunks + lod.firstChunk;
+      objectLods[object] = level;
+
+      if (!clusterCull) {
+        for (uint32_t chunk = 0; chunk < lod.chunkCount; chunk++)
+          draws.push_back(first + chunk);
+        continue;
       }
-      indices.push_back(uniqueVertices[vertex]);
+
+      Frustum local;
+      glm::mat4 transposed = glm::transpose(model);
+      for (int p = 0; p < 6; p++) {
+        glm::vec4 plane = transposed * frustum.planes[p];
+        local.planes[p] = plane / glm::length(glm::vec3(plane));
+      }
+      glm::vec3 camera = glm::vec3(glm::inverse(model) * glm::vec4(cameraPosition, 1.0f));
+
+      cullMeshlets(&meshletBounds[lod.firstChunk], lod.chunkCount, local, camera, first, draws);
     }
+  });
+
+  visibleDraws.clear();
+  for (const std::vector<uint32_t> &draws : clusterDraws)
+    visibleDraws.insert(visibleDraws.end(), draws.begin(), draws.end());
+
+  drawListFrames++;
+  drawListChunks += visibleDraws.size();
+  for (uint32_t draw : visibleDraws)
+    drawListTriangles += meshChunks[draw % chunks].indexCount / 3;
+  if (lodSelect) {
+    for (uint32_t i = 0; i < objects; i++)
+      lodObjects[objectLods[options.cpuCull ? visibleObjects[i] : i]]++;
   }
 }
 
-void VulkanTest::createVertexBuffer()
+/* Records draws [first, last) of the draw list into a secondary command
+ * buffer continuing the render pass. Runs on any thread.
+ */
+void VulkanTest::recordDraws(VkCommandBuffer commandBuffer, const VkCommandBufferInheritanceInfo &inheritance,
+                             uint32_t first, uint32_t last)
 {
-  VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                    VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+  beginInfo.pInheritanceInfo = &inheritance;
 
-  createBuffer(bufferSize,
-               VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-               vertexBuffer, vertexBufferMemory);
+  vkBeginCommandBuffer(commandBuffer, &beginInfo);
 
-  fillBuffer(vertexBufferMemory, bufferSize, vertices.data());
-  printf("Created Vertex input buffer and filled it with data\n");
-}
+  /* Secondaries inherit neither the bound state nor the dynamic state */
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
 
-void VulkanTest::createIndexBuffer()
-{
-  VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+  VkViewport viewport = {};
+  viewport.x = 0.0f;
+  viewport.y = 0.0f;
+  viewport.width = (float) swapChainExtent.width;
+  viewport.height = (float) swapChainExtent.height;
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+  vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+  VkRect2D scissor = {};
+  scissor.offset = {0, 0};
+  scissor.extent = swapChainExtent;
+  vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+  VkBuffer vertexBuffers[] = {vertexBuffer};
+  VkDeviceSize offsets[] = {0};
+  vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+  vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT16);
+
+  /* Dynamic offsets go in binding order: uniforms, then model matrices */
+  uint32_t dynamicOffsets[] = {uniformRing.offset(currentFrame), instanceRing.offset(currentFrame)};
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 2, dynamicOffsets);
 
-  /* For testing, I am going to use a staging buffer, even when for Intel GPU
-   * it is not needed (the memory is shared between host and device). However
-   * I am following https://vulkan-tutorial.com/Vertex_buffers/Index_buffer
-   * tutorial and I want to learn how to do it for other GPUs.
+  /* One draw per chunk, its 16-bit indices are relative to firstVertex.
+   * The vertex shader fetches the model matrix with the instance index:
+   * instanced draws cover all the objects, otherwise firstInstance selects
+   * the object of the draw. With GPU culling the compute pass wrote them.
    */
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingBufferMemory;
+  uint32_t chunks = drawList ? (uint32_t) meshChunks.size() : meshLods[0].chunkCount;
+  if (options.gpuCull) {
+    gpuCulling.recordDraws(commandBuffer, currentFrame);
+  } else {
+    for (uint32_t draw = first; draw < last; draw++) {
+      uint32_t index = drawList ? visibleDraws[draw] : draw;
+      const MeshChunk &chunk = meshChunks[index % chunks];
+      uint32_t object = index / chunks;
+      if (options.cpuCull && !drawList)
+        object = visibleObjects[object];
+      if (options.instanced)
+        vkCmdDrawIndexed(commandBuffer, chunk.indexCount, options.objects, chunk.firstIndex, chunk.firstVertex, 0);
+      else
+        vkCmdDrawIndexed(commandBuffer, chunk.indexCount, 1, chunk.firstIndex, chunk.firstVertex, object);
+    }
+  }
 
-  createBuffer(bufferSize,
-               VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-               stagingBuffer, stagingBufferMemory);
+  VkResult res = vkEndCommandBuffer(commandBuffer);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error recording secondary command buffer");
+}
 
-  fillBuffer(stagingBufferMemory, bufferSize, indices.data());
+/* Records the command buffers of the current frame. Its fence has been
+ * waited for, so nothing allocated from its pools is pending anymore. The
+ * draw list is split across the thread pool, each job recording into its
+ * own secondary, and the primary executes them inside the render pass.
+ * Culling may leave fewer draws than jobs created for the frame.
+ */
+VkCommandBuffer VulkanTest::recordFrame(uint32_t imageIndex)
+{
+  FrameCommands &frame = frameCommands[currentFrame];
+  uint32_t draws = drawCount();
+  uint32_t jobs = std::min((uint32_t) frame.secondaries.size(),
+                           (draws + MIN_DRAWS_PER_RECORD_JOB - 1) / MIN_DRAWS_PER_RECORD_JOB);
+  jobs = std::max(jobs, 1u);
+
+  VkCommandBufferInheritanceInfo inheritance = {};
+  inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  inheritance.renderPass = renderPass;
+  inheritance.subpass = 0;
+  inheritance.framebuffer = swapChainFramebuffers[imageIndex];
+
+  threadPool.parallelFor(jobs, [&](size_t job) {
+    vkResetCommandPool(device, frame.pools[job], 0);
+    recordDraws(frame.secondaries[job], inheritance, (uint32_t) (draws * job / jobs),
+                (uint32_t) (draws * (job + 1) / jobs));
+  });
+
+  vkResetCommandPool(device, frame.primaryPool, 0);
+  VkCommandBuffer commandBuffer = frame.primary;
 
-  printf("Created staging buffer for indices and filled it with data\n");
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-  /* Create index buffer in device memory */
-  createBuffer(bufferSize,
-               VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-               indexBuffer, indexBufferMemory);
+  vkBeginCommandBuffer(commandBuffer, &beginInfo);
 
-  printf("Created index buffer device local memory\n");
+  if (timestampsSupported) {
+    vkCmdResetQueryPool(commandBuffer, frameQueryPool, (uint32_t) currentFrame * 2, 2);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frameQueryPool, (uint32_t) currentFrame * 2);
+  }
 
-  /* Copy staging buffer contents (host visible memory to index buffer (device memory) */
-  VkCommandBuffer commandBuffer = beginCommandBuffer();
+  if (options.gpuCull)
+    gpuCulling.recordCull(commandBuffer, currentFrame, uniformRing.offset(currentFrame), instanceRing.offset(currentFrame));
 
-  VkBufferCopy copyRegion = {};
-  copyRegion.size = bufferSize;
-  vkCmdCopyBuffer(commandBuffer, stagingBuffer, indexBuffer, 1, &copyRegion);
+  VkRenderPassBeginInfo renderPassInfo = {};
+  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  renderPassInfo.renderPass = renderPass;
+  renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+  renderPassInfo.renderArea.offset = {0, 0};
+  renderPassInfo.renderArea.extent = swapChainExtent;
 
-  endCommandBufferAndSubmit(commandBuffer);
+  std::array<VkClearValue, 2> clearValues = {};
+  clearValues[0].color = {0.0f, 0.0f, 0.0f, 1.0f};
+  clearValues[1].depthStencil = {1.0f, 0};
 
-  printf("Transfer data from staging buffer to index buffer done\n");
+  renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+  renderPassInfo.pClearValues = clearValues.data();
 
-  /* Destroy staging buffer, it is no longer used */
-  vkDestroyBuffer(device, stagingBuffer, VK_NULL_HANDLE);
-  vkFreeMemory(device, stagingBufferMemory, VK_NULL_HANDLE);
-}
+  vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+  vkCmdExecuteCommands(commandBuffer, jobs, frame.secondaries.data());
+  vkCmdEndRenderPass(commandBuffer);
 
-void VulkanTest::endCommandBufferAndSubmit(VkCommandBuffer commandBuffer)
+  if (timestampsSupported)
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frameQueryPool, (uint32_t) currentFrame * 2 + 1);
+
+  VkResult res = vkEndCommandBuffer(commandBuffer);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error recording command buffer");
+
+  return commandBuffer;
+}
+
+void VulkanTest::createUploadQueryPool()
+{
+  if (!timestampsSupported)
+    return;
+
+  VkQueryPoolCreateInfo queryPoolInfo = {};
+  queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  queryPoolInfo.queryCount = UPLOAD_QUERY_COUNT;
+
+  VkResult res = vkCreateQueryPool(device, &queryPoolInfo, VK_NULL_HANDLE, &uploadQueryPool);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating upload timestamp query pool");
+
+  /* Reset all the queries once here: each timer uses its own queries, and
+   * transfer-only queues can't reset them.
+   */
+  vkCmdResetQueryPool(setupCommandBuffer(), uploadQueryPool, 0, UPLOAD_QUERY_COUNT);
+}
+
+void VulkanTest::createFrameQueryPool()
+{
+  frameQueryPending.assign(options.framesInFlight, false);
+  if (!timestampsSupported)
+    return;
+
+  VkQueryPoolCreateInfo queryPoolInfo = {};
+  queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  queryPoolInfo.queryCount = options.framesInFlight * 2;
+
+  VkResult res = vkCreateQueryPool(device, &queryPoolInfo, VK_NULL_HANDLE, &frameQueryPool);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating frame timestamp query pool");
+}
+
+int VulkanTest::beginGpuUploadTimer(VkCommandBuffer commandBuffer, const std::string &label)
+{
+  if (!timestampsSupported || uploadQueryCount + 2 > UPLOAD_QUERY_COUNT)
+    return -1;
+
+  GpuUploadTimer timer = {};
+  timer.label = label;
+  timer.query = uploadQueryCount;
+  uploadQueryCount += 2;
+  uploadTimers.push_back(timer);
+
+  vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, uploadQueryPool, timer.query);
+  return (int) uploadTimers.size() - 1;
+}
+
+void VulkanTest::endGpuUploadTimer(VkCommandBuffer commandBuffer, int timer)
+{
+  if (timer < 0)
+    return;
+
+  vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, uploadQueryPool,
+                      uploadTimers[timer].query + 1);
+}
+
+/* Reads a begin/end timestamp pair without waiting. Returns false if the
+ * GPU didn't write both of them yet.
+ */
+static bool readTimestampPair(VkDevice device, VkQueryPool pool, uint32_t query,
+                              uint64_t mask, float period, double &ms)
+{
+  /* Each query returns its value followed by its availability */
+  uint64_t data[4];
+  vkGetQueryPoolResults(device, pool, query, 2, sizeof(data), data, 2 * sizeof(uint64_t),
+                        VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+  if (!data[1] || !data[3])
+    return false;
+
+  ms = ((data[2] - data[0]) & mask) * period / 1000000.0;
+  return true;
+}
+
+void VulkanTest::resolveUploadTimestamps()
+{
+  for (auto &timer : uploadTimers) {
+    if (timer.resolved)
+      continue;
+
+    if (!readTimestampPair(device, uploadQueryPool, timer.query, timestampMask, timestampPeriod, timer.ms))
+      continue;
+
+    timer.resolved = true;
+    printf("GPU upload %s: %.4f ms\n", timer.label.c_str(), timer.ms);
+  }
+}
+
+void VulkanTest::resolveFrameTimestamps()
+{
+  gpuFrameTimeValid = false;
+  if (!timestampsSupported || !frameQueryPending[currentFrame])
+    return;
+
+  frameQueryPending[currentFrame] = false;
+
+  if (!readTimestampPair(device, frameQueryPool, (uint32_t) currentFrame * 2, timestampMask, timestampPeriod,
+                         gpuFrameTimeMs))
+    return;
+
+  gpuFrameTimeValid = true;
+
+  if (gpuLogFrames == 0)
+    gpuLogTime = BenchClock::now();
+  gpuLogSumMs += gpuFrameTimeMs;
+  gpuLogFrames++;
+
+  BenchClock::time_point now = BenchClock::now();
+  if (elapsedMs(gpuLogTime, now) >= GPU_TIMING_LOG_INTERVAL * 1000.0) {
+    printf("GPU render pass: %.4f ms average over %u frames\n", gpuLogSumMs / gpuLogFrames, gpuLogFrames);
+    gpuLogSumMs = 0.0;
+    gpuLogFrames = 0;
+  }
+}
+
+void VulkanTest::createBuffer(VkDeviceSize bufferSize, unsigned bufferUsage, unsigned memoryProperties,
+                              VkBuffer &buffer, MemoryAllocation &bufferMemory,
+                              AllocationStrategy strategy)
+{
+  VkBufferCreateInfo bufferInfo = {};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = bufferSize;
+  bufferInfo.usage = bufferUsage;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  allocator.createBuffer(bufferInfo, memoryProperties, buffer, bufferMemory, strategy);
+}
+
+/* Part of a shape imported by one thread. Indices refer to the chunk local
+ * vertices until they are remapped to the merged vertex array.
+ */
+struct ImportChunk {
+  const tinyobj::shape_t *shape;
+  size_t           begin;
+  size_t           end;
+  size_t           firstIndex;
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;
+  std::vector<uint32_t> remap;
+};
+
+static Vertex objVertex(const tinyobj::attrib_t &attrib, const tinyobj::index_t &index)
+{
+  Vertex vertex = {};
+  vertex.pos = {
+    attrib.vertices[3 * index.vertex_index + 0],
+    attrib.vertices[3 * index.vertex_index + 1],
+    attrib.vertices[3 * index.vertex_index + 2]
+  };
+
+  vertex.texCoord = {
+    attrib.texcoords[2 * index.texcoord_index + 0],
+    1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
+  };
+
+  vertex.color = {1.0f, 1.0f, 1.0f};
+  return vertex;
+}
+
+/* Appends the streamed model to the vertex and index arrays */
+class VectorMeshSink : public MeshSink {
+ public:
+  VectorMeshSink(std::vector<Vertex> &v, std::vector<uint32_t> &i) : vertices(v), indices(i) {}
+
+  void addVertices(const Vertex *data, size_t count) {
+    vertices.insert(vertices.end(), data, data + count);
+  }
+  void addIndices(const uint32_t *data, size_t count) {
+    indices.insert(indices.end(), data, data + count);
+  }
+
+ private:
+  std::vector<Vertex> &vertices;
+  std::vector<uint32_t> &indices;
+};
+
+void VulkanTest::loadModelStreaming()
+{
+  VectorMeshSink sink(vertices, indices);
+  ObjStreamStats stats = streamObj(MODEL_PATH, sink);
+
+  /* The parser working memory leaves out the vertices and indices kept by
+   * the sink, the peak RSS has everything.
+   */
+  printf("Streamed %.1f MB of OBJ: %zu positions, %zu texcoords, parser memory %.1f MB, peak RSS %.1f MB\n",
+         stats.bytesRead / (1024.0 * 1024.0), stats.positions, stats.texcoords,
+         stats.peakBytes / (1024.0 * 1024.0), peakRss() / (1024.0 * 1024.0));
+}
+
+void VulkanTest::loadModel()
+{
+  BenchClock::time_point start = BenchClock::now();
+  uint32_t cacheFlags = (options.meshOpt ? MESH_CACHE_OPTIMIZED : 0) | (options.meshlets ? MESH_CACHE_MESHLETS : 0) |
+                        (options.lods ? MESH_CACHE_LODS : 0);
+
+  if (options.meshCache && meshCache.load(MODEL_CACHE_PATH, MODEL_PATH, cacheFlags)) {
+    vertexData = meshCache.vertices();
+    indexData = meshCache.indices();
+    vertexCount = meshCache.vertexCount();
+    indexCount = meshCache.indexCount();
+    meshChunks.assign(meshCache.chunks(), meshCache.chunks() + meshCache.chunkCount());
+    meshLods.assign(meshCache.lods(), meshCache.lods() + meshCache.lodCount());
+    meshPosScale = meshCache.posScale();
+    meshPosOffset = meshCache.posOffset();
+    printf("Loaded model from %s in %.2f ms: %u vertices, %u indices, %zu chunks\n", MODEL_CACHE_PATH.c_str(),
+           elapsedMs(start, BenchClock::now()), vertexCount, indexCount, meshChunks.size());
+    printLods();
+    createMeshletBounds();
+    return;
+  }
+
+  if (options.streamImport)
+    loadModelStreaming();
+  else
+    loadModelObj();
+
+  /* Done before storing the cache, so the cost is only paid once */
+  if (options.meshOpt)
+    optimizeModel();
+
+  size_t importedBytes = vertices.size() * sizeof(Vertex) + indices.size() * sizeof(uint32_t);
+  if (options.meshlets)
+    packedMesh = packMesh(vertices, indices, MESHLET_MAX_VERTICES, MESHLET_MAX_TRIANGLES);
+  else
+    packedMesh = packMesh(vertices, indices);
+  size_t packedBytes = packedMesh.vertices.size() * sizeof(PackedVertex) +
+                       packedMesh.indices.size() * sizeof(uint16_t);
+  printf("Packed model: %zu chunks, %zu duplicated vertices, %.1f MB -> %.1f MB\n",
+         packedMesh.chunks.size(), packedMesh.vertices.size() - vertices.size(),
+         importedBytes / (1024.0 * 1024.0), packedBytes / (1024.0 * 1024.0));
+
+  createLods();
+
+  /* The full precision geometry is not needed anymore */
+  std::vector<Vertex>().swap(vertices);
+  std::vector<uint32_t>().swap(indices);
+
+  vertexData = packedMesh.vertices.data();
+  indexData = packedMesh.indices.data();
+  vertexCount = static_cast<uint32_t>(packedMesh.vertices.size());
+  indexCount = static_cast<uint32_t>(packedMesh.indices.size());
+  meshChunks = packedMesh.chunks;
+  meshLods = packedMesh.lods;
+  meshPosScale = packedMesh.posScale;
+  meshPosOffset = packedMesh.posOffset;
+  printf("Loaded model from %s in %.2f ms: %u vertices, %u indices, peak RSS %.1f MB\n", MODEL_PATH.c_str(),
+         elapsedMs(start, BenchClock::now()), vertexCount, indexCount, peakRss() / (1024.0 * 1024.0));
+  printLods();
+
+  if (options.meshCache) {
+    if (MeshCache::store(MODEL_CACHE_PATH, MODEL_PATH, packedMesh, cacheFlags))
+      printf("Saved model cache to %s\n", MODEL_CACHE_PATH.c_str());
+    else
+      printf("Failed to save model cache to %s\n", MODEL_CACHE_PATH.c_str());
+  }
+
+  createMeshletBounds();
+}
+
+/* Bounds are cheap to compute from the packed mesh, so they are not cached */
+void VulkanTest::createMeshletBounds()
+{
+  if (!options.meshlets)
+    return;
+
+  BenchClock::time_point start = BenchClock::now();
+  meshletBounds = computeMeshletBounds(vertexData, indexData, meshChunks, meshPosScale, meshPosOffset);
+
+  size_t cones = 0;
+  for (const MeshletBounds &bounds : meshletBounds) {
+    if (bounds.coneCutoff <= 1.0f)
+      cones++;
+  }
+  printf("Computed bounds of %zu meshlets in %.2f ms: %.1f triangles each, %zu with a normal cone\n",
+         meshletBounds.size(), elapsedMs(start, BenchClock::now()),
+         indexCount / 3.0 / std::max(meshletBounds.size(), (size_t) 1), cones);
+}
+
+/* Simplifies the imported model into levels of detail, each one reordered
+ * for the vertex cache and packed with the same chunk limits as level 0.
+ * Levels only reference the vertices they keep, but those are duplicated
+ * in the packed chunks of every level.
+ */
+void VulkanTest::createLods()
+{
+  if (!options.lods)
+    return;
+
+  BenchClock::time_point start = BenchClock::now();
+  std::vector<SimplifiedLevel> levels = simplifyMesh(vertices, indices, LOD_MAX_LEVELS, LOD_RATIO, LOD_MAX_RATIO);
+
+  size_t vertexBytes = packedMesh.vertices.size() * sizeof(PackedVertex);
+  for (SimplifiedLevel &level : levels) {
+    if (options.meshOpt)
+      optimizeVertexCache(level.indices, vertices.size());
+    if (options.meshlets)
+      appendMeshLod(packedMesh, packMesh(vertices, level.indices, MESHLET_MAX_VERTICES, MESHLET_MAX_TRIANGLES),
+                    level.error);
+    else
+      appendMeshLod(packedMesh, packMesh(vertices, level.indices), level.error);
+  }
+
+  printf("Simplified model in %.2f ms: %zu levels of detail, %.1f MB more vertices\n",
+         elapsedMs(start, BenchClock::now()), levels.size(),
+         (packedMesh.vertices.size() * sizeof(PackedVertex) - vertexBytes) / (1024.0 * 1024.0));
+}
+
+uint32_t VulkanTest::lodTriangles(uint32_t level) const
+{
+  uint32_t triangles = 0;
+  for (uint32_t chunk = 0; chunk < meshLods[level].chunkCount; chunk++)
+    triangles += meshChunks[meshLods[level].firstChunk + chunk].indexCount / 3;
+  return triangles;
+}
+
+/* Error against triangle count of every level, the error relative to the
+ * diagonal of the bounding box too.
+ */
+void VulkanTest::printLods() const
+{
+  if (meshLods.size() <= 1)
+    return;
+
+  float size = glm::length(meshPosScale);
+  for (uint32_t level = 0; level < (uint32_t) meshLods.size(); level++) {
+    printf("  LOD %u: %u triangles (%.1f%%), error %g (%.4f%% of the model size)\n", level, lodTriangles(level),
+           100.0 * lodTriangles(level) / std::max(lodTriangles(0), 1u), meshLods[level].error,
+           100.0 * meshLods[level].error / size);
+  }
+}
+
+void VulkanTest::optimizeModel()
+{
+  BenchClock::time_point start = BenchClock::now();
+  VertexCacheStats before = analyzeVertexCache(indices.data(), indices.size(), vertices.size());
+
+  optimizeVertexCache(indices, vertices.size());
+  optimizeOverdraw(indices, vertices, MESH_OPT_OVERDRAW_THRESHOLD);
+  optimizeVertexFetch(vertices, indices);
+
+  VertexCacheStats after = analyzeVertexCache(indices.data(), indices.size(), vertices.size());
+  printf("Optimized model in %.2f ms: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n",
+         elapsedMs(start, BenchClock::now()), before.acmr, after.acmr, before.atvr, after.atvr);
+}
+
+void VulkanTest::loadModelObj()
+{
+  tinyobj::attrib_t attrib;
+  std::vector<tinyobj::shape_t> shapes;
+  std::vector<tinyobj::material_t> materials;
+  std::string warn, err;
+
+  if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, MODEL_PATH.c_str())) {
+    throw std::runtime_error(warn + err);
+  }
+
+  /* Corners are split in chunks that are deduplicated in parallel, each one
+   * in its own index space. Chunks never span two shapes.
+   */
+  std::vector<ImportChunk> chunks;
+  size_t cornerCount = 0;
+  for (const auto& shape : shapes) {
+    size_t shapeCorners = shape.mesh.indices.size();
+    for (size_t begin = 0; begin < shapeCorners; begin += IMPORT_CHUNK_CORNERS) {
+      ImportChunk chunk;
+      chunk.shape = &shape;
+      chunk.begin = begin;
+      chunk.end = std::min(begin + IMPORT_CHUNK_CORNERS, shapeCorners);
+      chunk.firstIndex = cornerCount + begin;
+      chunks.push_back(chunk);
+    }
+    cornerCount += shapeCorners;
+  }
+
+  threadPool.parallelFor(chunks.size(), [&attrib, &chunks](size_t c) {
+    ImportChunk &chunk = chunks[c];
+    /* Most corners share their vertex with two or more others */
+    VertexDedupTable uniqueVertices((chunk.end - chunk.begin) / 3);
+
+    chunk.indices.reserve(chunk.end - chunk.begin);
+    for (size_t i = chunk.begin; i < chunk.end; i++) {
+      Vertex vertex = objVertex(attrib, chunk.shape->mesh.indices[i]);
+      chunk.indices.push_back(uniqueVertices.insert(vertex, chunk.vertices));
+    }
+  });
+
+  /* Merge the chunk vertices in order. A vertex is added the first time it
+   * shows up, like a serial import would do, so the output doesn't depend on
+   * the number of threads. Only unique vertices of each chunk go through this
+   * serial step.
+   */
+  size_t expectedVertices = std::max(attrib.vertices.size() / 3, attrib.texcoords.size() / 2);
+  VertexDedupTable uniqueVertices(expectedVertices);
+  vertices.reserve(expectedVertices);
+
+  for (auto &chunk : chunks) {
+    chunk.remap.resize(chunk.vertices.size());
+    for (size_t i = 0; i < chunk.vertices.size(); i++)
+      chunk.remap[i] = uniqueVertices.insert(chunk.vertices[i], vertices);
+    std::vector<Vertex>().swap(chunk.vertices);
+  }
+
+  indices.resize(cornerCount);
+  threadPool.parallelFor(chunks.size(), [this, &chunks](size_t c) {
+    const ImportChunk &chunk = chunks[c];
+    for (size_t i = 0; i < chunk.indices.size(); i++)
+      indices[chunk.firstIndex + i] = chunk.remap[chunk.indices[i]];
+  });
+}
+
+void VulkanTest::createUploadService()
+{
+  /* Submit the setup work recorded so far: the upload timers need the query
+   * reset, which a dedicated transfer queue has to wait for.
+   */
+  bool waitReset = transferTimestampsSupported && queueTransferFamilyIndex != queueGraphicsFamilyIndex;
+  submitSetupCommands(waitReset ? setupSemaphore : VK_NULL_HANDLE);
+
+  uploader.init(phyDevice, device, allocator, graphicsQueue, queueGraphicsFamilyIndex,
+                transferQueue, queueTransferFamilyIndex);
+  if (waitReset)
+    uploader.waitSemaphore(setupSemaphore, VK_PIPELINE_STAGE_TRANSFER_BIT);
+  if (!transferTimestampsSupported)
+    return;
+
+  uploader.setGpuTimer(
+    [this](VkCommandBuffer commandBuffer, const std::string &label) {
+      return beginGpuUploadTimer(commandBuffer, label);
+    },
+    [this](VkCommandBuffer commandBuffer, int timer) {
+      endGpuUploadTimer(commandBuffer, timer);
+    });
+}
+
+void VulkanTest::createVertexBuffer()
+{
+  VkDeviceSize bufferSize = sizeof(PackedVertex) * vertexCount;
+
+  uploader.createBuffer(vertexData, bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                        vertexBuffer, vertexBufferMemory, "vertex_copy");
+  printf("Created vertex buffer\n");
+}
+
+void VulkanTest::createIndexBuffer()
+{
+  VkDeviceSize bufferSize = sizeof(uint16_t) * indexCount;
+
+  uploader.createBuffer(indexData, bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                        indexBuffer, indexBufferMemory, "index_copy");
+  printf("Created index buffer\n");
+}
+
+void VulkanTest::endCommandBufferAndSubmit(VkCommandBuffer commandBuffer)
 {
   vkEndCommandBuffer(commandBuffer);
 
@@ -1097,37 +2220,167 @@ VkCommandBuffer VulkanTest::beginCommandBuffer()
   return commandBuffer;
 }
 
+/* Returns the open command buffer of the setup batch, starting a new one if
+ * needed. Its commands run in recording order on the graphics queue.
+ */
+VkCommandBuffer VulkanTest::setupCommandBuffer()
+{
+  if (setupCommands == VK_NULL_HANDLE)
+    setupCommands = beginCommandBuffer();
+  return setupCommands;
+}
+
+/* Submits the setup commands recorded so far without waiting for them */
+void VulkanTest::submitSetupCommands(VkSemaphore signalSemaphore)
+{
+  if (setupCommands == VK_NULL_HANDLE)
+    return;
+
+  vkEndCommandBuffer(setupCommands);
+
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &setupCommands;
+  submitInfo.signalSemaphoreCount = signalSemaphore != VK_NULL_HANDLE ? 1 : 0;
+  submitInfo.pSignalSemaphores = &signalSemaphore;
+
+  VkResult res = vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error submitting setup commands");
+
+  setupSubmitted.push_back(setupCommands);
+  setupCommands = VK_NULL_HANDLE;
+}
+
+/* Submits the rest of the setup batch and waits once for all of it. The
+ * fence also covers the earlier graphics queue submissions, the upload
+ * acquires included.
+ */
+void VulkanTest::flushSetupCommands()
+{
+  if (setupCommands == VK_NULL_HANDLE && setupSubmitted.empty())
+    return;
+
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  if (setupCommands != VK_NULL_HANDLE) {
+    vkEndCommandBuffer(setupCommands);
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &setupCommands;
+  }
+
+  VkResult res = vkQueueSubmit(graphicsQueue, 1, &submitInfo, setupFence);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error submitting setup commands");
+
+  if (setupCommands != VK_NULL_HANDLE)
+    setupSubmitted.push_back(setupCommands);
+  setupCommands = VK_NULL_HANDLE;
+
+  vkWaitForFences(device, 1, &setupFence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+  vkResetFences(device, 1, &setupFence);
+
+  vkFreeCommandBuffers(device, cmdPool, (uint32_t) setupSubmitted.size(), setupSubmitted.data());
+  setupSubmitted.clear();
+
+  std::vector<std::function<void()>> destroys;
+  destroys.swap(setupDestroys);
+  for (auto &destroy : destroys)
+    destroy();
+}
+
 void VulkanTest::createUniformBuffer()
 {
-  VkDeviceSize bufferSize = sizeof(UniformBufferObject);
-  createBuffer(bufferSize,
-               VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-               uniformBuffer, uniformBufferMemory);
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(phyDevice, &properties);
+
+  uniformRing.init(allocator, device, properties.limits.minUniformBufferOffsetAlignment,
+                   sizeof(UniformBufferObject), options.framesInFlight);
   printf("Created Uniform buffer\n");
 }
 
-void VulkanTest::updateUniformBuffer()
+void VulkanTest::createInstanceBuffer()
 {
-  static auto startTime = std::chrono::high_resolution_clock::now();
-  auto currentTime = std::chrono::high_resolution_clock::now();
-  float time = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(phyDevice, &properties);
+
+  instanceRing.init(allocator, device, properties.limits.minStorageBufferOffsetAlignment,
+                    sizeof(glm::mat4) * options.objects, options.framesInFlight,
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  if (options.cpuCull)
+    objectBounds.resize(options.objects);
+  if (drawList)
+    objectModels.resize(options.objects);
+  if (lodSelect) {
+    objectLods.resize(options.objects);
+    lodObjects.assign(meshLods.size(), 0);
+  }
+}
+
+glm::mat4 VulkanTest::viewMatrix()
+{
+  return glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f));
+}
+
+glm::mat4 VulkanTest::projectionMatrix(VkExtent2D extent)
+{
+  return glm::perspective(glm::radians(45.0f), extent.width / (float) extent.height, CAMERA_NEAR, CAMERA_FAR);
+}
+
+void VulkanTest::updateUniformBuffer(BenchClock::time_point inputTime)
+{
+  static auto startTime = inputTime;
+  float time = std::chrono::duration<float, std::chrono::seconds::period>(inputTime - startTime).count();
   UniformBufferObject ubo = {};
-  ubo.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-  ubo.view = glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f));
-  ubo.proj = glm::perspective(glm::radians(45.0f), swapChainExtent.width / (float) swapChainExtent.height, 0.1f, 10.0f);
-  fillBuffer(uniformBufferMemory, sizeof(ubo), &ubo);
+  glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+  ubo.view = viewMatrix();
+  ubo.proj = projectionMatrix(swapChainExtent);
+  ubo.posScale = glm::vec4(meshPosScale, 0.0f);
+  ubo.posOffset = glm::vec4(meshPosOffset, 0.0f);
+
+  /* Culling uses the frustum of the view-projection matrix and a sphere
+   * enclosing the bounding box of the mesh.
+   */
+  frustum = frustumFromMatrix(ubo.proj * ubo.view);
+  cameraPosition = glm::vec3(glm::inverse(ubo.view)[3]);
+  lodScale = std::abs(ubo.proj[1][1]) * 0.5f * swapChainExtent.height;
+  for (int i = 0; i < 6; i++)
+    ubo.frustum[i] = frustum.planes[i];
+  ubo.sphere = glm::vec4(meshPosOffset + meshPosScale * 0.5f, glm::length(meshPosScale) * 0.5f);
+
+  /* The slices are persistently mapped and the fence of the frame has signaled */
+  memcpy(uniformRing.data(currentFrame), &ubo, sizeof(ubo));
+
+  /* Objects are laid out in a square grid scaled to the size of a single
+   * model, so a single object is drawn as before.
+   */
+  glm::mat4 *models = static_cast<glm::mat4 *>(instanceRing.data(currentFrame));
+  uint32_t side = (uint32_t) std::ceil(std::sqrt((double) options.objects));
+  float cell = 2.0f / side;
+  for (uint32_t object = 0; object < options.objects; object++) {
+    glm::vec3 center((object % side + 0.5f) * cell - 1.0f, (object / side + 0.5f) * cell - 1.0f, 0.0f);
+    glm::mat4 model = glm::scale(glm::translate(glm::mat4(1.0f), center), glm::vec3(1.0f / side)) * rotation;
+    models[object] = model;
+    if (drawList)
+      objectModels[object] = model;
+    /* The rotation keeps the radius, the grid scales it */
+    if (options.cpuCull)
+      objectBounds.set(object, glm::vec3(model * glm::vec4(glm::vec3(ubo.sphere), 1.0f)), ubo.sphere.w / side);
+  }
 }
 
 void VulkanTest::createDescriptorPool()
 {
   VkResult res = VK_SUCCESS;
 
-  std::array<VkDescriptorPoolSize, 2> poolSizes = {};
-  poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  std::array<VkDescriptorPoolSize, 3> poolSizes = {};
+  poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   poolSizes[0].descriptorCount = 1;
   poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
   poolSizes[1].descriptorCount = 1;
+  poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  poolSizes[2].descriptorCount = 1;
 
   VkDescriptorPoolCreateInfo poolInfo = {};
   poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -1157,13 +2410,8 @@ void VulkanTest::createDescriptorSet()
   if (res != VK_SUCCESS)
     throw std::runtime_error("Error allocating descriptor set");
 
-  /* Once allocated, indicate it has a uniform buffer and bind it to the one
-   * we created before.
-   */
-  VkDescriptorBufferInfo bufferInfo = {};
-  bufferInfo.buffer = uniformBuffer;
-  bufferInfo.offset = 0;
-  bufferInfo.range = sizeof(UniformBufferObject);
+  updateUniformDescriptor();
+  updateInstanceDescriptor();
 
   /* Describe the texture sampler we use and bind it */
   VkDescriptorImageInfo imageInfo = {};
@@ -1171,65 +2419,78 @@ void VulkanTest::createDescriptorSet()
   imageInfo.imageView = textureImageView;
   imageInfo.sampler = textureSampler;
 
-  std::array<VkWriteDescriptorSet, 2> descriptorWrites = {};
-
-  descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-  descriptorWrites[0].dstSet = descriptorSet;
-  descriptorWrites[0].dstBinding = 0;
-  descriptorWrites[0].dstArrayElement = 0;
-  descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  descriptorWrites[0].descriptorCount = 1;
-  descriptorWrites[0].pBufferInfo = &bufferInfo;
-
-  descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-  descriptorWrites[1].dstSet = descriptorSet;
-  descriptorWrites[1].dstBinding = 1;
-  descriptorWrites[1].dstArrayElement = 0;
-  descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-  descriptorWrites[1].descriptorCount = 1;
-  descriptorWrites[1].pImageInfo = &imageInfo;
-
-  vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()),
-                         descriptorWrites.data(), 0, VK_NULL_HANDLE);
+  VkWriteDescriptorSet descriptorWrite = {};
+  descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  descriptorWrite.dstSet = descriptorSet;
+  descriptorWrite.dstBinding = 1;
+  descriptorWrite.dstArrayElement = 0;
+  descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  descriptorWrite.descriptorCount = 1;
+  descriptorWrite.pImageInfo = &imageInfo;
+
+  vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, VK_NULL_HANDLE);
   printf("Created descriptor set\n");
 }
 
-uint32_t VulkanTest::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties)
+void VulkanTest::updateInstanceDescriptor()
 {
-  VkPhysicalDeviceMemoryProperties memProperties;
-  vkGetPhysicalDeviceMemoryProperties(phyDevice, &memProperties);
-
-  for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-    if ((typeFilter & (1 << i)) &&
-        (memProperties.memoryTypes[i].propertyFlags & properties) == properties)
-      return i;
-  }
+  VkDescriptorBufferInfo bufferInfo = {};
+  bufferInfo.buffer = instanceRing.buffer();
+  bufferInfo.offset = 0;
+  bufferInfo.range = instanceRing.range();
+
+  VkWriteDescriptorSet descriptorWrite = {};
+  descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  descriptorWrite.dstSet = descriptorSet;
+  descriptorWrite.dstBinding = 2;
+  descriptorWrite.dstArrayElement = 0;
+  descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  descriptorWrite.descriptorCount = 1;
+  descriptorWrite.pBufferInfo = &bufferInfo;
+
+  vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, VK_NULL_HANDLE);
+}
 
-  throw std::runtime_error("Error finding suitable memory type");
+void VulkanTest::updateUniformDescriptor()
+{
+  /* The whole ring is behind one dynamic uniform buffer descriptor, the
+   * slice is selected with the dynamic offset when binding the set.
+   */
+  VkDescriptorBufferInfo bufferInfo = {};
+  bufferInfo.buffer = uniformRing.buffer();
+  bufferInfo.offset = 0;
+  bufferInfo.range = uniformRing.range();
+
+  VkWriteDescriptorSet descriptorWrite = {};
+  descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  descriptorWrite.dstSet = descriptorSet;
+  descriptorWrite.dstBinding = 0;
+  descriptorWrite.dstArrayElement = 0;
+  descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  descriptorWrite.descriptorCount = 1;
+  descriptorWrite.pBufferInfo = &bufferInfo;
+
+  vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, VK_NULL_HANDLE);
 }
 
-void VulkanTest::createTextureImage()
+/* CPU only, runs on a startup worker thread */
+void VulkanTest::decodeTexture()
 {
-  VkResult res = VK_SUCCESS;
-  int texWidth, texHeight, texChannels;
-  stbi_uc* pixels = stbi_load(TEXTURE_PATH.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-  VkDeviceSize imageSize = texWidth * texHeight * 4;
-  mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
+  BenchClock::time_point start = BenchClock::now();
+  int texChannels;
+  texturePixels = stbi_load(TEXTURE_PATH.c_str(), &textureWidth, &textureHeight, &texChannels, STBI_rgb_alpha);
 
-  if (!pixels)
+  if (!texturePixels)
     throw std::runtime_error("Error loading texture image");
 
-  /* Upload the read data into a staging buffer, we will copy it to a image later. */
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingBufferMemory;
-
-  createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-               stagingBuffer, stagingBufferMemory);
-  fillBuffer(stagingBufferMemory, imageSize, pixels);
-  stbi_image_free(pixels);
+  printf("Decoded texture %s in %.2f ms: %dx%d\n", TEXTURE_PATH.c_str(),
+         elapsedMs(start, BenchClock::now()), textureWidth, textureHeight);
+}
 
-  printf("Created buffer to copy the read pixels from texture.jpg to\n");
+void VulkanTest::createTextureImage()
+{
+  int texWidth = textureWidth, texHeight = textureHeight;
+  mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
 
   /* Create the image to copy the data to */
   VkImageCreateInfo imageInfo = {};
@@ -1248,73 +2509,19 @@ void VulkanTest::createTextureImage()
   imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
   imageInfo.flags = 0; // Optional
 
-  res = vkCreateImage(device, &imageInfo, VK_NULL_HANDLE, &textureImage);
-  if (res != VK_SUCCESS)
-    throw std::runtime_error("Error creating image");
-
-  VkMemoryRequirements memRequirements;
-  vkGetImageMemoryRequirements(device, textureImage, &memRequirements);
-
-  VkMemoryAllocateInfo allocInfo = {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memRequirements.size;
-  allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-  res = vkAllocateMemory(device, &allocInfo, nullptr, &textureImageMemory);
-  if (res != VK_SUCCESS)
-    throw std::runtime_error("Error allocating image memory!");
-
-  vkBindImageMemory(device, textureImage, textureImageMemory, 0);
+  allocator.createImage(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
 
   printf("Created image\n");
 
-  /* Copy the data */
-  VkCommandBuffer commandBuffer = beginCommandBuffer();
-
-  /* Change layout */
-  VkImageMemoryBarrier barrier = {};
-  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.image = textureImage;
-  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  barrier.subresourceRange.baseMipLevel = 0;
-  barrier.subresourceRange.levelCount = mipLevels;
-  barrier.subresourceRange.baseArrayLayer = 0;
-  barrier.subresourceRange.layerCount = 1;
-  barrier.srcAccessMask = 0;
-  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-  vkCmdPipelineBarrier(
-    commandBuffer,
-    VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-    0,
-    0, VK_NULL_HANDLE,
-    0, VK_NULL_HANDLE,
-    1, &barrier);
-
-  VkBufferImageCopy region = {};
-  region.bufferOffset = 0;
-  region.bufferRowLength = 0;
-  region.bufferImageHeight = 0;
+  /* Copy the data through the upload ring, it may run on the transfer queue */
+  uploader.uploadImage(texturePixels, textureImage, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight),
+                       4, mipLevels, "texture_copy");
+  stbi_image_free(texturePixels);
+  texturePixels = nullptr;
+  uploader.submit();
 
-  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  region.imageSubresource.mipLevel = 0;
-  region.imageSubresource.baseArrayLayer = 0;
-  region.imageSubresource.layerCount = 1;
-
-  region.imageOffset = {0, 0, 0};
-  region.imageExtent = {
-    static_cast<uint32_t>(texWidth),
-    static_cast<uint32_t>(texHeight),
-    1
-  };
-
-  vkCmdCopyBufferToImage(commandBuffer, stagingBuffer, textureImage,
-                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                         1, &region);
+  /* Mipmaps are blitted on the graphics queue, ordered after the copy */
+  VkCommandBuffer commandBuffer = setupCommandBuffer();
 
   // Generate mipmaps
 
@@ -1364,10 +2571,12 @@ void VulkanTest::createTextureImage()
     blit.dstSubresource.baseArrayLayer = 0;
     blit.dstSubresource.layerCount = 1;
 
+    int timer = beginGpuUploadTimer(commandBuffer, "texture_mip" + std::to_string(i));
     vkCmdBlitImage(commandBuffer, textureImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
                    textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                    1, &blit,
                    VK_FILTER_LINEAR);
+    endGpuUploadTimer(commandBuffer, timer);
     /* Change layout of i - 1 mipmap level */
     VkImageMemoryBarrier barrierPostMipmap = {};
     barrierPostMipmap.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
@@ -1418,12 +2627,8 @@ void VulkanTest::createTextureImage()
                         0, VK_NULL_HANDLE,
                         0, VK_NULL_HANDLE,
                         1, &barrierPostLastMipmap);
-  endCommandBufferAndSubmit(commandBuffer);
 
-  vkDestroyBuffer(device, stagingBuffer, VK_NULL_HANDLE);
-  vkFreeMemory(device, stagingBufferMemory, VK_NULL_HANDLE);
-
-  printf("Copied the pixels in the buffer to the image\n");
+  printf("Recorded the mipmap generation of the texture image\n");
 }
 
 void VulkanTest::createTextureImageView()
@@ -1494,26 +2699,10 @@ void VulkanTest::createColorResources()
   imageInfo.samples = msaaSamples;
   imageInfo.flags = 0; // Optional
 
-  res = vkCreateImage(device, &imageInfo, VK_NULL_HANDLE, &colorImage);
-  if (res != VK_SUCCESS)
-    throw std::runtime_error("Error creating image");
+  allocator.createImage(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, colorImage, colorImageMemory);
 
   printf("Created color msaa image\n");
 
-  VkMemoryRequirements memRequirements;
-  vkGetImageMemoryRequirements(device, colorImage, &memRequirements);
-
-  VkMemoryAllocateInfo allocInfo = {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memRequirements.size;
-  allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-  res = vkAllocateMemory(device, &allocInfo, nullptr, &colorImageMemory);
-  if (res != VK_SUCCESS)
-    throw std::runtime_error("Error allocating image memory!");
-
-  vkBindImageMemory(device, colorImage, colorImageMemory, 0);
-
   VkImageViewCreateInfo createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
   createInfo.image = colorImage;
@@ -1534,7 +2723,7 @@ void VulkanTest::createColorResources()
     throw std::runtime_error("Error creating color msaa image view");
 
   /* Change color image layout */
-  VkCommandBuffer commandBuffer = beginCommandBuffer();
+  VkCommandBuffer commandBuffer = setupCommandBuffer();
   VkImageMemoryBarrier barrier = {};
   barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
   barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -1557,9 +2746,8 @@ void VulkanTest::createColorResources()
     0, VK_NULL_HANDLE,
     0, VK_NULL_HANDLE,
     1, &barrier);
-  endCommandBufferAndSubmit(commandBuffer);
 
-  printf("Changed layout color msaa image\n");
+  printf("Recorded layout change of color msaa image\n");
 }
 
 void VulkanTest::createDepthResources()
@@ -1584,26 +2772,10 @@ void VulkanTest::createDepthResources()
   imageInfo.samples = msaaSamples;
   imageInfo.flags = 0; // Optional
 
-  res = vkCreateImage(device, &imageInfo, VK_NULL_HANDLE, &depthImage);
-  if (res != VK_SUCCESS)
-    throw std::runtime_error("Error creating image");
+  allocator.createImage(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthImage, depthImageMemory);
 
   printf("Created depth image\n");
 
-  VkMemoryRequirements memRequirements;
-  vkGetImageMemoryRequirements(device, depthImage, &memRequirements);
-
-  VkMemoryAllocateInfo allocInfo = {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memRequirements.size;
-  allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-  res = vkAllocateMemory(device, &allocInfo, nullptr, &depthImageMemory);
-  if (res != VK_SUCCESS)
-    throw std::runtime_error("Error allocating image memory!");
-
-  vkBindImageMemory(device, depthImage, depthImageMemory, 0);
-
   VkImageViewCreateInfo createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
   createInfo.image = depthImage;
@@ -1624,7 +2796,7 @@ void VulkanTest::createDepthResources()
     throw std::runtime_error("Error creating depth image view");
 
   /* Change depth image layout */
-  VkCommandBuffer commandBuffer = beginCommandBuffer();
+  VkCommandBuffer commandBuffer = setupCommandBuffer();
   VkImageMemoryBarrier barrier = {};
   barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
   barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -1647,9 +2819,8 @@ void VulkanTest::createDepthResources()
     0, VK_NULL_HANDLE,
     0, VK_NULL_HANDLE,
     1, &barrier);
-  endCommandBufferAndSubmit(commandBuffer);
 
-  printf("Changed layout depth image\n");
+  printf("Recorded layout change of depth image\n");
 }
 
 VkFormat VulkanTest::findDepthFormat()
@@ -1684,77 +2855,336 @@ VkFormat VulkanTest::findSupportedFormat(const std::vector<VkFormat>& candidates
 
 void VulkanTest::cleanup()
 {
-  for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+  for (unsigned i = 0; i < options.framesInFlight; i++) {
     vkDestroySemaphore(device, renderFinishedSemaphore[i], VK_NULL_HANDLE);
     vkDestroySemaphore(device, imageAvailableSemaphore[i], VK_NULL_HANDLE);
     vkDestroyFence(device, inFlightFences[i], VK_NULL_HANDLE);
   }
 
   vkDestroyDescriptorPool(device, descriptorPool, VK_NULL_HANDLE);
+  destroyFrameCommands();
+
+  if (uploadQueryPool != VK_NULL_HANDLE)
+    vkDestroyQueryPool(device, uploadQueryPool, VK_NULL_HANDLE);
+  if (frameQueryPool != VK_NULL_HANDLE)
+    vkDestroyQueryPool(device, frameQueryPool, VK_NULL_HANDLE);
 
   vkDestroySampler(device, textureSampler, VK_NULL_HANDLE);
   vkDestroyImageView(device, textureImageView, VK_NULL_HANDLE);
   vkDestroyImage(device, textureImage, VK_NULL_HANDLE);
-  vkFreeMemory(device, textureImageMemory, VK_NULL_HANDLE);
-
-  vkDestroyBuffer(device, uniformBuffer, VK_NULL_HANDLE);
-  vkFreeMemory(device, uniformBufferMemory, VK_NULL_HANDLE);
+  allocator.free(textureImageMemory);
+
+  uniformRing.destroy();
+  instanceRing.destroy();
+  if (options.gpuCull && lastSubmittedFrame >= 0)
+    printf("GPU culling: %u of %u draws visible in the last frame\n",
+           gpuCulling.visibleDraws(lastSubmittedFrame), gpuCulling.maxDraws());
+  gpuCulling.destroy();
+  if (options.cpuCull && culledFrames)
+    printf("CPU culling (%s): %.1f of %u objects visible on average\n", SphereCuller::pathName(objectBounds.path()),
+           culledVisible / (double) culledFrames, options.objects);
+  if (drawList && drawListFrames) {
+    /* Relative to drawing level 0 of every object */
+    uint64_t triangles = (uint64_t) lodTriangles(0) * options.objects;
+    if (clusterCull)
+      printf("Cluster culling: %.1f of %zu meshlets, %.1f%% of the triangles drawn on average\n",
+             drawListChunks / (double) drawListFrames, (size_t) meshLods[0].chunkCount * options.objects,
+             100.0 * drawListTriangles / ((double) drawListFrames * triangles));
+    else
+      printf("LOD selection: %.1f%% of the triangles drawn on average\n",
+             100.0 * drawListTriangles / ((double) drawListFrames * triangles));
+  }
+  if (lodSelect && drawListFrames) {
+    uint64_t selected = 0;
+    for (uint64_t count : lodObjects)
+      selected += count;
+    for (size_t level = 0; level < lodObjects.size(); level++)
+      printf("  LOD %zu: %.1f%% of the objects drawn\n", level,
+             100.0 * lodObjects[level] / std::max(selected, (uint64_t) 1));
+  }
   vkDestroyBuffer(device, indexBuffer, VK_NULL_HANDLE);
-  vkFreeMemory(device, indexBufferMemory, VK_NULL_HANDLE);
+  allocator.free(indexBufferMemory);
   vkDestroyBuffer(device, vertexBuffer, VK_NULL_HANDLE);
-  vkFreeMemory(device, vertexBufferMemory, VK_NULL_HANDLE);
+  allocator.free(vertexBufferMemory);
 
   destroySwapchain();
+  vkDestroyPipeline(device, graphicsPipeline, VK_NULL_HANDLE);
+  vkDestroyPipelineLayout(device, pipelineLayout, VK_NULL_HANDLE);
+  vkDestroyDescriptorSetLayout(device, setLayout, VK_NULL_HANDLE);
+  vkDestroyRenderPass(device, renderPass, VK_NULL_HANDLE);
+  vkDestroySemaphore(device, setupSemaphore, VK_NULL_HANDLE);
+  vkDestroyFence(device, setupFence, VK_NULL_HANDLE);
   vkDestroyCommandPool(device, cmdPool, VK_NULL_HANDLE);
 
+  uploader.destroy();
+  allocator.destroy();
+  pipelineCache.printStats();
+  pipelineCache.save();
+  pipelineCache.destroy();
   vkDestroyDevice(device, VK_NULL_HANDLE);
-  DestroyDebugReportCallbackEXT(instance, callback, VK_NULL_HANDLE);
-  vkDestroySurfaceKHR(instance, surface, VK_NULL_HANDLE);
+  if (ENABLE_DEBUG)
+    DestroyDebugReportCallbackEXT(instance, callback, VK_NULL_HANDLE);
+  if (!options.headless)
+    vkDestroySurfaceKHR(instance, surface, VK_NULL_HANDLE);
   vkDestroyInstance(instance, VK_NULL_HANDLE);
 
-  glfwDestroyWindow(window);
-  glfwTerminate();
+  if (!options.headless) {
+    glfwDestroyWindow(window);
+    glfwTerminate();
+  }
   printf("Cleaned up all\n");
 }
 
 void VulkanTest::init()
 {
-  initWindow();
-  createInstance();
-  if (ENABLE_DEBUG)
-    setupDebugCallback();
-  createSurface();
-  createDevice();
-  getQueue();
-  createSwapchain();
-  createSwapchainImageViews();
-  createRenderPass();
-  createCommandPool(); // Created here becase we will need to transition the layout of the depthImage
-  createDepthResources();
-  createColorResources();
-  createFramebuffer();
-  createPipeline();
-  loadModel();
-  createVertexBuffer();
-  createIndexBuffer();
-  createUniformBuffer();
-  createTextureImage();
-  createTextureImageView();
-  createTextureSampler();
-  createDescriptorPool();
-  createDescriptorSet();
-  createCommandBuffers();
-  recordCommandBuffers();
-  createSyncObjects();
+  /* Mirrors the serial order of the setup: main tasks run in this order on
+   * this thread, the asset tasks only need to be done before their uploads.
+   */
+  const StartupGraph::TaskThread MAIN = StartupGraph::TASK_MAIN;
+  StartupGraph startup;
+
+  unsigned texture = startup.add("decode_texture", StartupGraph::TASK_WORKER, {}, [this]() {
+    decodeTexture();
+  });
+  unsigned model = startup.add("load_model", StartupGraph::TASK_WORKER, {}, [this]() {
+    loadModel();
+  });
+
+  startup.add("window", MAIN, {}, [this]() {
+    if (!options.headless)
+      initWindow();
+  });
+  startup.add("instance", MAIN, {}, [this]() {
+    createInstance();
+    if (ENABLE_DEBUG)
+      setupDebugCallback();
+    if (!options.headless)
+      createSurface();
+  });
+  startup.add("device", MAIN, {}, [this]() {
+    createDevice();
+    getQueue();
+    pipelineCache.init(phyDevice, device, options.pipelineCache ? PIPELINE_CACHE_PATH : "");
+  });
+  startup.add("swapchain", MAIN, {}, [this]() {
+    if (options.headless)
+      createOffscreenImages();
+    else
+      createSwapchain();
+    createSwapchainImageViews();
+    createRenderPass();
+  });
+  startup.add("attachments", MAIN, {}, [this]() {
+    createCommandPool(); // Created here becase we will need to transition the layout of the depthImage
+    createDepthResources();
+    createColorResources();
+    createFramebuffer();
+  });
+  startup.add("pipeline", MAIN, {}, [this]() {
+    /* Includes the descriptor set layout too */
+    createPipelineLayout();
+    createPipeline();
+  });
+  startup.add("upload_setup", MAIN, {}, [this]() {
+    createUploadQueryPool();
+    createUploadService();
+  });
+  startup.add("geometry_upload", MAIN, {model}, [this]() {
+    createVertexBuffer();
+    createIndexBuffer();
+    /* Geometry is in the staging ring or GPU memory now, release the mapped cache */
+    meshCache.unload();
+    uploader.submit();
+  });
+  startup.add("uniform_buffer", MAIN, {model}, [this]() {
+    createUniformBuffer();
+    /* Sizes the per level of detail counts with the loaded model */
+    createInstanceBuffer();
+  });
+  startup.add("texture_upload", MAIN, {texture}, [this]() {
+    createTextureImage();
+    createTextureImageView();
+    createTextureSampler();
+  });
+  startup.add("command_buffers", MAIN, {}, [this]() {
+    createDescriptorPool();
+    createDescriptorSet();
+    if (options.gpuCull) {
+      /* Always level 0, the compute pass doesn't select levels */
+      std::vector<MeshChunk> chunks(meshChunks.begin(), meshChunks.begin() + meshLods[0].chunkCount);
+      gpuCulling.init(phyDevice, device, allocator, uploader, pipelineCache.handle(), chunks,
+                      options.objects, options.framesInFlight, drawIndirectCount, maxDrawIndirectCount);
+      gpuCulling.setInputs(uniformRing.buffer(), uniformRing.range(), instanceRing.buffer(), instanceRing.range());
+      uploader.submit();
+    }
+    createFrameCommands();
+    createFrameQueryPool();
+    createSyncObjects();
+  });
+  startup.add("gpu_setup_wait", MAIN, {}, [this]() {
+    /* The only wait for the GPU during init: layout transitions, uploads and mipmaps */
+    flushSetupCommands();
+    if (uploader.retire())
+      uploader.printStats();
+  });
+
+  startup.run();
+  startup.printTimeline();
+  allocator.printStats();
+}
+
+void VulkanTest::runBenchmark()
+{
+  static const char *stageNames[FRAME_STAGE_COUNT] = {
+    "fence_wait", "acquire", "pacing", "ubo_update", "cull", "record", "submit", "present"
+  };
+
+  unsigned frameSeries = benchStats.addSeries("frame");
+  unsigned stageSeries[FRAME_STAGE_COUNT];
+  for (unsigned i = 0; i < FRAME_STAGE_COUNT; i++)
+    stageSeries[i] = benchStats.addSeries(stageNames[i]);
+  unsigned gpuSeries = benchStats.addSeries("gpu_render_pass");
+  unsigned latencySeries = benchStats.addSeries("input_latency");
+
+  /* Run for the requested time if given, otherwise a fixed number of frames */
+  uint64_t frames = options.frames ? options.frames : BENCH_DEFAULT_FRAMES;
+  bool timed = options.benchDuration > 0.0;
+
+  printf("Benchmark: %" PRIu64 " warm-up frames, then ", options.warmupFrames);
+  if (timed)
+    printf("%.2f seconds\n", options.benchDuration);
+  else
+    printf("%" PRIu64 " frames\n", frames);
+
+  bool windowClosed = false;
+  /* A closed window stops both loops before drawing, like run() */
+  for (uint64_t frame = 0; frame < options.warmupFrames; frame++) {
+    if (!options.headless) {
+      glfwPollEvents();
+      windowClosed = glfwWindowShouldClose(window);
+      if (windowClosed)
+        break;
+    }
+    drawFrame();
+  }
+
+  uint64_t measured = 0;
+  BenchClock::time_point start = BenchClock::now();
+  while (!windowClosed) {
+    if (timed) {
+      if (elapsedMs(start, BenchClock::now()) >= options.benchDuration * 1000.0)
+        break;
+    } else if (measured >= frames) {
+      break;
+    }
+
+    if (!options.headless) {
+      glfwPollEvents();
+      windowClosed = glfwWindowShouldClose(window);
+      if (windowClosed)
+        break;
+    }
+    drawFrame();
+
+    /* Frames that ended up recreating the swapchain are not representative */
+    if (!frameTimingValid)
+      continue;
+
+    benchStats.addSample(frameSeries, frameTotalMs);
+    for (unsigned i = 0; i < FRAME_STAGE_COUNT; i++)
+      benchStats.addSample(stageSeries[i], frameStageMs[i]);
+    /* GPU results belong to an older frame, they are resolved without stalling */
+    if (gpuFrameTimeValid)
+      benchStats.addSample(gpuSeries, gpuFrameTimeMs);
+    for (double latency : inputLatencies)
+      benchStats.addSample(latencySeries, latency);
+    measured++;
+  }
+  double wallMs = elapsedMs(start, BenchClock::now());
+
+  vkDeviceWaitIdle(device);
+
+  /* Init-time uploads finished long ago, each one is reported as a single sample */
+  resolveUploadTimestamps();
+  for (const auto &timer : uploadTimers) {
+    if (timer.resolved)
+      benchStats.addSample(benchStats.addSeries("gpu_upload_" + timer.label), timer.ms);
+  }
+
+  printf("\nBenchmark: %" PRIu64 " frames in %.3f s (%.2f FPS)\n",
+         measured, wallMs / 1000.0, measured ? measured * 1000.0 / wallMs : 0.0);
+  benchStats.print();
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(phyDevice, &properties);
+
+  char value[64];
+  std::vector<std::pair<std::string, std::string>> info;
+  info.push_back({"program", PACKAGE_STRING});
+  info.push_back({"device", properties.deviceName});
+  info.push_back({"mode", options.headless ? "headless" : "window"});
+  if (!options.headless)
+    info.push_back({"present_mode", presentModeName(swapChainPresentMode)});
+  snprintf(value, sizeof(value), "%u", (unsigned) swapChainImages.size());
+  info.push_back({"images", value});
+  snprintf(value, sizeof(value), "%u", options.framesInFlight);
+  info.push_back({"frames_in_flight", value});
+  info.push_back({"pacing", options.lowLatency ? "low_latency" : "throughput"});
+  snprintf(value, sizeof(value), "%u", options.objects);
+  info.push_back({"objects", value});
+  snprintf(value, sizeof(value), "%u", drawCount());
+  info.push_back({"draws", value});
+  info.push_back({"instanced", options.instanced ? "true" : "false"});
+  info.push_back({"gpu_cull", options.gpuCull ? "true" : "false"});
+  snprintf(value, sizeof(value), "%zu", meshChunks.size());
+  info.push_back({"chunks", value});
+  info.push_back({"meshlets", options.meshlets ? "true" : "false"});
+  snprintf(value, sizeof(value), "%zu", lodSelect ? meshLods.size() : (size_t) 1);
+  info.push_back({"lods", value});
+  if (options.cpuCull)
+    info.push_back({"cpu_cull", SphereCuller::pathName(objectBounds.path())});
+  else
+    info.push_back({"cpu_cull", "false"});
+  snprintf(value, sizeof(value), "%ux%u", swapChainExtent.width, swapChainExtent.height);
+  info.push_back({"extent", value});
+  snprintf(value, sizeof(value), "%" PRIu64, options.warmupFrames);
+  info.push_back({"warmup_frames", value});
+  snprintf(value, sizeof(value), "%" PRIu64, measured);
+  info.push_back({"frames", value});
+  snprintf(value, sizeof(value), "%.3f", measured ? measured * 1000.0 / wallMs : 0.0);
+  info.push_back({"fps", value});
+
+  if (!options.benchJson.empty())
+    benchStats.writeJson(options.benchJson, info);
+  if (!options.benchCsv.empty())
+    benchStats.writeCsv(options.benchCsv);
 }
 
 void VulkanTest::run()
 {
-  while (!glfwWindowShouldClose(window)) {
-    glfwPollEvents();
+  if (options.bench) {
+    runBenchmark();
+    if (options.headless && !options.outputImage.empty())
+      saveOffscreenImage(options.outputImage);
+    return;
+  }
+
+  uint64_t frames = options.frames;
+  if (options.headless && frames == 0)
+    frames = HEADLESS_DEFAULT_FRAMES;
+
+  for (uint64_t frame = 0; frames == 0 || frame < frames; frame++) {
+    if (!options.headless) {
+      if (glfwWindowShouldClose(window))
+        break;
+      glfwPollEvents();
+    }
     drawFrame();
   }
 
   /* Wait for device finishes what it is doing */
   vkDeviceWaitIdle(device);
+
+  if (options.headless && !options.outputImage.empty())
+    saveOffscreenImage(options.outputImage);
 }
@@ -3,44 +3,131 @@
 #include <GLFW/glfw3.h>
 
 #include <config.h>
+#include <functional>
 #include <vector>
 #include <string>
 
-#define GLM_FORCE_RADIANS
-#define GLM_FORCE_DEPTH_ZERO_TO_ONE // Vulkan's depth range from 0 to 1
-#include <glm/glm.hpp>
+#include "vk-mesh.h"
+#include "vk-mesh-cache.h"
+#include "vk-bench.h"
+#include "vk-thread-pool.h"
+#include "vk-allocator.h"
+#include "vk-upload.h"
+#include "vk-frame-ring.h"
+#include "vk-pipeline-cache.h"
+#include "vk-gpu-cull.h"
+#include "vk-cull.h"
+#include "vk-meshlet.h"
 
-#define GLM_ENABLE_EXPERIMENTAL
-#include <glm/gtx/hash.hpp>
+struct UniformBufferObject {
+  glm::mat4 view;
+  glm::mat4 proj;
+  /* Dequantization of the packed vertex positions (xyz) */
+  glm::vec4 posScale;
+  glm::vec4 posOffset;
+  /* GPU culling: world space frustum planes, inside when
+   * dot(xyz, p) + w >= 0, and the bounding sphere of the mesh in model
+   * space (center, radius).
+   */
+  glm::vec4 frustum[6];
+  glm::vec4 sphere;
+};
+
+struct VulkanTestOptions {
+  /* Render into offscreen images instead of a GLFW window + swapchain */
+  bool             headless = false;
+  uint32_t         width = 800;
+  uint32_t         height = 600;
+  /* Number of frames to render before exiting, 0 means until the window is closed */
+  uint64_t         frames = 0;
+  /* Index of the physical device to use */
+  unsigned         deviceIndex = 0;
+  /* Headless only: dump the last rendered frame as a PPM image */
+  std::string      outputImage;
+
+  /* Benchmark mode: measure 'frames' frames (or 'benchDuration' seconds)
+   * after 'warmupFrames' unmeasured ones.
+   */
+  bool             bench = false;
+  uint64_t         warmupFrames = 100;
+  double           benchDuration = 0.0;
+  std::string      benchJson;
+  std::string      benchCsv;
+
+  /* Load the model from (and save it to) a binary cache next to it */
+  bool             meshCache = true;
+
+  /* Load the pipeline cache from (and save it to) a file */
+  bool             pipelineCache = true;
+
+  /* Import the model with the streaming OBJ parser instead of tinyobjloader */
+  bool             streamImport = false;
+
+  /* Reorder the imported triangles and vertices for the GPU caches */
+  bool             meshOpt = true;
+
+  /* Worker threads for CPU work like model import, 0 means one per core */
+  unsigned         threads = 0;
 
-struct Vertex {
-  glm::vec3 pos;
-  glm::vec3 color;
-  glm::vec2 texCoord;
-  bool operator==(const Vertex& other) const {
-    return pos == other.pos && color == other.color && texCoord == other.texCoord;
-  }
+  /* Swapchain present mode, with a fallback if the surface lacks it */
+  VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  /* Swapchain images, 0 means the minimum the surface needs (at least 2) */
+  uint32_t         swapchainImages = 0;
+  /* Frames the CPU can prepare while the GPU renders older ones */
+  uint32_t         framesInFlight = 2;
+  /* Copies of the model drawn, each one with its own model matrix */
+  uint32_t         objects = 1;
+  /* Draw all the objects with one instanced draw per mesh chunk, instead
+   * of one draw per chunk of each object.
+   */
+  bool             instanced = false;
+  /* Cull the objects in a compute pass that writes indirect draws */
+  bool             gpuCull = false;
+  /* Cull the objects on the CPU and only record the draws of visible ones */
+  bool             cpuCull = false;
+  /* Split the model in meshlets and only record the draws of the ones
+   * facing the camera inside the frustum.
+   */
+  bool             meshlets = false;
+  /* Simplify the imported model into levels of detail and draw each object
+   * with the coarsest one whose error stays under lodError pixels.
+   */
+  bool             lods = false;
+  float            lodError = 1.0f;
+
+  /* Wait for the previous frame before sampling the input and updating the
+   * uniforms: lower input-to-present latency, less CPU/GPU overlap.
+   */
+  bool             lowLatency = false;
 };
 
-namespace std {
-    template<> struct hash<Vertex> {
-        size_t operator()(Vertex const& vertex) const {
-            return ((hash<glm::vec3>()(vertex.pos) ^
-                   (hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^
-                   (hash<glm::vec2>()(vertex.texCoord) << 1);
-        }
-    };
-}
+/* GPU time of a one-shot upload operation, measured with timestamp queries */
+struct GpuUploadTimer {
+  std::string      label;
+  uint32_t         query;
+  bool             resolved;
+  double           ms;
+};
 
-struct UniformBufferObject {
-  glm::mat4 model;
-  glm::mat4 view;
-  glm::mat4 proj;
+/* CPU time spent in each step of drawFrame() */
+enum FrameStage {
+  FRAME_STAGE_FENCE_WAIT = 0,
+  FRAME_STAGE_ACQUIRE,
+  /* Low latency mode: wait for the previous frame and sample the input */
+  FRAME_STAGE_PACING,
+  FRAME_STAGE_UBO_UPDATE,
+  /* CPU culling of the objects */
+  FRAME_STAGE_CULL,
+  FRAME_STAGE_RECORD,
+  FRAME_STAGE_SUBMIT,
+  FRAME_STAGE_PRESENT,
+  FRAME_STAGE_COUNT
 };
 
 class VulkanTest {
  public:
-  VulkanTest() {};
+  VulkanTest(const VulkanTestOptions &opts = VulkanTestOptions()) :
+    options(opts), threadPool(opts.threads) {};
   ~VulkanTest() {};
 
   void     init();
@@ -49,6 +136,10 @@ class VulkanTest {
 
   bool             framebufferResized = false;
 
+  /* Camera of the scene, shared with the culling benchmark */
+  static glm::mat4 viewMatrix();
+  static glm::mat4 projectionMatrix(VkExtent2D extent);
+
  private:
 
   /* Functions to prepare rendering */
@@ -57,21 +148,36 @@ class VulkanTest {
   void     createDevice();
   void     createSurface();
   void     getQueue();
-  void     createCommandBuffers();
+  void     createFrameCommands();
+  void     destroyFrameCommands();
   void     createCommandPool();
   void     createPipelineLayout();
   void     createSwapchain();
   void     recreateSwapchain();
+  void     retireSwapchain();
   void     destroySwapchain();
   void     createSwapchainImageViews();
+  void     createOffscreenImages();
+  void     saveOffscreenImage(const std::string &filename);
   void     createPipeline();
   void     createRenderPass();
   void     createFramebuffer();
   void     createSyncObjects();
   void     loadModel();
+  void     loadModelObj();
+  void     loadModelStreaming();
+  void     optimizeModel();
+  void     createMeshletBounds();
+  void     createLods();
+  void     printLods() const;
+  uint32_t lodTriangles(uint32_t level) const;
+  uint32_t selectLod(const glm::mat4 &model) const;
+  void     createUploadService();
   void     createVertexBuffer();
   void     createIndexBuffer();
   void     createUniformBuffer();
+  void     createInstanceBuffer();
+  void     decodeTexture();
   void     createTextureImage();
   void     createTextureImageView();
   void     createTextureSampler();
@@ -79,25 +185,49 @@ class VulkanTest {
   void     createDepthResources();
   void     createDescriptorPool();
   void     createDescriptorSet();
-  void     recordCommandBuffers();
-  void     updateUniformBuffer();
+  void     updateUniformDescriptor();
+  void     updateInstanceDescriptor();
+  uint32_t drawCount() const;
+  void     cullObjects();
+  void     recordDraws(VkCommandBuffer commandBuffer, const VkCommandBufferInheritanceInfo &inheritance,
+                       uint32_t first, uint32_t last);
+  VkCommandBuffer  recordFrame(uint32_t imageIndex);
+  void     updateUniformBuffer(BenchClock::time_point inputTime);
   void     drawFrame();
+  void     resolveInputLatency(unsigned frame, BenchClock::time_point signaled);
+  void     deferDestroy(std::function<void()> destroy);
+  void     runDeferredDestroys(unsigned frame);
+  void     flushDeferredDestroys();
+  void     runBenchmark();
+
+  /* GPU timestamps */
+  void     createUploadQueryPool();
+  void     createFrameQueryPool();
+  int      beginGpuUploadTimer(VkCommandBuffer commandBuffer, const std::string &label);
+  void     endGpuUploadTimer(VkCommandBuffer commandBuffer, int timer);
+  void     resolveUploadTimestamps();
+  void     resolveFrameTimestamps();
 
   /* Auxiliary functions */
-  uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
   void     setupDebugCallback();
   bool     checkValidationLayerSupport();
   void     createBuffer(VkDeviceSize bufferSize, unsigned bufferUsage, unsigned memoryProperties,
-                        VkBuffer &buffer, VkDeviceMemory &bufferMemory);
-  void     fillBuffer(VkDeviceMemory bufferMemory, VkDeviceSize size, const void *data);
+                        VkBuffer &buffer, MemoryAllocation &bufferMemory,
+                        AllocationStrategy strategy = ALLOCATION_FREE_LIST);
   VkShaderModule   createShaderModule(const std::vector<char>& code);
   VkCommandBuffer  beginCommandBuffer();
   void             endCommandBufferAndSubmit(VkCommandBuffer commandBuffer);
+  VkCommandBuffer  setupCommandBuffer();
+  void             submitSetupCommands(VkSemaphore signalSemaphore = VK_NULL_HANDLE);
+  void             flushSetupCommands();
   VkFormat findSupportedFormat(const std::vector<VkFormat>& candidates, VkImageTiling tiling, VkFormatFeatureFlags features);
   VkFormat findDepthFormat();
   bool     hasStencilComponent(VkFormat format);
 
   /* Class members */
+  VulkanTestOptions options;
+  ThreadPool       threadPool;
+
   GLFWwindow       *window;
   VkSurfaceKHR     surface;
 
@@ -108,56 +238,185 @@ class VulkanTest {
 
   VkPhysicalDevice phyDevice;
   VkDevice         device;
+  DeviceAllocator  allocator;
+  UploadService    uploader;
   VkSampleCountFlagBits msaaSamples;
 
   int              queueGraphicsFamilyIndex;
   int              queuePresentationFamilyIndex;
+  /* Transfer-only family if the device has one, graphics family otherwise */
+  int              queueTransferFamilyIndex;
   VkQueue          graphicsQueue;
   VkQueue          presentQueue;
+  VkQueue          transferQueue;
 
   VkCommandPool                 cmdPool;
-  std::vector<VkCommandBuffer>  commandBuffers;
+  /* Command buffers recorded every frame, see createFrameCommands() */
+  struct FrameCommands {
+    VkCommandPool                primaryPool;
+    VkCommandBuffer              primary;
+    std::vector<VkCommandPool>   pools;
+    std::vector<VkCommandBuffer> secondaries;
+  };
+  std::vector<FrameCommands>    frameCommands;
+  /* Setup batch: layout transitions and mipmap generation recorded by
+   * several functions, submitted together and waited for once.
+   */
+  VkCommandBuffer               setupCommands = VK_NULL_HANDLE;
+  std::vector<VkCommandBuffer>  setupSubmitted;
+  VkFence                       setupFence;
+  VkSemaphore                   setupSemaphore;
 
   VkDescriptorSetLayout setLayout;
   VkPipelineLayout      pipelineLayout;
   VkPipeline            graphicsPipeline;
+  PipelineCache         pipelineCache;
+  GpuCulling            gpuCulling;
+  /* CPU culling: world space bounding spheres of the objects, updated with
+   * the model matrices, and the objects visible in the current frame.
+   */
+  SphereCuller          objectBounds;
+  Frustum               frustum;
+  std::vector<uint32_t> visibleObjects;
+  uint64_t              culledFrames = 0;
+  uint64_t              culledVisible = 0;
+  /* Cluster culling of the meshlets of each object and LOD selection, done
+   * on the CPU with their model matrices. When any of them is on, drawList
+   * is set and visibleDraws has the draw list indices (object * chunks +
+   * chunk, all levels included) of the chunks left, collected per job in
+   * clusterDraws. objectLods has the level selected for each object.
+   */
+  bool                  clusterCull = false;
+  bool                  lodSelect = false;
+  bool                  drawList = false;
+  std::vector<MeshletBounds> meshletBounds;
+  std::vector<glm::mat4> objectModels;
+  glm::vec3             cameraPosition;
+  /* Pixels covered by a unit at unit distance along the view axis */
+  float                 lodScale = 1.0f;
+  std::vector<std::vector<uint32_t>> clusterDraws;
+  std::vector<uint32_t> visibleDraws;
+  std::vector<uint32_t> objectLods;
+  uint64_t              drawListFrames = 0;
+  uint64_t              drawListTriangles = 0;
+  uint64_t              drawListChunks = 0;
+  std::vector<uint64_t> lodObjects;
+  /* Indirect draw features used by GPU culling. maxDrawIndirectCount is
+   * the most draws of an indirect draw call, 1 without multiDrawIndirect.
+   */
+  uint32_t              maxDrawIndirectCount = 1;
+  PFN_vkCmdDrawIndexedIndirectCountKHR drawIndirectCount = nullptr;
+  /* VK_EXT_pipeline_creation_feedback: the driver reports cache hits */
+  bool                  creationFeedbackSupported = false;
   VkRenderPass          renderPass;
 
-  VkSwapchainKHR        swapChain;
+  VkSwapchainKHR        swapChain = VK_NULL_HANDLE;
   VkFormat              swapChainImageFormat;
+  VkPresentModeKHR      swapChainPresentMode;
   VkExtent2D            swapChainExtent;
   std::vector<VkImage> swapChainImages;
   std::vector<VkImageView> swapChainImageViews;
   std::vector<VkFramebuffer> swapChainFramebuffers;
+  /* Headless mode: memory backing the offscreen images in swapChainImages */
+  std::vector<MemoryAllocation> offscreenImageMemory;
 
   std::vector<VkSemaphore>      imageAvailableSemaphore;
   std::vector<VkSemaphore>      renderFinishedSemaphore;
   std::vector<VkFence> inFlightFences;
   size_t           currentFrame = 0;
+  /* Objects retired while in use, per frame in flight: destroyed once its
+   * fence signals. lastSubmittedFrame is -1 when nothing is in flight.
+   */
+  std::vector<std::vector<std::function<void()>>> deferredDestroys;
+  int              lastSubmittedFrame = -1;
+  /* Objects retired while the setup batch is open, which may reference
+   * them: they wait for the submission that runs the batch.
+   */
+  std::vector<std::function<void()>> setupDestroys;
+
+  /* Timings of the last drawFrame() call, only valid if it rendered a frame */
+  bool             frameTimingValid = false;
+  double           frameTotalMs;
+  double           frameStageMs[FRAME_STAGE_COUNT];
+  BenchStats       benchStats;
+
+  /* Input sample time of each frame in flight, until its fence is seen
+   * signaled. inputLatencies has the ones resolved by the last drawFrame().
+   */
+  std::vector<BenchClock::time_point> frameInputTime;
+  std::vector<bool> frameLatencyPending;
+  std::vector<double> inputLatencies;
+  double           latencyLogSumMs = 0.0;
+  unsigned         latencyLogFrames = 0;
+  BenchClock::time_point latencyLogTime;
+
+  /* GPU timestamps: frameQueryPool has a begin/end pair around the render
+   * pass of the command buffer of each frame in flight. frameQueryPending
+   * tracks the frames submitted with them, so that their results are read
+   * once the frame fence has signaled, without waiting.
+   */
+  bool             timestampsSupported = false;
+  bool             transferTimestampsSupported = false;
+  float            timestampPeriod;
+  uint64_t         timestampMask;
+  VkQueryPool      frameQueryPool = VK_NULL_HANDLE;
+  std::vector<bool> frameQueryPending;
+  bool             gpuFrameTimeValid = false;
+  double           gpuFrameTimeMs;
+  double           gpuLogSumMs = 0.0;
+  unsigned         gpuLogFrames = 0;
+  BenchClock::time_point gpuLogTime;
+  VkQueryPool      uploadQueryPool = VK_NULL_HANDLE;
+  uint32_t         uploadQueryCount = 0;
+  std::vector<GpuUploadTimer> uploadTimers;
 
+  /* Imported model. vertices/indices are only used while importing; the
+   * result is packed and vertexData/indexData point either to packedMesh or
+   * to the mapped mesh cache, until the buffers are uploaded.
+   */
   std::vector<Vertex> vertices;
   std::vector<uint32_t> indices;
+  PackedMesh       packedMesh;
+  MeshCache        meshCache;
+  const PackedVertex *vertexData;
+  const uint16_t  *indexData;
+  uint32_t         vertexCount;
+  uint32_t         indexCount;
+  std::vector<MeshChunk> meshChunks;
+  std::vector<MeshLod> meshLods;
+  glm::vec3        meshPosScale;
+  glm::vec3        meshPosOffset;
   VkBuffer         vertexBuffer;
-  VkDeviceMemory   vertexBufferMemory;
+  MemoryAllocation vertexBufferMemory;
   VkBuffer         indexBuffer;
-  VkDeviceMemory   indexBufferMemory;
-  VkBuffer         uniformBuffer;
-  VkDeviceMemory   uniformBufferMemory;
+  MemoryAllocation indexBufferMemory;
+  /* One uniform slice per frame in flight, bound with the dynamic offset
+   * of the slice when the frame is recorded.
+   */
+  FrameRing        uniformRing;
+  /* Model matrices of all the objects, a slice per frame in flight too,
+   * read by the vertex shader with the instance index.
+   */
+  FrameRing        instanceRing;
 
   VkDescriptorPool descriptorPool;
   VkDescriptorSet  descriptorSet;
 
+  /* Decoded RGBA texels, released once copied to the upload ring */
+  unsigned char    *texturePixels = nullptr;
+  int              textureWidth;
+  int              textureHeight;
   uint32_t         mipLevels;
   VkImage          textureImage;
-  VkDeviceMemory   textureImageMemory;
+  MemoryAllocation textureImageMemory;
   VkImageView      textureImageView;
   VkSampler        textureSampler;
 
   VkImage          depthImage;
-  VkDeviceMemory   depthImageMemory;
+  MemoryAllocation depthImageMemory;
   VkImageView      depthImageView;
 
   VkImage          colorImage;
-  VkDeviceMemory   colorImageMemory;
+  MemoryAllocation colorImageMemory;
   VkImageView      colorImageView;
 };
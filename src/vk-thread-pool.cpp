@@ -0,0 +1,88 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+#include "vk-thread-pool.h"
+
+ThreadPool::ThreadPool(unsigned threads)
+{
+  if (threads == 0)
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  for (unsigned i = 0; i < threads; i++)
+    workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wakeup.notify_all();
+
+  for (auto &worker : workers)
+    worker.join();
+}
+
+void ThreadPool::workerLoop()
+{
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wakeup.wait(lock, [this]() { return stopping || !tasks.empty(); });
+      if (stopping && tasks.empty())
+        return;
+      task = std::move(tasks.front());
+      tasks.pop();
+    }
+    task();
+  }
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)> &task)
+{
+  if (count == 0)
+    return;
+
+  if (count == 1) {
+    task(0);
+    return;
+  }
+
+  std::atomic<size_t> next(0);
+  auto worker = [&next, count, &task]() {
+    for (size_t i = next++; i < count; i = next++)
+      task(i);
+  };
+
+  /* The calling thread is one of the helpers */
+  size_t helpers = std::min((size_t) size(), count - 1);
+  std::vector<std::future<void>> pending;
+  for (size_t i = 0; i < helpers; i++)
+    pending.push_back(submit(worker));
+
+  /* Helpers reference locals of this frame, so wait for all of them even if
+   * some task throws, then propagate the first exception.
+   */
+  std::exception_ptr error;
+  try {
+    worker();
+  } catch (...) {
+    error = std::current_exception();
+    next = count;
+  }
+
+  for (auto &result : pending) {
+    try {
+      result.get();
+    } catch (...) {
+      if (!error)
+        error = std::current_exception();
+    }
+  }
+
+  if (error)
+    std::rethrow_exception(error);
+}
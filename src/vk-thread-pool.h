@@ -0,0 +1,50 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/* Fixed set of worker threads consuming a FIFO of tasks. Tasks must not
+ * wait for other tasks of the same pool, parallelFor() included.
+ */
+class ThreadPool {
+ public:
+  /* threads == 0 uses one thread per hardware thread */
+  explicit ThreadPool(unsigned threads = 0);
+  ~ThreadPool();
+
+  unsigned         size() const { return (unsigned) workers.size(); }
+
+  template<typename F>
+  auto submit(F task) -> std::future<decltype(task())>
+  {
+    typedef decltype(task()) Result;
+    auto packaged = std::make_shared<std::packaged_task<Result()>>(task);
+    std::future<Result> result = packaged->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push([packaged]() { (*packaged)(); });
+    }
+    wakeup.notify_one();
+    return result;
+  }
+
+  /* Runs task(i) for every i in [0, count) and returns when all of them are
+   * done. Items are handed out dynamically, the calling thread helps too.
+   */
+  void             parallelFor(size_t count, const std::function<void(size_t)> &task);
+
+ private:
+  void             workerLoop();
+
+  std::vector<std::thread>          workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex                        mutex;
+  std::condition_variable           wakeup;
+  bool                              stopping = false;
+};
@@ -0,0 +1,582 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include "vk-upload.h"
+
+/* Staging memory used for uploads, and number of segments it is split in */
+static const VkDeviceSize UPLOAD_RING_SIZE = 16ull << 20;
+static const unsigned UPLOAD_RING_SEGMENTS = 2;
+/* Buffer offset of image copies, a multiple of any texel size */
+static const VkDeviceSize UPLOAD_IMAGE_ALIGNMENT = 16;
+
+/* Access and stages of the first use of a buffer, from its usage */
+static void bufferFirstUse(VkBufferUsageFlags usage, VkAccessFlags &access, VkPipelineStageFlags &stage)
+{
+  access = 0;
+  stage = 0;
+  if (usage & VK_BUFFER_USAGE_VERTEX_BUFFER_BIT) {
+    access |= VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+    stage |= VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+  }
+  if (usage & VK_BUFFER_USAGE_INDEX_BUFFER_BIT) {
+    access |= VK_ACCESS_INDEX_READ_BIT;
+    stage |= VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+  }
+  if (usage & VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT) {
+    access |= VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    stage |= VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+  }
+  if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) {
+    access |= VK_ACCESS_UNIFORM_READ_BIT;
+    stage |= VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  }
+  if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) {
+    access |= VK_ACCESS_SHADER_READ_BIT;
+    stage |= VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  }
+  if (!stage)
+    stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+}
+
+void UploadService::init(VkPhysicalDevice phyDevice, VkDevice dev, DeviceAllocator &deviceAllocator,
+                         VkQueue graphics, uint32_t graphicsFamilyIndex,
+                         VkQueue transfer, uint32_t transferFamilyIndex)
+{
+  VkResult res = VK_SUCCESS;
+  device = dev;
+  allocator = &deviceAllocator;
+  graphicsQueue = graphics;
+  graphicsFamily = graphicsFamilyIndex;
+  transferQueue = transfer;
+  transferFamily = transferFamilyIndex;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(phyDevice, &properties);
+  VkPhysicalDeviceMemoryProperties memProperties;
+  vkGetPhysicalDeviceMemoryProperties(phyDevice, &memProperties);
+
+  uint32_t familyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(phyDevice, &familyCount, VK_NULL_HANDLE);
+  std::vector<VkQueueFamilyProperties> families(familyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(phyDevice, &familyCount, families.data());
+  transferGranularity = families[transferFamily].minImageTransferGranularity;
+
+  /* Discrete GPUs may expose a small host-visible window of their memory
+   * too, but writing through it is not worth it for bulk data.
+   */
+  VkMemoryPropertyFlags directFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  unified = false;
+  if (properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU ||
+      properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU) {
+    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+      if ((memProperties.memoryTypes[i].propertyFlags & directFlags) == directFlags)
+        unified = true;
+    }
+  }
+
+  /* Optimal tiling images can't be written by the CPU, they always need the ring */
+  printf("Upload path: %s, %s queue\n",
+         unified ? "direct buffer writes (unified memory)" : "staging ring",
+         dedicatedQueue() ? "dedicated transfer" : "graphics");
+
+  VkCommandPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.queueFamilyIndex = transferFamily;
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+  res = vkCreateCommandPool(device, &poolInfo, VK_NULL_HANDLE, &cmdPool);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error creating upload command pool");
+
+  if (dedicatedQueue()) {
+    poolInfo.queueFamilyIndex = graphicsFamily;
+    res = vkCreateCommandPool(device, &poolInfo, VK_NULL_HANDLE, &acquireCmdPool);
+    if (res != VK_SUCCESS)
+      throw std::runtime_error("Error creating upload acquire command pool");
+  }
+
+  VkBufferCreateInfo bufferInfo = {};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = UPLOAD_RING_SIZE;
+  bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  allocator->createBuffer(bufferInfo,
+                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                          ringBuffer, ringMemory);
+
+  segmentSize = UPLOAD_RING_SIZE / UPLOAD_RING_SEGMENTS;
+  segments.resize(UPLOAD_RING_SEGMENTS);
+
+  VkCommandBufferAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandBufferCount = 1;
+
+  VkFenceCreateInfo fenceInfo = {};
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  VkSemaphoreCreateInfo semaphoreInfo = {};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+  for (Segment &segment : segments) {
+    segment = Segment();
+    allocInfo.commandPool = cmdPool;
+    res = vkAllocateCommandBuffers(device, &allocInfo, &segment.commandBuffer);
+    if (res != VK_SUCCESS)
+      throw std::runtime_error("Error allocating upload command buffer");
+
+    res = vkCreateFence(device, &fenceInfo, VK_NULL_HANDLE, &segment.fence);
+    if (res != VK_SUCCESS)
+      throw std::runtime_error("Error creating upload fence");
+
+    if (!dedicatedQueue())
+      continue;
+
+    allocInfo.commandPool = acquireCmdPool;
+    res = vkAllocateCommandBuffers(device, &allocInfo, &segment.acquireCommandBuffer);
+    if (res != VK_SUCCESS)
+      throw std::runtime_error("Error allocating upload acquire command buffer");
+
+    res = vkCreateSemaphore(device, &semaphoreInfo, VK_NULL_HANDLE, &segment.semaphore);
+    if (res != VK_SUCCESS)
+      throw std::runtime_error("Error creating upload semaphore");
+  }
+
+  printf("Created upload staging ring of %.1f MB in %u segments\n",
+         UPLOAD_RING_SIZE / (1024.0 * 1024.0), UPLOAD_RING_SEGMENTS);
+}
+
+void UploadService::destroy()
+{
+  for (Segment &segment : segments) {
+    waitSegment(segment);
+    vkDestroyFence(device, segment.fence, VK_NULL_HANDLE);
+    if (segment.semaphore != VK_NULL_HANDLE)
+      vkDestroySemaphore(device, segment.semaphore, VK_NULL_HANDLE);
+  }
+  segments.clear();
+
+  if (cmdPool != VK_NULL_HANDLE)
+    vkDestroyCommandPool(device, cmdPool, VK_NULL_HANDLE);
+  cmdPool = VK_NULL_HANDLE;
+  if (acquireCmdPool != VK_NULL_HANDLE)
+    vkDestroyCommandPool(device, acquireCmdPool, VK_NULL_HANDLE);
+  acquireCmdPool = VK_NULL_HANDLE;
+
+  if (ringBuffer != VK_NULL_HANDLE) {
+    vkDestroyBuffer(device, ringBuffer, VK_NULL_HANDLE);
+    allocator->free(ringMemory);
+  }
+  ringBuffer = VK_NULL_HANDLE;
+}
+
+void UploadService::setGpuTimer(std::function<int(VkCommandBuffer, const std::string &)> begin,
+                                std::function<void(VkCommandBuffer, int)> end)
+{
+  beginTimer = begin;
+  endTimer = end;
+}
+
+void UploadService::beginSegment(Segment &segment)
+{
+  /* Reusing the segment memory needs its previous copies to be done */
+  waitSegment(segment);
+
+  vkResetFences(device, 1, &segment.fence);
+  vkResetCommandBuffer(segment.commandBuffer, 0);
+
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(segment.commandBuffer, &beginInfo);
+
+  segment.used = 0;
+  segment.recording = true;
+  segment.releases.clear();
+}
+
+void UploadService::submitSegment(Segment &segment)
+{
+  if (!segment.recording)
+    return;
+
+  VkAccessFlags dstAccess = 0;
+  VkPipelineStageFlags dstStage = 0;
+  for (const Release &release : segment.releases) {
+    dstAccess |= release.access;
+    dstStage |= release.stage;
+  }
+
+  /* Resources split across segments are released once, after their last
+   * copy. The barrier also covers the copies of the earlier segments, they
+   * were submitted before on the same queue.
+   */
+  bool acquire = dedicatedQueue() && !segment.releases.empty();
+  std::vector<VkBufferMemoryBarrier> bufferBarriers;
+  std::vector<VkImageMemoryBarrier> imageBarriers;
+
+  if (acquire) {
+    for (const Release &release : segment.releases) {
+      if (release.buffer != VK_NULL_HANDLE) {
+        VkBufferMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        barrier.srcQueueFamilyIndex = transferFamily;
+        barrier.dstQueueFamilyIndex = graphicsFamily;
+        barrier.buffer = release.buffer;
+        barrier.offset = 0;
+        barrier.size = VK_WHOLE_SIZE;
+        bufferBarriers.push_back(barrier);
+      } else {
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = transferFamily;
+        barrier.dstQueueFamilyIndex = graphicsFamily;
+        barrier.image = release.image;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = release.mipLevels;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = 1;
+        imageBarriers.push_back(barrier);
+      }
+    }
+
+    /* Release: the destination scope is ignored, the acquire provides it */
+    vkCmdPipelineBarrier(segment.commandBuffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                         0,
+                         0, VK_NULL_HANDLE,
+                         (uint32_t) bufferBarriers.size(), bufferBarriers.data(),
+                         (uint32_t) imageBarriers.size(), imageBarriers.data());
+  } else if (!segment.releases.empty()) {
+    /* Same queue: make the copies visible to the first use of the resources */
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = dstAccess;
+
+    vkCmdPipelineBarrier(segment.commandBuffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage,
+                         0,
+                         1, &barrier,
+                         0, VK_NULL_HANDLE,
+                         0, VK_NULL_HANDLE);
+  }
+
+  vkEndCommandBuffer(segment.commandBuffer);
+
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.waitSemaphoreCount = (uint32_t) waitSemaphores.size();
+  submitInfo.pWaitSemaphores = waitSemaphores.data();
+  submitInfo.pWaitDstStageMask = waitStages.data();
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &segment.commandBuffer;
+  submitInfo.signalSemaphoreCount = acquire ? 1 : 0;
+  submitInfo.pSignalSemaphores = &segment.semaphore;
+
+  /* With an acquire the fence goes to it, it signals after the copies */
+  VkResult res = vkQueueSubmit(transferQueue, 1, &submitInfo, acquire ? VK_NULL_HANDLE : segment.fence);
+  if (res != VK_SUCCESS)
+    throw std::runtime_error("Error submitting uploads");
+  waitSemaphores.clear();
+  waitStages.clear();
+
+  if (acquire) {
+    VkCommandBuffer commandBuffer = segment.acquireCommandBuffer;
+    vkResetCommandBuffer(commandBuffer, 0);
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+    /* Acquire: same ownership transfer, with the scope of the first use */
+    unsigned buffers = 0, images = 0;
+    for (const Release &release : segment.releases) {
+      if (release.buffer != VK_NULL_HANDLE) {
+        bufferBarriers[buffers].srcAccessMask = 0;
+        bufferBarriers[buffers++].dstAccessMask = release.access;
+      } else {
+        imageBarriers[images].srcAccessMask = 0;
+        imageBarriers[images++].dstAccessMask = release.access;
+      }
+    }
+
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStage,
+                         0,
+                         0, VK_NULL_HANDLE,
+                         (uint32_t) bufferBarriers.size(), bufferBarriers.data(),
+                         (uint32_t) imageBarriers.size(), imageBarriers.data());
+    vkEndCommandBuffer(commandBuffer);
+
+    VkSubmitInfo acquireInfo = {};
+    acquireInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    acquireInfo.waitSemaphoreCount = 1;
+    acquireInfo.pWaitSemaphores = &segment.semaphore;
+    acquireInfo.pWaitDstStageMask = &dstStage;
+    acquireInfo.commandBufferCount = 1;
+    acquireInfo.pCommandBuffers = &commandBuffer;
+
+    res = vkQueueSubmit(graphicsQueue, 1, &acquireInfo, segment.fence);
+    if (res != VK_SUCCESS)
+      throw std::runtime_error("Error submitting upload acquire");
+  }
+
+  segment.recording = false;
+  segment.pending = true;
+  submits++;
+}
+
+void UploadService::waitSegment(Segment &segment)
+{
+  if (!segment.pending)
+    return;
+
+  vkWaitForFences(device, 1, &segment.fence, VK_TRUE, UINT64_MAX);
+  segment.pending = false;
+}
+
+void UploadService::nextSegment()
+{
+  submitSegment(segments[currentSegment]);
+  currentSegment = (currentSegment + 1) % segments.size();
+}
+
+void UploadService::startTiming()
+{
+  if (!uploading) {
+    uploadStart = BenchClock::now();
+    uploading = true;
+  }
+}
+
+void UploadService::createBuffer(const void *data, VkDeviceSize size, VkBufferUsageFlags usage,
+                                 VkBuffer &buffer, MemoryAllocation &allocation, const std::string &label)
+{
+  VkBufferCreateInfo bufferInfo = {};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = size;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  startTiming();
+
+  if (unified) {
+    bufferInfo.usage = usage;
+    allocator->createBuffer(bufferInfo,
+                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                            buffer, allocation);
+    memcpy(allocation.mapped, data, (size_t) size);
+    uploadedBytes += size;
+    return;
+  }
+
+  bufferInfo.usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  allocator->createBuffer(bufferInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, allocation);
+
+  const char *bytes = static_cast<const char *>(data);
+  VkDeviceSize offset = 0;
+  unsigned piece = 0;
+
+  while (offset < size) {
+    Segment &segment = segments[currentSegment];
+    if (!segment.recording)
+      beginSegment(segment);
+
+    /* Segment full: hand it to the GPU and continue in the next one */
+    if (segment.used == segmentSize) {
+      nextSegment();
+      continue;
+    }
+
+    VkDeviceSize count = std::min(segmentSize - segment.used, size - offset);
+    VkDeviceSize ringOffset = currentSegment * segmentSize + segment.used;
+    memcpy(static_cast<char *>(ringMemory.mapped) + ringOffset, bytes + offset, (size_t) count);
+
+    VkBufferCopy copyRegion = {};
+    copyRegion.srcOffset = ringOffset;
+    copyRegion.dstOffset = offset;
+    copyRegion.size = count;
+
+    std::string timerLabel = piece ? label + "_" + std::to_string(piece) : label;
+    int timer = beginTimer ? beginTimer(segment.commandBuffer, timerLabel) : -1;
+    vkCmdCopyBuffer(segment.commandBuffer, ringBuffer, buffer, 1, &copyRegion);
+    if (endTimer)
+      endTimer(segment.commandBuffer, timer);
+
+    segment.used += count;
+    offset += count;
+    piece++;
+  }
+
+  Release release = {};
+  release.buffer = buffer;
+  bufferFirstUse(usage, release.access, release.stage);
+  segments[currentSegment].releases.push_back(release);
+
+  uploadedBytes += size;
+}
+
+void UploadService::uploadImage(const void *data, VkImage image, uint32_t width, uint32_t height,
+                                uint32_t texelSize, uint32_t mipLevels, const std::string &label)
+{
+  VkDeviceSize rowPitch = (VkDeviceSize) width * texelSize;
+  /* Partial copies must be aligned to the transfer granularity of the
+   * queue, zero means that only whole levels can be copied.
+   */
+  uint32_t rowAlignment = transferGranularity.height ? transferGranularity.height : height;
+
+  startTiming();
+
+  const char *bytes = static_cast<const char *>(data);
+  uint32_t row = 0;
+  unsigned piece = 0;
+  bool transitioned = false;
+
+  while (row < height) {
+    Segment &segment = segments[currentSegment];
+    if (!segment.recording)
+      beginSegment(segment);
+
+    VkDeviceSize used = (segment.used + UPLOAD_IMAGE_ALIGNMENT - 1) & ~(UPLOAD_IMAGE_ALIGNMENT - 1);
+    uint32_t rows = 0;
+    if (used < segmentSize)
+      rows = (uint32_t) std::min<VkDeviceSize>((segmentSize - used) / rowPitch, height - row);
+    if (rows < height - row)
+      rows -= rows % rowAlignment;
+
+    if (rows == 0) {
+      if (segment.used == 0)
+        throw std::runtime_error("Image " + label + " doesn't fit in an upload segment");
+      nextSegment();
+      continue;
+    }
+
+    if (!transitioned) {
+      VkImageMemoryBarrier barrier = {};
+      barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+      barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.image = image;
+      barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      barrier.subresourceRange.baseMipLevel = 0;
+      barrier.subresourceRange.levelCount = mipLevels;
+      barrier.subresourceRange.baseArrayLayer = 0;
+      barrier.subresourceRange.layerCount = 1;
+      barrier.srcAccessMask = 0;
+      barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+      vkCmdPipelineBarrier(segment.commandBuffer,
+                           VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           0,
+                           0, VK_NULL_HANDLE,
+                           0, VK_NULL_HANDLE,
+                           1, &barrier);
+      transitioned = true;
+    }
+
+    VkDeviceSize ringOffset = currentSegment * segmentSize + used;
+    memcpy(static_cast<char *>(ringMemory.mapped) + ringOffset, bytes + row * rowPitch,
+           (size_t) (rows * rowPitch));
+
+    VkBufferImageCopy region = {};
+    region.bufferOffset = ringOffset;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, (int32_t) row, 0};
+    region.imageExtent = {width, rows, 1};
+
+    std::string timerLabel = piece ? label + "_" + std::to_string(piece) : label;
+    int timer = beginTimer ? beginTimer(segment.commandBuffer, timerLabel) : -1;
+    vkCmdCopyBufferToImage(segment.commandBuffer, ringBuffer, image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    if (endTimer)
+      endTimer(segment.commandBuffer, timer);
+
+    segment.used = used + rows * rowPitch;
+    row += rows;
+    piece++;
+  }
+
+  Release release = {};
+  release.image = image;
+  release.mipLevels = mipLevels;
+  release.access = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+  release.stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+  segments[currentSegment].releases.push_back(release);
+
+  uploadedBytes += rowPitch * height;
+}
+
+void UploadService::waitSemaphore(VkSemaphore semaphore, VkPipelineStageFlags stage)
+{
+  waitSemaphores.push_back(semaphore);
+  waitStages.push_back(stage);
+}
+
+void UploadService::submit()
+{
+  if (segments.empty())
+    return;
+
+  Segment &segment = segments[currentSegment];
+  if (!segment.recording)
+    return;
+
+  /* The next uploads start in the following segment */
+  nextSegment();
+}
+
+bool UploadService::retire()
+{
+  bool busy = false;
+  for (Segment &segment : segments) {
+    if (segment.pending && vkGetFenceStatus(device, segment.fence) == VK_SUCCESS)
+      segment.pending = false;
+    busy = busy || segment.pending || segment.recording;
+  }
+
+  if (!uploading || busy)
+    return false;
+
+  uploadMs += elapsedMs(uploadStart, BenchClock::now());
+  uploading = false;
+  return true;
+}
+
+void UploadService::flush()
+{
+  submit();
+  for (Segment &segment : segments)
+    waitSegment(segment);
+  retire();
+}
+
+void UploadService::printStats() const
+{
+  double mb = uploadedBytes / (1024.0 * 1024.0);
+  printf("Uploaded %.1f MB in %.2f ms (%.1f MB/s), %u submits, %s on the %s queue\n",
+         mb, uploadMs, uploadMs > 0.0 ? mb / (uploadMs / 1000.0) : 0.0, submits,
+         unified ? "direct" : "staged", dedicatedQueue() ? "transfer" : "graphics");
+}
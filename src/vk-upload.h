@@ -0,0 +1,129 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "vk-allocator.h"
+#include "vk-bench.h"
+
+/* Uploads data into device-local buffers and images. On unified memory
+ * devices (an integrated GPU with device-local host-visible memory) buffers
+ * are written directly. Otherwise data goes through a persistent staging
+ * ring split in segments: the CPU fills one segment while the GPU copies
+ * the previous one, and peak staging memory never exceeds the ring size.
+ *
+ * Copies run on a dedicated transfer queue when the device has one, so they
+ * overlap with rendering. Each segment then releases the resources it
+ * completed from the transfer queue family, and a small command buffer on
+ * the graphics queue acquires them after waiting on the segment semaphore.
+ * Graphics work submitted after submit() is ordered after the uploads
+ * without any CPU wait.
+ */
+class UploadService {
+ public:
+  void             init(VkPhysicalDevice phyDevice, VkDevice device, DeviceAllocator &allocator,
+                        VkQueue graphicsQueue, uint32_t graphicsFamilyIndex,
+                        VkQueue transferQueue, uint32_t transferFamilyIndex);
+  void             destroy();
+
+  bool             unifiedMemory() const { return unified; }
+  bool             dedicatedQueue() const { return graphicsFamily != transferFamily; }
+
+  /* Optional GPU timing of each recorded copy, see beginGpuUploadTimer() */
+  void             setGpuTimer(std::function<int(VkCommandBuffer, const std::string &)> begin,
+                               std::function<void(VkCommandBuffer, int)> end);
+
+  /* Creates a device-local buffer filled with data. The data can be
+   * released when this returns, but the GPU copy is only ordered before the
+   * graphics work submitted after submit().
+   */
+  void             createBuffer(const void *data, VkDeviceSize size, VkBufferUsageFlags usage,
+                                VkBuffer &buffer, MemoryAllocation &allocation, const std::string &label);
+  /* Fills the first level of a 2D color image created with
+   * VK_IMAGE_USAGE_TRANSFER_DST_BIT, width * height texels of texelSize
+   * bytes. All its levels are left in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+   * owned by the graphics queue family, ready for transfer commands of the
+   * graphics work submitted after submit().
+   */
+  void             uploadImage(const void *data, VkImage image, uint32_t width, uint32_t height,
+                               uint32_t texelSize, uint32_t mipLevels, const std::string &label);
+
+  /* Makes the next submitted copies wait on a semaphore signaled by other
+   * work, e.g. the reset of the queries written by the GPU timer.
+   */
+  void             waitSemaphore(VkSemaphore semaphore, VkPipelineStageFlags stage);
+
+  /* Submits the recorded copies without waiting for them */
+  void             submit();
+  /* Checks the submitted copies without waiting. Returns true when it finds
+   * that the last pending upload is done.
+   */
+  bool             retire();
+  /* Submits the pending copies and waits for all of them */
+  void             flush();
+
+  void             printStats() const;
+
+ private:
+  /* A resource whose last copy is in a segment, with the access of its
+   * first use on the graphics queue.
+   */
+  struct Release {
+    VkBuffer             buffer;
+    VkImage              image;
+    uint32_t             mipLevels;
+    VkAccessFlags        access;
+    VkPipelineStageFlags stage;
+  };
+
+  struct Segment {
+    VkCommandBuffer commandBuffer;
+    /* Dedicated transfer queue only: ownership acquire on the graphics queue */
+    VkCommandBuffer acquireCommandBuffer;
+    VkSemaphore    semaphore;
+    VkFence        fence;
+    VkDeviceSize   used;
+    bool           recording;
+    bool           pending;
+    std::vector<Release> releases;
+  };
+
+  void             beginSegment(Segment &segment);
+  void             submitSegment(Segment &segment);
+  void             waitSegment(Segment &segment);
+  void             nextSegment();
+  void             startTiming();
+
+  VkDevice         device = VK_NULL_HANDLE;
+  VkQueue          graphicsQueue = VK_NULL_HANDLE;
+  VkQueue          transferQueue = VK_NULL_HANDLE;
+  uint32_t         graphicsFamily = 0;
+  uint32_t         transferFamily = 0;
+  VkExtent3D       transferGranularity;
+  DeviceAllocator *allocator = nullptr;
+  bool             unified = false;
+
+  VkCommandPool    cmdPool = VK_NULL_HANDLE;
+  VkCommandPool    acquireCmdPool = VK_NULL_HANDLE;
+  VkBuffer         ringBuffer = VK_NULL_HANDLE;
+  MemoryAllocation ringMemory;
+  VkDeviceSize     segmentSize = 0;
+  std::vector<Segment> segments;
+  unsigned         currentSegment = 0;
+  std::vector<VkSemaphore> waitSemaphores;
+  std::vector<VkPipelineStageFlags> waitStages;
+
+  std::function<int(VkCommandBuffer, const std::string &)> beginTimer;
+  std::function<void(VkCommandBuffer, int)> endTimer;
+
+  /* Throughput: bytes uploaded and time from the first write until the
+   * last copy is seen done, over all the batches.
+   */
+  uint64_t         uploadedBytes = 0;
+  uint32_t         submits = 0;
+  double           uploadMs = 0.0;
+  bool             uploading = false;
+  BenchClock::time_point uploadStart;
+};
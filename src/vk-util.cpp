@@ -1,6 +1,14 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
 #include <fstream>
+#include <stdexcept>
 #include <vector>
 
+#include "vk-util.h"
+
 std::vector<char> readFile(const std::string& filename)
 {
   std::ifstream file(filename, std::ios::ate | std::ios::binary);
@@ -19,3 +27,72 @@ std::vector<char> readFile(const std::string& filename)
 
   return buffer;
 }
+
+bool writeAll(int fd, const void *data, size_t size)
+{
+  const char *bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool writeFileAtomic(const std::string &filename, const void *data, size_t size)
+{
+  std::string tmpFile = filename + ".tmp." + std::to_string(getpid());
+  int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+
+  bool ok = writeAll(fd, data, size) && fsync(fd) == 0;
+
+  if (close(fd) != 0)
+    ok = false;
+
+  if (!ok || rename(tmpFile.c_str(), filename.c_str()) != 0) {
+    unlink(tmpFile.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed)
+{
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  uint64_t hash = mix64(seed ^ (size * 0x9e3779b97f4a7c15ull));
+
+  /* Consume 8 bytes per step, the tail is zero padded */
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, bytes, 8);
+    hash = (hash ^ mix64(word)) * 0x9e3779b97f4a7c15ull;
+    bytes += 8;
+    size -= 8;
+  }
+
+  if (size > 0) {
+    uint64_t word = 0;
+    memcpy(&word, bytes, size);
+    hash = (hash ^ mix64(word)) * 0x9e3779b97f4a7c15ull;
+  }
+
+  return mix64(hash);
+}
+
+size_t peakRss()
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+
+  /* Linux reports it in kilobytes */
+  return (size_t) usage.ru_maxrss * 1024;
+}
@@ -1,4 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
 #include <vector>
 
 std::vector<char> readFile(const std::string& filename);
+
+/* Writes all of data to a file descriptor, retrying partial writes */
+bool writeAll(int fd, const void *data, size_t size);
+
+/* Replaces filename with data. Readers never see a partially written file:
+ * it is written next to it and renamed over the old one.
+ */
+bool writeFileAtomic(const std::string &filename, const void *data, size_t size);
+
+/* Final mixing step of splitmix64, every input bit affects every output bit */
+static inline uint64_t mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+/* Fast non-cryptographic 64-bit hash of a memory block */
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0);
+
+/* Peak resident set size of the process, in bytes */
+size_t peakRss();
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <algorithm>
+#include <unordered_map>
+
+#include "vk-vertex-dedup.h"
+#include "vk-bench.h"
+
+static const uint32_t EMPTY_SLOT = UINT32_MAX;
+
+/* Keep the load factor at or below 1/2 so that probe sequences stay short */
+static size_t tableCapacity(size_t vertices)
+{
+  size_t capacity = 16;
+  while (capacity < vertices * 2)
+    capacity *= 2;
+  return capacity;
+}
+
+VertexDedupTable::VertexDedupTable(size_t expectedVertices)
+{
+  Slot empty = { 0, EMPTY_SLOT };
+  slots.assign(tableCapacity(expectedVertices), empty);
+  mask = slots.size() - 1;
+}
+
+uint32_t VertexDedupTable::insert(const Vertex &vertex, std::vector<Vertex> &vertices)
+{
+  uint64_t hash = hashVertex(vertex);
+  uint32_t tag = (uint32_t) (hash >> 32);
+  size_t pos = (size_t) hash & mask;
+
+  while (true) {
+    Slot &slot = slots[pos];
+
+    if (slot.index == EMPTY_SLOT) {
+      slot.tag = tag;
+      slot.index = static_cast<uint32_t>(vertices.size());
+      vertices.push_back(vertex);
+
+      uint32_t index = slot.index;
+      if (++count * 2 > slots.size())
+        grow(vertices);
+      return index;
+    }
+
+    if (slot.tag == tag && vertices[slot.index] == vertex)
+      return slot.index;
+
+    pos = (pos + 1) & mask;
+  }
+}
+
+void VertexDedupTable::grow(const std::vector<Vertex> &vertices)
+{
+  std::vector<Slot> old;
+  old.swap(slots);
+
+  Slot empty = { 0, EMPTY_SLOT };
+  slots.assign(old.size() * 2, empty);
+  mask = slots.size() - 1;
+
+  for (const Slot &slot : old) {
+    if (slot.index == EMPTY_SLOT)
+      continue;
+
+    size_t pos = (size_t) hashVertex(vertices[slot.index]) & mask;
+    while (slots[pos].index != EMPTY_SLOT)
+      pos = (pos + 1) & mask;
+    slots[pos] = slot;
+  }
+}
+
+/* No valid key has all bits set: position indices are below UINT32_MAX */
+static const uint64_t EMPTY_KEY = UINT64_MAX;
+
+ObjIndexDedupTable::ObjIndexDedupTable(size_t expectedVertices)
+{
+  Slot empty = { EMPTY_KEY, 0 };
+  slots.assign(tableCapacity(expectedVertices), empty);
+  mask = slots.size() - 1;
+}
+
+uint32_t ObjIndexDedupTable::insert(uint32_t position, uint32_t texcoord, uint32_t newIndex, bool &inserted)
+{
+  uint64_t key = ((uint64_t) position << 32) | texcoord;
+  size_t pos = (size_t) mix64(key) & mask;
+
+  while (true) {
+    Slot &slot = slots[pos];
+
+    if (slot.key == key) {
+      inserted = false;
+      return slot.index;
+    }
+
+    if (slot.key == EMPTY_KEY) {
+      slot.key = key;
+      slot.index = newIndex;
+      inserted = true;
+      if (++count * 2 > slots.size())
+        grow();
+      return newIndex;
+    }
+
+    pos = (pos + 1) & mask;
+  }
+}
+
+void ObjIndexDedupTable::grow()
+{
+  std::vector<Slot> old;
+  old.swap(slots);
+
+  Slot empty = { EMPTY_KEY, 0 };
+  slots.assign(old.size() * 2, empty);
+  mask = slots.size() - 1;
+
+  for (const Slot &slot : old) {
+    if (slot.key == EMPTY_KEY)
+      continue;
+
+    size_t pos = (size_t) mix64(slot.key) & mask;
+    while (slots[pos].key != EMPTY_KEY)
+      pos = (pos + 1) & mask;
+    slots[pos] = slot;
+  }
+}
+
+/* Hash used by the loader before VertexDedupTable, kept as a reference */
+struct LegacyVertexHash {
+  size_t operator()(Vertex const& vertex) const {
+    return ((std::hash<glm::vec3>()(vertex.pos) ^
+             (std::hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^
+      (std::hash<glm::vec2>()(vertex.texCoord) << 1);
+  }
+};
+
+/* Former loader loop: count() followed by two operator[] lookups */
+template<typename Map>
+static void dedupWithMap(const std::vector<Vertex> &corners,
+                         std::vector<Vertex> &vertices, std::vector<uint32_t> &indices)
+{
+  Map uniqueVertices;
+
+  for (const Vertex &vertex : corners) {
+    if (uniqueVertices.count(vertex) == 0) {
+      uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
+      vertices.push_back(vertex);
+    }
+    indices.push_back(uniqueVertices[vertex]);
+  }
+}
+
+static void dedupWithTable(const std::vector<Vertex> &corners, size_t expectedVertices,
+                           std::vector<Vertex> &vertices, std::vector<uint32_t> &indices)
+{
+  VertexDedupTable uniqueVertices(expectedVertices);
+
+  for (const Vertex &vertex : corners)
+    indices.push_back(uniqueVertices.insert(vertex, vertices));
+}
+
+static void reportDedup(const char *name, double ms, size_t corners,
+                        const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                        const std::vector<uint32_t> &reference)
+{
+  printf("%-36s %10.2f ms %8.2f Mcorners/s %9zu vertices%s\n", name, ms,
+         corners / (ms * 1000.0), vertices.size(),
+         indices == reference ? "" : " (MISMATCH)");
+}
+
+void benchVertexDedup(unsigned gridSize)
+{
+  /* Grid of gridSize x gridSize quads, two triangles each, emitted corner by
+   * corner like the OBJ loader does. Every inner vertex is shared by six
+   * triangles, which is close to what scanned models look like.
+   */
+  std::vector<Vertex> corners;
+  corners.reserve((size_t) gridSize * gridSize * 6);
+
+  auto gridVertex = [gridSize](unsigned x, unsigned y) {
+    Vertex vertex = {};
+    vertex.pos = {x / (float) gridSize, y / (float) gridSize, 0.0f};
+    vertex.color = {1.0f, 1.0f, 1.0f};
+    vertex.texCoord = {x / (float) gridSize, 1.0f - y / (float) gridSize};
+    return vertex;
+  };
+
+  for (unsigned y = 0; y < gridSize; y++) {
+    for (unsigned x = 0; x < gridSize; x++) {
+      corners.push_back(gridVertex(x, y));
+      corners.push_back(gridVertex(x + 1, y));
+      corners.push_back(gridVertex(x + 1, y + 1));
+      corners.push_back(gridVertex(x, y));
+      corners.push_back(gridVertex(x + 1, y + 1));
+      corners.push_back(gridVertex(x, y + 1));
+    }
+  }
+
+  size_t uniqueVertices = (size_t) (gridSize + 1) * (gridSize + 1);
+  printf("Vertex deduplication: %zu corners, %zu unique vertices\n", corners.size(), uniqueVertices);
+
+  std::vector<uint32_t> reference;
+
+  {
+    std::vector<Vertex> vertices;
+    BenchClock::time_point start = BenchClock::now();
+    dedupWithMap<std::unordered_map<Vertex, uint32_t, LegacyVertexHash>>(corners, vertices, reference);
+    reportDedup("unordered_map, XOR/shift hash", elapsedMs(start, BenchClock::now()),
+                corners.size(), vertices, reference, reference);
+  }
+
+  {
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    BenchClock::time_point start = BenchClock::now();
+    dedupWithMap<std::unordered_map<Vertex, uint32_t>>(corners, vertices, indices);
+    reportDedup("unordered_map, hashVertex()", elapsedMs(start, BenchClock::now()),
+                corners.size(), vertices, indices, reference);
+  }
+
+  {
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    BenchClock::time_point start = BenchClock::now();
+    dedupWithTable(corners, uniqueVertices, vertices, indices);
+    reportDedup("VertexDedupTable, pre-sized", elapsedMs(start, BenchClock::now()),
+                corners.size(), vertices, indices, reference);
+  }
+
+  {
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    BenchClock::time_point start = BenchClock::now();
+    dedupWithTable(corners, 16, vertices, indices);
+    reportDedup("VertexDedupTable, growing from 16", elapsedMs(start, BenchClock::now()),
+                corners.size(), vertices, indices, reference);
+  }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "vk-mesh.h"
+
+/* Flat open-addressing table (linear probing, power of two capacity) that
+ * maps vertices to their index in the deduplicated vertex array. Each slot
+ * keeps the upper hash bits next to the index, so most probes are resolved
+ * without touching the vertex array, and a lookup and an insertion share the
+ * same probe sequence.
+ */
+class VertexDedupTable {
+ public:
+  /* expectedVertices is the estimated number of unique vertices. The table
+   * grows if it is exceeded, but that should be rare.
+   */
+  explicit VertexDedupTable(size_t expectedVertices);
+
+  /* Returns the index of vertex in vertices, appending it if it is new */
+  uint32_t         insert(const Vertex &vertex, std::vector<Vertex> &vertices);
+
+  size_t           size() const { return count; }
+
+ private:
+  struct Slot {
+    uint32_t       tag;
+    uint32_t       index;
+  };
+
+  void             grow(const std::vector<Vertex> &vertices);
+
+  std::vector<Slot> slots;
+  size_t           mask;
+  size_t           count = 0;
+};
+
+/* Open-addressing table mapping the OBJ (position, texcoord) index pair of a
+ * corner to its vertex index. Unlike VertexDedupTable it doesn't need the
+ * vertex data to resolve collisions, so vertices can be streamed out as soon
+ * as they are found. Pairs referring to equal values are not merged.
+ */
+class ObjIndexDedupTable {
+ public:
+  explicit ObjIndexDedupTable(size_t expectedVertices);
+
+  /* Returns the index of the pair, or assigns newIndex to it if it is new */
+  uint32_t         insert(uint32_t position, uint32_t texcoord, uint32_t newIndex, bool &inserted);
+
+  size_t           size() const { return count; }
+  size_t           memoryBytes() const { return slots.capacity() * sizeof(Slot); }
+
+ private:
+  struct Slot {
+    uint64_t       key;
+    uint32_t       index;
+  };
+
+  void             grow();
+
+  std::vector<Slot> slots;
+  size_t           mask;
+  size_t           count = 0;
+};
+
+/* Compares std::unordered_map (with the former XOR/shift hash and with
+ * hashVertex()) against VertexDedupTable on a synthetic grid mesh of
+ * gridSize x gridSize quads, printing time and throughput of each one.
+ */
+void benchVertexDedup(unsigned gridSize);